@@ -59,6 +59,12 @@ private:
                 ArrangementWriteTask* arrangementWriteTask = new ArrangementWriteTask();
                 arrangementWriteTask->startFlag = true;
                 arrangementWriteTask->arrangementVersion = arrangementFilterTask->arrangementVersion;
+                arrangementWriteTask->arrangementVersions = arrangementFilterTask->arrangementVersions;
+                arrangementWriteTask->catchUp = arrangementFilterTask->catchUp;
+                arrangementWriteTask->journalVersion = arrangementFilterTask->journalVersion;
+                arrangementVersion = arrangementFilterTask->arrangementVersion;
+                targetVersion = arrangementFilterTask->arrangementVersion + arrangementFilterTask->arrangementVersions;
+                catchUp = arrangementFilterTask->catchUp;
                 GlobalArrangementWritePipelinePtr->addTask(arrangementWriteTask);
                 delete arrangementFilterTask;
                 continue;
@@ -110,24 +116,22 @@ private:
                     }
                 }
 
-                int r = GlobalMetadataManagerPtr->arrangementLookup(blockHeader->fp);
-                if(!r){
-                    ArrangementWriteTask* arrangementWriteTask = new ArrangementWriteTask(
-                            (uint8_t*)blockHeader,
-                            blockHeader->length + sizeof(BlockHeader),
-                            arrangementFilterTask->classId,
-                            arrangementFilterTask->arrangementVersion,
-                            true);
-                    GlobalArrangementWritePipelinePtr->addTask(arrangementWriteTask);
+                // the last version a chunk belongs to decides whether it stays in the active categories of
+                // targetVersion, or which volume it is archived to.
+                uint64_t lastVersion;
+                if(catchUp){
+                    lastVersion = GlobalMetadataManagerPtr->catchUpLookup(blockHeader->fp, arrangementFilterTask->birthVersion);
                 }else{
-                    ArrangementWriteTask* arrangementWriteTask = new ArrangementWriteTask(
-                            (uint8_t*)blockHeader,
-                            blockHeader->length + sizeof(BlockHeader),
-                            arrangementFilterTask->classId,
-                            arrangementFilterTask->arrangementVersion,
-                            false);
-                    GlobalArrangementWritePipelinePtr->addTask(arrangementWriteTask);
+                    lastVersion = GlobalMetadataManagerPtr->arrangementLookup(blockHeader->fp) ? targetVersion : arrangementVersion;
                 }
+                bool isArchived = lastVersion < targetVersion;
+                ArrangementWriteTask* arrangementWriteTask = new ArrangementWriteTask(
+                        (uint8_t*)blockHeader,
+                        blockHeader->length + sizeof(BlockHeader),
+                        arrangementFilterTask->classId,
+                        isArchived ? lastVersion : targetVersion,
+                        isArchived);
+                GlobalArrangementWritePipelinePtr->addTask(arrangementWriteTask);
                 readoffset += sizeof(BlockHeader) + blockHeader->length;
                 parseLeft -= sizeof(BlockHeader) + blockHeader->length;
             }
@@ -142,6 +146,10 @@ private:
     std::list<ArrangementFilterTask*> taskList;
     MutexLock mutexLock;
     Condition condition;
+
+    uint64_t arrangementVersion = 0;
+    uint64_t targetVersion = 0;
+    bool catchUp = false;
 };
 
 static ArrangementFilterPipeline* GlobalArrangementFilterPipelinePtr;
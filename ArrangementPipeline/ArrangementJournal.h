@@ -0,0 +1,175 @@
+//  Copyright (c) Xiangyu Zou, 2020. All rights reserved.
+//  This source code is licensed under the GPLv2
+
+#ifndef MFDEDUP_ARRANGEMENTJOURNAL_H
+#define MFDEDUP_ARRANGEMENTJOURNAL_H
+
+#include <string>
+#include <vector>
+#include "../Utility/FileOperator.h"
+#include "../Utility/xxhash.h"
+
+extern std::string JournalFilePath;
+extern std::string ClassFilePath;
+extern std::string VersionFilePath;
+
+const uint64_t ArrangementJournalMagic = 0x4a52474e41524d46; // "FMRANGRJ"
+
+// Output state of an arrangement after some source categories have been completed.
+struct ArrangementCheckpoint {
+    uint64_t completedClasses = 0;
+    // file position and section lengths of each volume being written.
+    std::vector<uint64_t> volumeOffsets;
+    std::vector<std::vector<uint64_t>> lengths;
+};
+
+// Intent journal of an arrangement. A header identifies the arrangement of versions
+// [arrangementVersion, arrangementVersion + arrangementVersions), started when maxVersion was the last version, and a
+// checkpoint is appended each time a source category is completed and its outputs are durable. Since source
+// categories are kept until the arrangement is committed, an interrupted arrangement resumes from its last checkpoint.
+// Outputs depend on the arranged versions only, as chunks of later versions stay in the categories of the target
+// either way, so that it resumes after versions have been backed up since.
+class ArrangementJournal {
+public:
+    ArrangementJournal(uint64_t version, uint64_t versions, uint64_t max)
+            : arrangementVersion(version), arrangementVersions(versions), maxVersion(max) {
+    }
+
+    ~ArrangementJournal() {
+        delete journalFile;
+    }
+
+    // Loads the last complete checkpoint. Returns false when there is no journal of this arrangement, or its outputs
+    // are incomplete.
+    bool load(ArrangementCheckpoint *checkpoint) {
+        FileOperator fileOperator((char *) JournalFilePath.data(), FileOpenType::Read);
+        if (!fileOperator.ok()) {
+            return false;
+        }
+        uint64_t header[4];
+        if (fileOperator.read((uint8_t *) header, sizeof(header)) != sizeof(header) ||
+            header[0] != ArrangementJournalMagic || header[1] != arrangementVersion ||
+            header[2] != arrangementVersions) {
+            printf("Arrangement journal belongs to another arrangement, discard it\n");
+            return false;
+        }
+
+        std::vector<uint64_t> record(recordLength() + 1);
+        bool found = false;
+        while (fileOperator.read((uint8_t *) record.data(), record.size() * sizeof(uint64_t)) ==
+               record.size() * sizeof(uint64_t)) {
+            if (XXH64(record.data(), recordLength() * sizeof(uint64_t), 0) != record[recordLength()]) {
+                break;
+            }
+            decode(record.data(), checkpoint);
+            found = true;
+        }
+        if (!found || !validate(*checkpoint)) {
+            return false;
+        }
+        if (header[3] != maxVersion) {
+            printf("Arrangement journal was started with %lu versions, %lu exist now\n", header[3], maxVersion);
+        }
+        return true;
+    }
+
+    // Returns how many versions the journaled arrangement from version arranges, 0 when there is none.
+    static uint64_t journaledVersions(uint64_t version) {
+        if (access(JournalFilePath.data(), F_OK) != 0) {
+            return 0;
+        }
+        FileOperator fileOperator((char *) JournalFilePath.data(), FileOpenType::Read);
+        uint64_t header[4];
+        if (!fileOperator.ok() || fileOperator.read((uint8_t *) header, sizeof(header)) != sizeof(header) ||
+            header[0] != ArrangementJournalMagic || header[1] != version) {
+            return 0;
+        }
+        return header[2];
+    }
+
+    // Starts a new journal, or continues the loaded one.
+    int open(bool resume) {
+        journalFile = new FileOperator((char *) JournalFilePath.data(),
+                                       resume ? FileOpenType::Append : FileOpenType::Write);
+        if (!resume) {
+            uint64_t header[4] = {ArrangementJournalMagic, arrangementVersion, arrangementVersions, maxVersion};
+            journalFile->write((uint8_t *) header, sizeof(header));
+            journalFile->fdatasync();
+        }
+        return 0;
+    }
+
+    int append(const ArrangementCheckpoint &checkpoint) {
+        std::vector<uint64_t> record(recordLength() + 1);
+        encode(checkpoint, record.data());
+        record[recordLength()] = XXH64(record.data(), recordLength() * sizeof(uint64_t), 0);
+        journalFile->write((uint8_t *) record.data(), record.size() * sizeof(uint64_t));
+        journalFile->fdatasync();
+        return 0;
+    }
+
+    // called once the arrangement has been committed in manifest.
+    static int clear() {
+        remove(JournalFilePath.data());
+        return 0;
+    }
+
+private:
+    // completedClasses, then offset and section lengths of each volume. Volume of version v has v sections.
+    uint64_t recordLength() {
+        uint64_t length = 1;
+        for (uint64_t v = arrangementVersion; v < arrangementVersion + arrangementVersions; v++) {
+            length += 1 + v;
+        }
+        return length;
+    }
+
+    void encode(const ArrangementCheckpoint &checkpoint, uint64_t *record) {
+        *record++ = checkpoint.completedClasses;
+        for (uint64_t i = 0; i < arrangementVersions; i++) {
+            *record++ = checkpoint.volumeOffsets[i];
+            for (uint64_t j = 0; j < arrangementVersion + i; j++) {
+                *record++ = checkpoint.lengths[i][j];
+            }
+        }
+    }
+
+    void decode(const uint64_t *record, ArrangementCheckpoint *checkpoint) {
+        checkpoint->completedClasses = *record++;
+        checkpoint->volumeOffsets.resize(arrangementVersions);
+        checkpoint->lengths.resize(arrangementVersions);
+        for (uint64_t i = 0; i < arrangementVersions; i++) {
+            checkpoint->volumeOffsets[i] = *record++;
+            checkpoint->lengths[i].assign(record, record + arrangementVersion + i);
+            record += arrangementVersion + i;
+        }
+    }
+
+    bool validate(const ArrangementCheckpoint &checkpoint) {
+        char pathBuffer[256];
+        uint64_t targetVersion = arrangementVersion + arrangementVersions;
+        for (uint64_t i = 0; i < arrangementVersions; i++) {
+            sprintf(pathBuffer, VersionFilePath.data(), arrangementVersion + i);
+            FileOperator volume(pathBuffer, FileOpenType::Read);
+            if (!volume.ok() || FileOperator::size(pathBuffer) < checkpoint.volumeOffsets[i]) {
+                return false;
+            }
+        }
+        uint64_t baseClassId = targetVersion * (targetVersion - 1) / 2 + 1;
+        for (uint64_t i = 0; i < checkpoint.completedClasses; i++) {
+            sprintf(pathBuffer, ClassFilePath.data(), baseClassId + i);
+            FileOperator active(pathBuffer, FileOpenType::Read);
+            if (!active.ok()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    uint64_t arrangementVersion;
+    uint64_t arrangementVersions;
+    uint64_t maxVersion;
+    FileOperator *journalFile = nullptr;
+};
+
+#endif //MFDEDUP_ARRANGEMENTJOURNAL_H
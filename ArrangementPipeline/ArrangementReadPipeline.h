@@ -5,15 +5,19 @@
 #define MFDEDUP_ARRANGEMENTREADPIPELINE_H
 
 #include "ArrangementFilterPipeline.h"
+#include "ArrangementJournal.h"
 #include "../Utility/FileOperator.h"
+#include "../Utility/ChunkIndex.h"
 
 extern std::string LogicFilePath;
 extern std::string ClassFilePath;
 extern std::string VersionFilePath;
+extern std::string ClassFileAppendPath;
 
 class ArrangementReadPipeline{
 public:
     ArrangementReadPipeline(): taskAmount(0), runningFlag(true), mutexLock(), condition(mutexLock){
+        GlobalArrangementIOLimiter.configure(FLAGS_ArrangementBandwidth, FLAGS_ArrangementIOPS);
         worker = new std::thread(std::bind(&ArrangementReadPipeline::arrangementReadCallback, this));
     }
 
@@ -30,12 +34,37 @@ public:
         worker->join();
     }
 
+    // Source categories of an arrangement are removed only after the arrangement has been committed in manifest,
+    // so that an interrupted arrangement leaves the previous layout intact.
+    int removeArrangedCategories(uint64_t arrangementVersion, uint64_t arrangementVersions = 1) {
+        if (arrangementVersion == 0 || arrangementVersions == 0) return 0;
+        char pathbuffer[512];
+        uint64_t startClass = (arrangementVersion - 1) * (arrangementVersion) / 2 + 1;
+        uint64_t endClass = arrangementVersion * (arrangementVersion + 1) / 2;
+        for (uint64_t i = startClass; i <= endClass; i++) {
+            sprintf(pathbuffer, ClassFilePath.data(), i);
+            remove(pathbuffer);
+            ChunkIndex::remove(pathbuffer);
+        }
+        sprintf(pathbuffer, ClassFileAppendPath.data(), startClass);
+        remove(pathbuffer);
+        ChunkIndex::remove(pathbuffer);
+        for (uint64_t i = arrangementVersion + 1; i < arrangementVersion + arrangementVersions; i++) {
+            sprintf(pathbuffer, ClassFilePath.data(), i * (i + 1) / 2);
+            remove(pathbuffer);
+            ChunkIndex::remove(pathbuffer);
+        }
+        return 0;
+    }
+
 
 private:
 
     void arrangementReadCallback() {
         ArrangementTask *arrangementTask;
         readAmount = 0;
+        // arrangement gives way to other I/O
+        setIOPriority(IOPriorityClass::Idle);
 
         while (likely(runningFlag)) {
             {
@@ -51,6 +80,8 @@ private:
             }
 
             uint64_t arrangementVersion = arrangementTask->arrangementVersion;
+            uint64_t arrangementVersions = arrangementTask->arrangementVersions;
+            readAmount = 0;
 
             if (likely(arrangementVersion > 0)) {
 
@@ -60,32 +91,87 @@ private:
                 ArrangementFilterTask* startTask = new ArrangementFilterTask();
                 startTask->startFlag = true;
                 startTask->arrangementVersion = arrangementVersion;
+                startTask->arrangementVersions = arrangementVersions;
+                startTask->catchUp = arrangementTask->catchUp;
+                startTask->journalVersion = arrangementTask->journalVersion;
                 GlobalArrangementFilterPipelinePtr->addTask(startTask);
 
-                readClassWithAppend(startClass, arrangementVersion);
+                // categories completed before an interruption are skipped.
+                uint64_t completedClasses = 0;
+                if (arrangementTask->journalVersion) {
+                    ArrangementJournal arrangementJournal(arrangementVersion, arrangementVersions,
+                                                          arrangementTask->journalVersion);
+                    ArrangementCheckpoint checkpoint;
+                    if (arrangementJournal.load(&checkpoint)) {
+                        completedClasses = checkpoint.completedClasses;
+                    }
+                }
+
+                // categories are loaded in the order of the first version their chunks belong to.
+                if (completedClasses < 1) {
+                    readClassWithAppend(startClass, arrangementVersion, 1);
+                }
                 for (uint64_t i = startClass+1; i <= endClass; i++) {
-                    readClass(i, arrangementVersion);
+                    if (i - startClass + 1 > completedClasses) {
+                        readClass(i, arrangementVersion, i - startClass + 1);
+                    }
+                }
+                // catch-up also loads new categories of the following versions, except the last one, which
+                // is already in place.
+                for (uint64_t i = arrangementVersion + 1; i < arrangementVersion + arrangementVersions; i++) {
+                    if (i > completedClasses) {
+                        readClass(i * (i + 1) / 2, arrangementVersion, i);
+                    }
                 }
 
                 ArrangementFilterTask* arrangementFilterTask = new ArrangementFilterTask(true);
                 arrangementFilterTask->countdownLatch = arrangementTask->countdownLatch;
                 GlobalArrangementFilterPipelinePtr->addTask(arrangementFilterTask);
-                printf("ArrangementReadPipeline finish, with %lu bytes loaded from %lu categories\n", readAmount, endClass - startClass + 1);
+                printf("ArrangementReadPipeline finish, with %lu bytes loaded from %lu categories\n", readAmount,
+                       endClass - startClass + arrangementVersions);
             } else {
                 printf("Do not need arrangement, skip\n");
-                GlobalMetadataManagerPtr->tableRolling();
+                GlobalMetadataManagerPtr->arrangementFinish();
                 arrangementTask->countdownLatch->countDown();
             }
         }
     }
 
-    uint64_t readClass(uint64_t classId, uint64_t versionId){
+    // categories are read once, bypassing the page cache with direct I/O, or otherwise advised as sequential, so that
+    // they do not stay in the page cache. Returns whether reads are direct.
+    bool beginRead(FileOperator &file, const char *path){
+        if(FLAGS_DirectIO && file.setDirect(true) == 0){
+            return true;
+        }
+        file.adviseSequential(0, FileOperator::size(path), FLAGS_ReadAdviceWindow);
+        return false;
+    }
+
+    // reads the next buffer of a file.
+    uint64_t readNext(FileOperator &file, uint8_t **buffer, uint64_t &offset, bool direct){
+        uint64_t readSize;
+        if(direct){
+            *buffer = alignedMalloc(FLAGS_ArrangementReadBufferLength);
+            readSize = file.readAt(*buffer, alignUp(FLAGS_ArrangementReadBufferLength), offset);
+        }else{
+            *buffer = (uint8_t*)malloc(FLAGS_ArrangementReadBufferLength);
+            readSize = file.read(*buffer, FLAGS_ArrangementReadBufferLength);
+            file.advise(offset + readSize);
+        }
+        offset += readSize;
+        return readSize;
+    }
+
+    uint64_t readClass(uint64_t classId, uint64_t versionId, uint64_t birthVersion){
         char pathbuffer[512];
         sprintf(pathbuffer, ClassFilePath.data(), classId);
         FileOperator classFile((char *) pathbuffer, FileOpenType::Read);
+        classFile.setLimiter(&GlobalArrangementIOLimiter);
+        bool direct = beginRead(classFile, pathbuffer);
+        uint64_t offset = 0;
         while(1){
-            uint8_t* buffer = (uint8_t*)malloc(FLAGS_ArrangementReadBufferLength);
-            uint64_t readSize = classFile.read(buffer, FLAGS_ArrangementReadBufferLength);
+            uint8_t* buffer;
+            uint64_t readSize = readNext(classFile, &buffer, offset, direct);
             readAmount += readSize;
             if(readSize == 0) {
                 ArrangementFilterTask* arrangementFilterTask = new ArrangementFilterTask(true, classId);
@@ -94,38 +180,47 @@ private:
                 break;
             }
             ArrangementFilterTask* arrangementFilterTask = new ArrangementFilterTask(buffer, readSize, classId, versionId);
+            arrangementFilterTask->birthVersion = birthVersion;
             GlobalArrangementFilterPipelinePtr->addTask(arrangementFilterTask);
         }
     }
 
-    uint64_t readClassWithAppend(uint64_t classId, uint64_t versionId){
+    uint64_t readClassWithAppend(uint64_t classId, uint64_t versionId, uint64_t birthVersion){
         char pathbuffer[512];
         sprintf(pathbuffer, ClassFilePath.data(), classId);
         FileOperator classFile((char *) pathbuffer, FileOpenType::Read);
+        classFile.setLimiter(&GlobalArrangementIOLimiter);
+        bool direct = beginRead(classFile, pathbuffer);
+        uint64_t offset = 0;
         while(1){
-            uint8_t* buffer = (uint8_t*)malloc(FLAGS_ArrangementReadBufferLength);
-            uint64_t readSize = classFile.read(buffer, FLAGS_ArrangementReadBufferLength);
+            uint8_t* buffer;
+            uint64_t readSize = readNext(classFile, &buffer, offset, direct);
             readAmount += readSize;
             if(readSize == 0) {
                 free(buffer);
                 break;
             }
             ArrangementFilterTask* arrangementFilterTask = new ArrangementFilterTask(buffer, readSize, classId, versionId);
+            arrangementFilterTask->birthVersion = birthVersion;
             GlobalArrangementFilterPipelinePtr->addTask(arrangementFilterTask);
         }
 
         sprintf(pathbuffer, ClassFileAppendPath.data(), classId);
         FileOperator appendFile((char *) pathbuffer, FileOpenType::Read);
+        appendFile.setLimiter(&GlobalArrangementIOLimiter);
         if(appendFile.ok()){
+            direct = beginRead(appendFile, pathbuffer);
+            offset = 0;
             while(1){
-                uint8_t* buffer = (uint8_t*)malloc(FLAGS_ArrangementReadBufferLength);
-                uint64_t readSize = appendFile.read(buffer, FLAGS_ArrangementReadBufferLength);
+                uint8_t* buffer;
+                uint64_t readSize = readNext(appendFile, &buffer, offset, direct);
                 readAmount += readSize;
                 if(readSize == 0) {
                     free(buffer);
                     break;
                 }
                 ArrangementFilterTask* arrangementFilterTask = new ArrangementFilterTask(buffer, readSize, classId, versionId);
+                arrangementFilterTask->birthVersion = birthVersion;
                 GlobalArrangementFilterPipelinePtr->addTask(arrangementFilterTask);
             }
         }
@@ -0,0 +1,221 @@
+//  Copyright (c) Xiangyu Zou, 2020. All rights reserved.
+//  This source code is licensed under the GPLv2
+
+#ifndef MFDEDUP_ARRANGEMENTSCHEDULER_H
+#define MFDEDUP_ARRANGEMENTSCHEDULER_H
+
+#include <string>
+#include <vector>
+#include "gflags/gflags.h"
+#include "../MetadataManager/MetadataManager.h"
+
+DEFINE_string(ArrangementPolicy,
+              "eager", "eager: arrange every version, cost: arrange when the saved restore reads outweigh the arrangement I/O");
+DEFINE_double(ArrangementRestoreWeight,
+              1.0, "expected restores of each version whose arrangement is pending, used by the cost policy");
+DEFINE_uint64(ArrangementMaxFallBehind,
+              8, "the cost policy catches up when arrangement falls behind this many versions, 0 means no limit");
+DEFINE_uint64(ArrangementSampleChunks,
+              65536, "the cost policy counts a sample of about this many chunks of each recipe, 0 means all of them");
+
+extern std::string ClassFilePath;
+extern std::string ClassFileAppendPath;
+extern std::string LogicFilePath;
+extern uint64_t RetentionTime;
+
+// Decides how many of the pending versions are arranged, by comparing the arrangement I/O with the read
+// amplification which restores pay while the layout falls behind.
+//
+// When the OPT layout covers version L, restoring a version t <= L reads exactly its chunks. A version t > L reads all
+// active categories of L and the new categories of L+1 ~ t, so its amplification is
+//     A + N(L+1) + ... + N(t) - U(t),
+// where A is the size of the active categories, N(i) is the size of the new category of version i, and U(t) is the
+// size of chunks of version t. Arranging K versions reads and writes A + N(L+1) + ... + N(L+K-1), after which the
+// active categories hold exactly U(L+K).
+class ArrangementScheduler {
+public:
+    // fallBehind counts every version which is not covered by the layout, including one which has just been backed
+    // up. The index is used instead of recipes when a single version is pending and the tables still describe it.
+    ArrangementScheduler(uint64_t max, uint64_t fallBehind, MetadataManager *metadataManager = nullptr)
+            : maxVersion(max), layoutVersion(max - fallBehind), indexManager(metadataManager) {
+        // arrangement of version 0 is void.
+        if (layoutVersion == 0) {
+            layoutVersion = 1;
+        }
+        pendingVersions = maxVersion > layoutVersion ? maxVersion - layoutVersion : 0;
+    }
+
+    // returns how many versions should be arranged, 0 means deferring the arrangement.
+    uint64_t schedule() {
+        if (pendingVersions == 0) {
+            // arrangement of version 0 is void, and only rolls the index.
+            reason = "nothing to arrange";
+            decision = maxVersion ? 1 : 0;
+            return decision;
+        }
+        if (FLAGS_ArrangementPolicy != "cost") {
+            reason = "eager policy";
+            decision = pendingVersions;
+        } else if (FLAGS_ArrangementMaxFallBehind && pendingVersions >= FLAGS_ArrangementMaxFallBehind) {
+            reason = "falls behind the limit";
+            decision = pendingVersions;
+        } else {
+            estimate();
+            reason = "lowest net cost";
+            decision = 0;
+            for (uint64_t k = 1; k <= pendingVersions; k++) {
+                if (netCost[k] < netCost[decision]) {
+                    decision = k;
+                }
+            }
+            // elimination requires the earliest version to be archived, which is checked one version early so that
+            // the deletion after the next backup is not blocked either.
+            if (maxVersion >= RetentionTime && layoutVersion + decision < 2) {
+                reason = "required by retention";
+                decision = 2 - layoutVersion;
+            }
+        }
+        return decision;
+    }
+
+    void report() {
+        printf("-----------------------Arrangement Schedule-----------------------\n");
+        printf("Layout covers version %lu, %lu versions pending, policy %s\n", layoutVersion, pendingVersions,
+               FLAGS_ArrangementPolicy.data());
+        if (pendingVersions == 0) {
+            printf("Nothing to arrange\n");
+            return;
+        }
+        if (!estimated) {
+            estimate();
+        }
+        printf("Active categories: %lu bytes\n", activeSize);
+        for (uint64_t i = 0; i < pendingVersions; i++) {
+            uint64_t v = layoutVersion + 1 + i;
+            if (indexManager) {
+                printf("Version %lu: new category %lu bytes, amplification %lu bytes\n", v, newSize[i],
+                       amplification(0, v));
+            } else {
+                printf("Version %lu: new category %lu bytes, %lu bytes of chunks, amplification %lu bytes\n", v,
+                       newSize[i], uniqueSize[i + 1], amplification(0, v));
+            }
+        }
+        printf("Batch\tArrangement I/O\tSaved restore reads\tNet cost\n");
+        for (uint64_t k = 0; k <= pendingVersions; k++) {
+            printf("%lu\t%lu\t%lu\t%.0f\n", k, arrangementCost[k], savedReads[k], netCost[k]);
+        }
+        if (decision) {
+            printf("Decision: arrange %lu versions, the layout will cover version %lu, %s\n", decision,
+                   layoutVersion + decision, reason);
+        } else {
+            printf("Decision: defer arrangement, %s\n", reason);
+        }
+    }
+
+private:
+    void estimate() {
+        estimated = true;
+        char pathBuffer[256];
+        uint64_t baseClassId = layoutVersion * (layoutVersion - 1) / 2 + 1;
+        activeSize = 0;
+        for (uint64_t i = 0; i < layoutVersion; i++) {
+            sprintf(pathBuffer, ClassFilePath.data(), baseClassId + i);
+            activeSize += FileOperator::size(pathBuffer);
+        }
+        sprintf(pathBuffer, ClassFileAppendPath.data(), baseClassId);
+        activeSize += FileOperator::size(pathBuffer);
+
+        newSize.clear();
+        for (uint64_t v = layoutVersion + 1; v <= maxVersion; v++) {
+            sprintf(pathBuffer, ClassFilePath.data(), v * (v + 1) / 2);
+            newSize.push_back(FileOperator::size(pathBuffer));
+        }
+
+        uniqueSize.clear();
+        if (pendingVersions == 1 && indexManager) {
+            // dead chunks of the layout version are exactly what the amplification of the latest version reads.
+            deadSize = indexManager->arrangementGetTruncateSize();
+        } else {
+            indexManager = nullptr;
+            for (uint64_t v = layoutVersion; v <= maxVersion; v++) {
+                uniqueSize.push_back(recipeSize(v));
+            }
+        }
+
+        arrangementCost.assign(pendingVersions + 1, 0);
+        savedReads.assign(pendingVersions + 1, 0);
+        netCost.assign(pendingVersions + 1, 0);
+        uint64_t sourceSize = activeSize;
+        for (uint64_t k = 1; k <= pendingVersions; k++) {
+            arrangementCost[k] = 2 * sourceSize;
+            sourceSize += newSize[k - 1];
+            for (uint64_t v = layoutVersion + 1; v <= maxVersion; v++) {
+                uint64_t before = amplification(0, v), after = amplification(k, v);
+                savedReads[k] += before > after ? before - after : 0;
+            }
+            netCost[k] = (double) arrangementCost[k] - FLAGS_ArrangementRestoreWeight * (double) savedReads[k];
+        }
+    }
+
+    // read amplification of restoring version v after arranging k pending versions.
+    uint64_t amplification(uint64_t k, uint64_t v) {
+        if (v <= layoutVersion + k) {
+            return 0;
+        }
+        if (indexManager) {
+            return deadSize;
+        }
+        uint64_t readSize = k ? uniqueSize[k] : activeSize;
+        for (uint64_t i = layoutVersion + k + 1; i <= v; i++) {
+            readSize += newSize[i - layoutVersion - 1];
+        }
+        uint64_t targetSize = uniqueSize[v - layoutVersion];
+        return readSize > targetSize ? readSize - targetSize : 0;
+    }
+
+    // stored size of the chunks which a version refers to. Fingerprints are uniform, so that 1 in a power of 2 of
+    // them is counted in a large recipe and scaled up, which bounds the table of each version.
+    uint64_t recipeSize(uint64_t version) {
+        RecipeReader recipe(version);
+        if (!recipe.ok()) {
+            return 0;
+        }
+        std::unordered_set<SHA1FP, TupleHasher, TupleEqualer> fpTable;
+        uint64_t sampleRate = 1;
+        while (FLAGS_ArrangementSampleChunks && recipe.getCount() / sampleRate > FLAGS_ArrangementSampleChunks) {
+            sampleRate *= 2;
+        }
+        uint64_t size = 0;
+        const uint64_t batch = 4096;
+        BlockHeader *blockHeaders = (BlockHeader *) malloc(batch * sizeof(BlockHeader));
+        uint64_t readSize;
+        while ((readSize = recipe.next(blockHeaders, batch)) > 0) {
+            for (uint64_t i = 0; i < readSize; i++) {
+                if (blockHeaders[i].fp.fp1 % sampleRate == 0 && fpTable.insert(blockHeaders[i].fp).second) {
+                    size += sizeof(BlockHeader) + blockHeaders[i].length;
+                }
+            }
+        }
+        free(blockHeaders);
+        return size * sampleRate;
+    }
+
+    uint64_t maxVersion;
+    uint64_t layoutVersion;
+    uint64_t pendingVersions;
+    MetadataManager *indexManager;
+
+    uint64_t activeSize = 0;
+    uint64_t deadSize = 0;
+    std::vector<uint64_t> newSize;
+    std::vector<uint64_t> uniqueSize;
+    std::vector<uint64_t> arrangementCost;
+    std::vector<uint64_t> savedReads;
+    std::vector<double> netCost;
+
+    bool estimated = false;
+    uint64_t decision = 0;
+    const char *reason = "";
+};
+
+#endif //MFDEDUP_ARRANGEMENTSCHEDULER_H
@@ -10,9 +10,12 @@
 #include "../Utility/Likely.h"
 #include <thread>
 #include <functional>
+#include <vector>
 #include <sys/time.h>
 #include "gflags/gflags.h"
 #include "../Utility/BufferedFileWriter.h"
+#include "../Utility/ChunkIndex.h"
+#include "ArrangementJournal.h"
 
 DEFINE_uint64(ArrangementFlushBufferLength,
               8388608, "ArrangementFlushBufferLength");
@@ -40,11 +43,11 @@ private:
     void arrangementWriteCallback(){
         ArrangementWriteTask* arrangementWriteTask;
         char pathBuffer[256];
-        uint64_t* length;
-        uint64_t currentVersion = 0;
+        uint64_t arrangementVersion = 0;
+        uint64_t targetVersion = 0;
         uint64_t classIter = 0;
-        uint64_t classCounter =0 ;
         uint64_t baseClassId = 0;
+        setIOPriority(IOPriorityClass::Idle);
 
         while (likely(runningFlag)) {
             {
@@ -60,78 +63,161 @@ private:
             }
 
             if(arrangementWriteTask->startFlag){
-                VolumeFileHeader versionFileHeader = {
-                        .offsetCount = arrangementWriteTask->arrangementVersion
-                };
-                length = (uint64_t*)malloc(sizeof(uint64_t)*versionFileHeader.offsetCount);
-                currentVersion = arrangementWriteTask->arrangementVersion;
+                arrangementVersion = arrangementWriteTask->arrangementVersion;
+                targetVersion = arrangementVersion + arrangementWriteTask->arrangementVersions;
                 classIter = 0;
-                classCounter = 0;
-                baseClassId = (currentVersion+1)*(currentVersion)/2+1;
-
-                sprintf(pathBuffer, VersionFilePath.data(), arrangementWriteTask->arrangementVersion);
-                archivedFileOperator = new FileOperator(pathBuffer, FileOpenType::Write);
-                archivedFileOperator->trunc(GlobalMetadataManagerPtr->arrangementGetTruncateSize() + (arrangementWriteTask->arrangementVersion+1)*sizeof(uint64_t));
-                archivedFileOperator->seek(0);
-                archivedFileOperator->write((uint8_t*)&versionFileHeader, sizeof(uint64_t));
-                archivedFileOperator->seek(sizeof(VolumeFileHeader) + sizeof(uint64_t) * versionFileHeader.offsetCount);
-                archivedFileWriter = new BufferedFileWriter(archivedFileOperator, FLAGS_ArrangementFlushBufferLength, 4);
-
-                sprintf(pathBuffer, ClassFilePath.data(), baseClassId);
-                activeFileOperator = new FileOperator(pathBuffer, FileOpenType::Write);
-                activeFileWriter = new BufferedFileWriter(activeFileOperator, FLAGS_ArrangementFlushBufferLength, 4);
+                baseClassId = targetVersion*(targetVersion-1)/2+1;
+
+                ArrangementCheckpoint checkpoint;
+                bool resume = false;
+                if(arrangementWriteTask->journalVersion){
+                    arrangementJournal = new ArrangementJournal(arrangementVersion,
+                                                                arrangementWriteTask->arrangementVersions,
+                                                                arrangementWriteTask->journalVersion);
+                    resume = arrangementJournal->load(&checkpoint);
+                    arrangementJournal->open(resume);
+                    if(resume){
+                        classIter = checkpoint.completedClasses;
+                        printf("Resume arrangement from category %lu\n", classIter);
+                    }
+                }
+
+                // one volume for each arranged version, volume v holds chunks whose last version is v.
+                for(uint64_t v = arrangementVersion; v < targetVersion; v++){
+                    ArchivedVolume archivedVolume;
+                    VolumeFileHeader versionFileHeader = {
+                            .offsetCount = v
+                    };
+                    archivedVolume.length = (uint64_t*)malloc(sizeof(uint64_t)*versionFileHeader.offsetCount);
+                    memset(archivedVolume.length, 0, sizeof(uint64_t)*versionFileHeader.offsetCount);
+                    archivedVolume.classCounter = 0;
+
+                    sprintf(pathBuffer, VersionFilePath.data(), v);
+                    archivedVolume.path = pathBuffer;
+                    archivedVolume.chunkIndex = new ChunkIndex();
+                    if(resume){
+                        // drop what has been written after the checkpoint
+                        uint64_t i = v - arrangementVersion;
+                        memcpy(archivedVolume.length, checkpoint.lengths[i].data(), sizeof(uint64_t)*versionFileHeader.offsetCount);
+                        archivedVolume.fileOperator = new FileOperator(pathBuffer, FileOpenType::ReadWrite);
+                        archivedVolume.fileOperator->trunc(checkpoint.volumeOffsets[i]);
+                        archivedVolume.fileOperator->seek(checkpoint.volumeOffsets[i]);
+                        archivedVolume.chunkIndex->scan(pathBuffer, volumeBegin(v), checkpoint.volumeOffsets[i]);
+                    }else{
+                        archivedVolume.fileOperator = new FileOperator(pathBuffer, FileOpenType::Write);
+                        if(!arrangementWriteTask->catchUp){
+                            archivedVolume.fileOperator->preallocate(0, GlobalMetadataManagerPtr->arrangementGetTruncateSize() + (v+1)*sizeof(uint64_t));
+                        }
+                        archivedVolume.fileOperator->seek(0);
+                        archivedVolume.fileOperator->write((uint8_t*)&versionFileHeader, sizeof(uint64_t));
+                        archivedVolume.fileOperator->seek(sizeof(VolumeFileHeader) + sizeof(uint64_t) * versionFileHeader.offsetCount);
+                    }
+                    archivedVolume.fileOperator->setLimiter(&GlobalArrangementIOLimiter);
+                    archivedVolume.fileWriter = new BufferedFileWriter(archivedVolume.fileOperator, FLAGS_ArrangementFlushBufferLength, FLAGS_DirectIO);
+                    archivedVolumes.push_back(archivedVolume);
+                }
+
+                if(classIter < targetVersion - 1){
+                    openActiveClass(baseClassId+classIter);
+                }
+                delete arrangementWriteTask;
+                continue;
             }
 
             if(arrangementWriteTask->classEndFlag){
-                length[classIter] = classCounter;
+                for(uint64_t i = 0; i < archivedVolumes.size(); i++){
+                    // volume of version v has v sections
+                    if(classIter < arrangementVersion + i){
+                        archivedVolumes[i].length[classIter] = archivedVolumes[i].classCounter;
+                    }
+                    archivedVolumes[i].classCounter = 0;
+                }
                 classIter++;
-                classCounter = 0;
-
-                sprintf(pathBuffer, ClassFilePath.data(), arrangementWriteTask->beforeClassId);
-                remove(pathBuffer);
 
+                // source categories are kept until the arrangement has been committed, see removeArrangedCategories().
                 delete arrangementWriteTask;
                 delete activeFileWriter;
+                activeChunkIndex.save(activeFileOperator, activePath, 0);
                 delete activeFileOperator;
+                activeFileWriter = nullptr;
+                activeFileOperator = nullptr;
+
+                if(arrangementJournal){
+                    // outputs of the category are durable before it is checkpointed.
+                    ArrangementCheckpoint checkpoint;
+                    checkpoint.completedClasses = classIter;
+                    for(uint64_t i = 0; i < archivedVolumes.size(); i++){
+                        archivedVolumes[i].fileWriter->sync();
+                        checkpoint.volumeOffsets.push_back(archivedVolumes[i].fileWriter->tell());
+                        checkpoint.lengths.emplace_back(archivedVolumes[i].length, archivedVolumes[i].length + arrangementVersion + i);
+                    }
+                    arrangementJournal->append(checkpoint);
+                }
 
-                if(classIter < currentVersion){
-                    sprintf(pathBuffer, ClassFilePath.data(), baseClassId+classIter);
-                    activeFileOperator = new FileOperator(pathBuffer, FileOpenType::Write);
-                    activeFileWriter = new BufferedFileWriter(activeFileOperator, FLAGS_ArrangementFlushBufferLength, 4);
+                if(classIter < targetVersion - 1){
+                    openActiveClass(baseClassId+classIter);
                 }
                 continue;
             }
 
             if(arrangementWriteTask->finalEndFlag){
-                delete archivedFileWriter;
-                archivedFileWriter = nullptr;
-
-                archivedFileOperator->seek(sizeof(VolumeFileHeader));
-                archivedFileOperator->write((uint8_t *) length, sizeof(uint64_t) * currentVersion);
-
-                archivedFileOperator->fdatasync();
-                delete archivedFileOperator;
-                archivedFileOperator = nullptr;
-
-                free(length);
-                currentVersion = -1;
+                uint64_t v = arrangementVersion;
+                for(auto& archivedVolume : archivedVolumes){
+                    delete archivedVolume.fileWriter;
+
+                    archivedVolume.fileOperator->seek(sizeof(VolumeFileHeader));
+                    archivedVolume.fileOperator->write((uint8_t *) archivedVolume.length, sizeof(uint64_t) * v);
+
+                    GlobalDurability.completed(archivedVolume.fileOperator);
+                    archivedVolume.chunkIndex->save(archivedVolume.fileOperator, archivedVolume.path, volumeBegin(v));
+                    delete archivedVolume.chunkIndex;
+                    delete archivedVolume.fileOperator;
+                    free(archivedVolume.length);
+                    v++;
+                }
+                archivedVolumes.clear();
+                arrangementVersion = -1;
+                // the journal is cleared once the arrangement is committed.
+                delete arrangementJournal;
+                arrangementJournal = nullptr;
 
-                GlobalMetadataManagerPtr->tableRolling();
+                GlobalMetadataManagerPtr->arrangementFinish();
                 arrangementWriteTask->countdownLatch->countDown();
                 delete arrangementWriteTask;
                 printf("ArrangementWritePipeline finish\n");
                 continue;
             }
 
+            // each task is a chunk with its header.
+            SHA1FP &fp = ((BlockHeader *) arrangementWriteTask->writeBuffer)->fp;
             if(arrangementWriteTask->isArchived){
-                archivedFileWriter->write(arrangementWriteTask->writeBuffer, arrangementWriteTask->length);
-                classCounter += arrangementWriteTask->length;
+                ArchivedVolume& archivedVolume = archivedVolumes[arrangementWriteTask->arrangementVersion - arrangementVersion];
+                archivedVolume.chunkIndex->add(fp, archivedVolume.fileWriter->tell(), arrangementWriteTask->length);
+                archivedVolume.fileWriter->write(arrangementWriteTask->writeBuffer, arrangementWriteTask->length);
+                archivedVolume.classCounter += arrangementWriteTask->length;
             }else{
+                activeChunkIndex.add(fp, activeFileWriter->tell(), arrangementWriteTask->length);
                 activeFileWriter->write(arrangementWriteTask->writeBuffer, arrangementWriteTask->length);
             }
+            delete arrangementWriteTask;
         }
     }
 
+    void openActiveClass(uint64_t classId){
+        char pathBuffer[256];
+        sprintf(pathBuffer, ClassFilePath.data(), classId);
+        activePath = pathBuffer;
+        activeChunkIndex = ChunkIndex();
+        activeFileOperator = new FileOperator(pathBuffer, FileOpenType::Write);
+        activeFileOperator->setLimiter(&GlobalArrangementIOLimiter);
+        activeFileWriter = new BufferedFileWriter(activeFileOperator, FLAGS_ArrangementFlushBufferLength, FLAGS_DirectIO);
+    }
+
+    // chunks of a volume follow its header and the section lengths.
+    static uint64_t volumeBegin(uint64_t version){
+        return sizeof(VolumeFileHeader) + sizeof(uint64_t) * version;
+    }
+
     bool runningFlag;
     std::thread *worker;
     uint64_t taskAmount;
@@ -139,13 +225,21 @@ private:
     MutexLock mutexLock;
     Condition condition;
 
-    FileOperator* archivedFileOperator = nullptr;
-//    FileOperator* activeFileOperator = nullptr;
-    BufferedFileWriter* archivedFileWriter = nullptr;
-//    BufferedFileWriter* activeFileWriter = nullptr;
+    struct ArchivedVolume {
+        FileOperator* fileOperator;
+        BufferedFileWriter* fileWriter;
+        uint64_t* length;
+        uint64_t classCounter;
+        std::string path;
+        ChunkIndex* chunkIndex;
+    };
+    std::vector<ArchivedVolume> archivedVolumes;
+    ArrangementJournal* arrangementJournal = nullptr;
 
     FileOperator* activeFileOperator = nullptr;
     BufferedFileWriter* activeFileWriter = nullptr;
+    std::string activePath;
+    ChunkIndex activeChunkIndex;
 };
 
 static ArrangementWritePipeline* GlobalArrangementWritePipelinePtr;
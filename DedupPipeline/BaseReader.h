@@ -0,0 +1,94 @@
+//  Copyright (c) Xiangyu Zou, 2020. All rights reserved.
+//  This source code is licensed under the GPLv2
+
+#ifndef MFDEDUP_BASEREADER_H
+#define MFDEDUP_BASEREADER_H
+
+#include <unordered_map>
+#include "../RestorePipeline/RestorePlanner.h"
+#include "../Utility/ChunkCompressor.h"
+
+// Reads bases of delta chunks of a new version, which are chunks of the previous version. They are found by the chunk
+// indexes of the files which the previous version is restored from, which are planned on the first read. Reads come
+// from the threads of the compression pool.
+class BaseReader {
+public:
+    BaseReader(uint64_t previousVersion, uint64_t fallBehind) : version(previousVersion), layoutFallBehind(fallBehind) {
+    }
+
+    ~BaseReader() {
+        for (auto file : files) {
+            delete file;
+        }
+    }
+
+    // reads the chunk into buffer, returns false when it is not found or is a delta itself.
+    bool read(const SHA1FP &sha1Fp, std::vector<uint8_t> &buffer) {
+        {
+            MutexLockGuard mutexLockGuard(mutexLock);
+            if (!planned) {
+                plan();
+            }
+        }
+        auto iter = locations.find(sha1Fp);
+        if (iter == locations.end()) {
+            return false;
+        }
+        const Location &location = iter->second;
+        std::vector<uint8_t> stored(location.length);
+        if (files[location.file]->readAt(stored.data(), location.length, location.offset) != location.length) {
+            return false;
+        }
+        BlockHeader *blockHeader = (BlockHeader *) stored.data();
+        if (!TupleEqualer()(blockHeader->fp, sha1Fp) ||
+            sizeof(BlockHeader) + blockHeader->length != location.length) {
+            return false;
+        }
+        const uint8_t *chunk = ChunkCompressor::decode(blockHeader, stored.data() + sizeof(BlockHeader), buffer);
+        if (!chunk) {
+            return false;
+        }
+        if (chunk != buffer.data()) {
+            buffer.assign(chunk, chunk + blockHeader->length);
+        }
+        return true;
+    }
+
+private:
+    struct Location {
+        uint64_t file;
+        uint64_t offset;
+        uint64_t length;
+    };
+
+    void plan() {
+        planned = true;
+        RestoreTask restoreTask = {version, version, layoutFallBehind, {}};
+        RestorePlanner restorePlanner;
+        restorePlanner.planFiles(&restoreTask);
+        std::vector<ReadExtent> extents;
+        restorePlanner.planExtents(extents);
+        for (auto &extent : extents) {
+            ChunkIndex chunkIndex;
+            if (chunkIndex.load(extent.path, extent.offset) != 0) {
+                continue;
+            }
+            files.push_back(new FileOperator((char *) extent.path.data(), FileOpenType::Read));
+            for (auto &entry : chunkIndex.getEntries()) {
+                if (entry.offset + entry.length > extent.offset + extent.length) break;
+                locations[entry.fp] = {files.size() - 1, entry.offset, entry.length};
+            }
+        }
+        printf("Bases of deltas are read from %lu chunks in %lu files of version %lu\n", locations.size(),
+               files.size(), version);
+    }
+
+    uint64_t version;
+    uint64_t layoutFallBehind;
+    bool planned = false;
+    std::vector<FileOperator *> files;
+    std::unordered_map<SHA1FP, Location, TupleHasher, TupleEqualer> locations;
+    MutexLock mutexLock;
+};
+
+#endif //MFDEDUP_BASEREADER_H
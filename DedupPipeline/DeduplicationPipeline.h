@@ -38,6 +38,9 @@ public:
     void getStatistics() {
         printf("Deduplicating Duration : %lu\n", duration);
         printf("new:%lu, iv:%lu, nv:%lu, it:%lu\n", chunkCounter[0], chunkCounter[1], chunkCounter[2], chunkCounter[3]);
+        if (FLAGS_Resemblance) {
+            printf("Resembling chunks : %lu of %lu new chunks\n", resemblingChunks, chunkCounter[0]);
+        }
         printf("Total Length : %lu, Unique Length : %lu, Adjacent duplicates : %lu, Dedup Ratio : %f\n", totalLength, afterDedupLength, adjacentDuplicates,
                (float) totalLength / afterDedupLength);
     }
@@ -69,6 +72,7 @@ private:
                 for (int i = 0; i < 4; i++) {
                     chunkCounter[i] = 0;
                 }
+                resemblingChunks = 0;
                 newVersionFlag = false;
                 duration = 0;
             }
@@ -90,6 +94,7 @@ private:
                 writeTask.bufferLength = dedupTask.length;
                 writeTask.sha1Fp = dedupTask.fp;
                 writeTask.oldClass = oldClass;
+                writeTask.hasBase = false;
 
                 totalLength += dedupTask.length;
 
@@ -97,15 +102,32 @@ private:
                     case LookupResult::Unique:
                         GlobalMetadataManagerPtr->newChunkAddRecord(writeTask.sha1Fp);
                         afterDedupLength += dedupTask.length;
+                        if (FLAGS_Resemblance) {
+                            writeTask.hasBase = GlobalMetadataManagerPtr->resemblanceLookup(
+                                    writeTask.sha1Fp, dedupTask.superFeatures, &writeTask.baseFp);
+                            if (writeTask.hasBase) {
+                                GlobalMetadataManagerPtr->deltaAddRecord(writeTask.sha1Fp, writeTask.baseFp);
+                                resemblingChunks++;
+                            }
+                        }
                         break;
                         
                     case LookupResult::InternalDedup:
+                        writeTask.hasBase = GlobalMetadataManagerPtr->deltaLookup(writeTask.sha1Fp,
+                                                                                  &writeTask.baseFp);
                         break;
                     case LookupResult::AdjacentDedup:
                         adjacentDuplicates += dedupTask.length;
                         GlobalMetadataManagerPtr->neighborAddRecord(writeTask.sha1Fp);
+                        // deltas of earlier runs keep their bases whether or not resemblance is enabled.
+                        writeTask.hasBase = GlobalMetadataManagerPtr->deltaInherit(writeTask.sha1Fp,
+                                                                                   &writeTask.baseFp);
                         break;
                 }
+                // chunks stored as they are may be bases of the next version.
+                if (FLAGS_Resemblance && lookupResult != LookupResult::InternalDedup && !writeTask.hasBase) {
+                    GlobalMetadataManagerPtr->resemblanceAddRecord(writeTask.sha1Fp, dedupTask.superFeatures);
+                }
 
                 gettimeofday(&t1, NULL);
                 duration += (t1.tv_sec - t0.tv_sec) * 1000000 + t1.tv_usec - t0.tv_usec;
@@ -144,6 +166,7 @@ private:
     uint64_t adjacentDuplicates = 0;
 
     uint64_t chunkCounter[4] = {0, 0, 0, 0};
+    uint64_t resemblingChunks = 0;
 
     uint64_t duration = 0;
 
@@ -4,6 +4,8 @@
 #ifndef MFDEDUP_ELIMINATOR_H
 #define MFDEDUP_ELIMINATOR_H
 
+#include "RecipeWriter.h"
+
 DEFINE_uint64(EliminateReadBuffer,
 67108864, "Read buffer size for eliminating old version");
 
@@ -18,35 +20,84 @@ public:
 
     }
 
-    int run(uint64_t maxVersion) {
+    int run(uint64_t maxVersion, uint64_t fallBehind = 0) {
+        // versions after layoutVersion have not been arranged, and only own their new categories.
+        uint64_t layoutVersion = maxVersion - fallBehind;
+        if (layoutVersion < 2) {
+            printf("only %lu versions have been arranged, the earliest version can not be eliminated\n", layoutVersion);
+            return -1;
+        }
         printf("start to eliminate\n");
-        uint64_t startClass = (maxVersion - 1) * maxVersion / 2 + 1;
-        uint64_t endClass = (maxVersion + 1) * maxVersion / 2;
+        // elimination mostly renames files, each rename is charged as one operation.
+        GlobalEliminationIOLimiter.configure(FLAGS_EliminationBandwidth, FLAGS_EliminationIOPS);
+        int priority = setIOPriority(IOPriorityClass::Idle);
+        uint64_t startClass = (layoutVersion - 1) * layoutVersion / 2 + 1;
+        uint64_t endClass = (layoutVersion + 1) * layoutVersion / 2;
 
         printf("processing categories files\n");
-        classFileCombinationProcessor(startClass, startClass + 1, maxVersion);
+        classFileCombinationProcessor(startClass, startClass + 1, layoutVersion);
         for (uint64_t i = startClass + 2; i <= endClass; i++) {
-            classFileProcessor(i, maxVersion);
+            classFileProcessor(i, layoutVersion);
+        }
+        for (uint64_t i = layoutVersion + 1; i <= maxVersion; i++) {
+            newClassFileProcessor(i);
         }
 
         printf("processing volume files\n");
-        for (uint64_t i = 2; i <= maxVersion - 1; i++) {
+        for (uint64_t i = 2; i <= layoutVersion - 1; i++) {
             versionFileProcessor(i);
         }
 
         printf("processing recipe files\n");
+        recipeDetach(2);
         for (uint64_t i = 2; i <= maxVersion; i++) {
             recipeFilesProcessor(i);
         }
+        restoreIOPriority(priority);
         printf("finish,  the earliest version has been eliminated\n");
+        return 0;
     }
 
 private:
+    // the recipe of the second version may refer to that of the eliminated one, and is rewritten without references.
+    // It replaces a committed recipe, so it is synced before the rename.
+    int recipeDetach(uint64_t recipeId) {
+        sprintf(oldPath, LogicFilePath.data(), recipeId);
+        std::string writingPath = std::string(oldPath) + ".writing";
+        {
+            RecipeReader recipe(recipeId);
+            if (!recipe.ok() || !recipe.getDepth()) {
+                return 0;
+            }
+            FileOperator fileOperator((char *) writingPath.data(), FileOpenType::Write);
+            fileOperator.setLimiter(&GlobalEliminationIOLimiter);
+            {
+                BufferedFileWriter bufferedFileWriter(&fileOperator, FLAGS_RecipeFlushBufferSize);
+                RecipeWriter recipeWriter(&bufferedFileWriter, recipeId, false);
+                const uint64_t batch = 4096;
+                std::vector<BlockHeader> blockHeaders(batch);
+                uint64_t readCount;
+                while ((readCount = recipe.next(blockHeaders.data(), batch)) > 0) {
+                    for (uint64_t i = 0; i < readCount; i++) {
+                        recipeWriter.add(blockHeaders[i]);
+                    }
+                }
+                recipeWriter.finish();
+            }
+            fileOperator.fdatasync();
+        }
+        GlobalEliminationIOLimiter.acquire(0);
+        rename(writingPath.data(), oldPath);
+        return 0;
+    }
+
     int recipeFilesProcessor(uint64_t recipeId) {
         // rolling back serial number of recipes
         sprintf(oldPath, LogicFilePath.data(), recipeId);
         sprintf(newPath, LogicFilePath.data(), recipeId - 1);
+        GlobalEliminationIOLimiter.acquire(0);
         rename(oldPath, newPath);
+        DeltaReferences::rename(oldPath, newPath);
 
         return 0;
     }
@@ -56,11 +107,16 @@ private:
         sprintf(oldPath, VersionFilePath.data(), versionId);
         sprintf(newPath, VersionFilePath.data(), versionId - 1);
         FileOperator fileOperator(oldPath, FileOpenType::ReadWrite);
+        fileOperator.setLimiter(&GlobalEliminationIOLimiter);
 
         VolumeFileHeader versionFileHeader;
         fileOperator.read((uint8_t * ) & versionFileHeader, sizeof(VolumeFileHeader));
         uint64_t *offset = (uint64_t *) malloc(versionFileHeader.offsetCount * sizeof(uint64_t));
         fileOperator.read((uint8_t *) offset, versionFileHeader.offsetCount * sizeof(uint64_t));
+        // chunks stay where they are, only the sidecar is saved again for the rewritten header.
+        uint64_t begin = sizeof(VolumeFileHeader) + versionFileHeader.offsetCount * sizeof(uint64_t);
+        ChunkIndex chunkIndex;
+        bool indexed = chunkIndex.load(oldPath, begin, false) == 0;
         offset[0] += offset[1];
         for (int i = 1; i < versionFileHeader.offsetCount - 1; i++) {
             offset[i] = offset[i + 1];
@@ -68,8 +124,15 @@ private:
         offset[versionFileHeader.offsetCount - 1] = -1;
         fileOperator.seek(sizeof(VolumeFileHeader));
         fileOperator.write((uint8_t *) offset, versionFileHeader.offsetCount * sizeof(uint64_t));
+        free(offset);
+        if (indexed) {
+            GlobalDurability.completed(&fileOperator);
+            chunkIndex.save(&fileOperator, oldPath, begin);
+        }
 
+        GlobalEliminationIOLimiter.acquire(0);
         rename(oldPath, newPath);
+        ChunkIndex::rename(oldPath, newPath);
 
         return 0;
     }
@@ -78,7 +141,19 @@ private:
         // rolling back serial number of categories
         sprintf(oldPath, ClassFilePath.data(), classId);
         sprintf(newPath, ClassFilePath.data(), classId - maxVersion);
+        GlobalEliminationIOLimiter.acquire(0);
+        rename(oldPath, newPath);
+        ChunkIndex::rename(oldPath, newPath);
+        return 0;
+    }
+
+    int newClassFileProcessor(uint64_t versionId) {
+        // rolling back serial number of the new category of a version which has not been arranged
+        sprintf(oldPath, ClassFilePath.data(), versionId * (versionId + 1) / 2);
+        sprintf(newPath, ClassFilePath.data(), (versionId - 1) * versionId / 2);
+        GlobalEliminationIOLimiter.acquire(0);
         rename(oldPath, newPath);
+        ChunkIndex::rename(oldPath, newPath);
         return 0;
     }
 
@@ -87,11 +162,15 @@ private:
         // append first two active categories.
         sprintf(oldPath, ClassFilePath.data(), classId1);
         sprintf(newPath, ClassFilePath.data(), classId1 - (maxVersion-1));
+        GlobalEliminationIOLimiter.acquire(0);
         rename(oldPath, newPath);
+        ChunkIndex::rename(oldPath, newPath);
 
         sprintf(oldPath, ClassFilePath.data(), classId2);
         sprintf(newPath, ClassFileAppendPath.data(), classId1 - (maxVersion-1));
+        GlobalEliminationIOLimiter.acquire(0);
         rename(oldPath, newPath);
+        ChunkIndex::rename(oldPath, newPath);
 
         return 0;
     }
@@ -71,6 +71,11 @@ private:
                 mh_sha1_update_avx2(&ctx, dedupTask.buffer + dedupTask.pos, (uint32_t) dedupTask.length);
                 mh_sha1_finalize_avx2(&ctx, &dedupTask.fp);
 
+                if (FLAGS_Resemblance) {
+                    resemblance.superFeatures(dedupTask.buffer + dedupTask.pos, dedupTask.length,
+                                              dedupTask.superFeatures);
+                }
+
                 if (dedupTask.countdownLatch) {
                     printf("HashingPipeline finish\n");
                     dedupTask.countdownLatch->countDown();
@@ -93,6 +98,7 @@ private:
     MutexLock mutexLock;
     Condition condition;
     uint64_t duration = 0;
+    Resemblance resemblance;
 
     bool newVersion = true;
 };
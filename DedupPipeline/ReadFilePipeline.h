@@ -66,9 +66,13 @@ private:
             chunkTask.buffer = storageTask->buffer;
             chunkTask.length = storageTask->length;
 
+            // the input is read once, into memory.
+            fileOperator.adviseSequential(0, storageTask->length, FLAGS_ReadAdviceWindow);
+
             gettimeofday(&t0, NULL);
             while (readOnce = fileOperator.read(storageTask->buffer + readOffset, ReadPipelineReadBlockSize)) {
                 readOffset += readOnce;
+                fileOperator.advise(readOffset);
                 chunkTask.end = readOffset;
                 if (readOnce < ReadPipelineReadBlockSize) {
                     chunkTask.countdownLatch = cd;
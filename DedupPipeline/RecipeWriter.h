@@ -0,0 +1,144 @@
+//  Copyright (c) Xiangyu Zou, 2020. All rights reserved.
+//  This source code is licensed under the GPLv2
+
+#ifndef MFDEDUP_RECIPEWRITER_H
+#define MFDEDUP_RECIPEWRITER_H
+
+#include <unordered_map>
+#include "gflags/gflags.h"
+#include "../MetadataManager/MetadataManager.h"
+#include "../Utility/BufferedFileWriter.h"
+#include "../Utility/RecipeReader.h"
+
+// compact recipes are not read by versions before them, so that they are enabled by the user.
+DEFINE_bool(CompactRecipe,
+            false, "write recipes as runs referring to the recipe of the previous version, and literal runs");
+
+DEFINE_uint64(RecipeSeekInterval,
+              1024, "entries between seek points of compact recipes");
+
+DEFINE_uint64(RecipeChainLength,
+              8, "recipes a compact recipe may refer to through the previous ones, beyond which it refers to none");
+
+// Writes a recipe through a buffered writer, which is complete once finish() returns. Chunks are looked up in the
+// recipe of the previous version, and runs of them which follow each other there are written as references.
+class RecipeWriter {
+public:
+    RecipeWriter(BufferedFileWriter *writer, uint64_t version, bool refer = true) : bufferedFileWriter(writer),
+                                                                                    compact(FLAGS_CompactRecipe) {
+        seekInterval = std::max(FLAGS_RecipeSeekInterval, (uint64_t) 1);
+        if (!compact || !refer || version <= 1) {
+            return;
+        }
+        RecipeReader previousRecipe(version - 1);
+        if (!previousRecipe.ok() || previousRecipe.getDepth() + 1 > FLAGS_RecipeChainLength) {
+            return;
+        }
+        depth = previousRecipe.getDepth() + 1;
+        previousFps.resize(previousRecipe.getCount());
+        const uint64_t batch = 4096;
+        std::vector<BlockHeader> blockHeaders(batch);
+        uint64_t readCount, index = 0;
+        while ((readCount = previousRecipe.next(blockHeaders.data(), batch)) > 0) {
+            for (uint64_t i = 0; i < readCount; i++, index++) {
+                previousFps[index] = blockHeaders[i].fp;
+                previousIndex.emplace(blockHeaders[i].fp, index);
+            }
+        }
+        previousFps.resize(index);
+    }
+
+    int add(const BlockHeader &blockHeader) {
+        if (!compact) {
+            return bufferedFileWriter->write((uint8_t *) &blockHeader, sizeof(BlockHeader));
+        }
+        if (entryCount % seekInterval == 0) {
+            flushRun();
+            seekPoints.push_back({offset, referenceEnd});
+        }
+        entryCount++;
+        totalLength += blockHeader.length;
+        if (referenceCount && referenceStart + referenceCount < previousFps.size() &&
+            TupleEqualer()(previousFps[referenceStart + referenceCount], blockHeader.fp)) {
+            referenceCount++;
+            return 0;
+        }
+        auto iter = previousIndex.find(blockHeader.fp);
+        if (iter != previousIndex.end()) {
+            flushRun();
+            referenceStart = iter->second;
+            referenceCount = 1;
+            return 0;
+        }
+        if (referenceCount) {
+            flushRun();
+        }
+        literals.push_back(blockHeader);
+        return 0;
+    }
+
+    // writes what is pending, the seek index and the trailer.
+    int finish() {
+        if (!compact) {
+            return 0;
+        }
+        flushRun();
+        RecipeTrailer trailer = {entryCount, totalLength, seekInterval, seekPoints.size(), offset, depth, RecipeMagic};
+        for (auto &seekPoint : seekPoints) {
+            bufferedFileWriter->write((uint8_t *) &seekPoint, sizeof(RecipeSeekPoint));
+        }
+        bufferedFileWriter->write((uint8_t *) &trailer, sizeof(RecipeTrailer));
+        printf("Recipe holds %lu chunks in %lu bytes, %lu of them referring to the previous recipe\n", entryCount,
+               offset + seekPoints.size() * sizeof(RecipeSeekPoint) + sizeof(RecipeTrailer), referredCount);
+        return 0;
+    }
+
+private:
+    void flushRun() {
+        if (referenceCount) {
+            writeVarint(referenceCount << 1 | 1);
+            writeVarint(zigzagEncode((int64_t) referenceStart - (int64_t) referenceEnd));
+            referenceEnd = referenceStart + referenceCount;
+            referredCount += referenceCount;
+            referenceCount = 0;
+        }
+        if (!literals.empty()) {
+            writeVarint(literals.size() << 1);
+            for (auto &literal : literals) {
+                bufferedFileWriter->write((uint8_t *) &literal.fp, RecipeFingerprintLength);
+                offset += RecipeFingerprintLength;
+                writeVarint(literal.length);
+            }
+            literals.clear();
+        }
+    }
+
+    void writeVarint(uint64_t value) {
+        uint8_t bytes[10];
+        int length = 0;
+        do {
+            bytes[length++] = (value & 0x7f) | (value >= 0x80 ? 0x80 : 0);
+            value >>= 7;
+        } while (value);
+        bufferedFileWriter->write(bytes, length);
+        offset += length;
+    }
+
+    BufferedFileWriter *bufferedFileWriter;
+    bool compact;
+    uint64_t seekInterval;
+    uint64_t depth = 0;
+    std::vector<SHA1FP> previousFps;
+    std::unordered_map<SHA1FP, uint64_t, TupleHasher, TupleEqualer> previousIndex;
+    uint64_t offset = 0;
+    uint64_t entryCount = 0;
+    uint64_t totalLength = 0;
+    uint64_t referenceStart = 0;
+    uint64_t referenceCount = 0;
+    uint64_t referenceEnd = 0;
+    uint64_t referredCount = 0;
+    std::vector<BlockHeader> literals;
+    std::vector<RecipeSeekPoint> seekPoints;
+};
+
+#endif //MFDEDUP_RECIPEWRITER_H
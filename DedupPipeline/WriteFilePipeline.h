@@ -10,12 +10,16 @@
 #include "../Utility/ChunkWriterManager.h"
 #include "../Utility/Likely.h"
 #include "../Utility/BufferedFileWriter.h"
+#include "BaseReader.h"
+#include "RecipeWriter.h"
 
 extern std::string LogicFilePath;
 
 DEFINE_uint64(RecipeFlushBufferSize,
               8388608, "RecipeFlushBufferSize");
 
+DECLARE_int32(ExpectSize);
+
 class WriteFilePipeline {
 public:
     WriteFilePipeline() : runningFlag(true), taskAmount(0), mutexLock(), condition(mutexLock),
@@ -36,11 +40,37 @@ public:
         worker->join();
     }
 
+    // files of the next version are preallocated from the length of its input: the category holds at most the input
+    // and a header for each chunk, and the recipe a header for each chunk of the expected size.
+    void expect(uint64_t inputLength) {
+        expectedLength = inputLength;
+    }
+
+    // bases of deltas of the next version are read from the previous version in the layout falling fallBehind
+    // versions behind, as it is during the backup.
+    void setBaseLayout(uint64_t fallBehind) {
+        baseFallBehind = fallBehind;
+    }
+
     void getStatistics() {
         printf("Write duration:%lu\n", duration);
     }
 
 private:
+    // the sidecar of the recipe lists its delta chunks with their bases.
+    void writeDeltaReferences() {
+        if (deltaReferences.empty()) {
+            return;
+        }
+        std::string sidecarPath = DeltaReferences::path(buffer);
+        FileOperator fileOperator((char *) sidecarPath.data(), FileOpenType::Write);
+        fileOperator.write((uint8_t *) deltaReferences.data(), deltaReferences.size() * sizeof(DeltaReference));
+        GlobalDurability.completed(&fileOperator);
+        printf("%lu delta chunks are listed by the recipe\n", deltaReferences.size());
+        deltaReferences.clear();
+        deltaChunks.clear();
+    }
+
     void writeFileCallback() {
         struct timeval t0, t1;
         bool newVersionFlag = true;
@@ -64,7 +94,16 @@ private:
             gettimeofday(&t0, NULL);
 
             if (chunkWriterManager == nullptr) {
-                chunkWriterManager = new ChunkWriterManager(TotalVersion);
+                uint64_t expectedChunks = expectedLength / FLAGS_ExpectSize + 1;
+                ChunkReader chunkReader;
+                if (FLAGS_Resemblance && TotalVersion > 1) {
+                    baseReader = new BaseReader(TotalVersion - 1, baseFallBehind);
+                    chunkReader = std::bind(&BaseReader::read, baseReader, std::placeholders::_1,
+                                            std::placeholders::_2);
+                }
+                chunkWriterManager = new ChunkWriterManager(TotalVersion,
+                                                            expectedLength + expectedChunks * sizeof(BlockHeader),
+                                                            chunkReader);
                 duration = 0;
             }
 
@@ -73,26 +112,35 @@ private:
                 if (!logicFileOperator) {
                     sprintf(buffer, LogicFilePath.c_str(), writeTask.fileID);
                     logicFileOperator = new FileOperator(buffer, FileOpenType::Write);
-                    bufferedFileWriter = new BufferedFileWriter(logicFileOperator, FLAGS_RecipeFlushBufferSize, 1);
+                    logicFileOperator->preallocate(0, (expectedLength / FLAGS_ExpectSize + 1) * sizeof(BlockHeader));
+                    bufferedFileWriter = new BufferedFileWriter(logicFileOperator, FLAGS_RecipeFlushBufferSize);
+                    recipeWriter = new RecipeWriter(bufferedFileWriter, writeTask.fileID);
+                    DeltaReferences::remove(buffer);
                     printf("start write\n");
                 }
+                if (writeTask.hasBase && deltaChunks.insert(writeTask.sha1Fp).second) {
+                    deltaReferences.push_back({writeTask.sha1Fp, writeTask.baseFp});
+                }
                 blockHeader = {
                         writeTask.sha1Fp,
-                        writeTask.bufferLength,
+                        (uint32_t) writeTask.bufferLength,
+                        (uint32_t) ChunkEncoding::Raw,
+                        0,
                 };
                 switch (writeTask.type) {
                     case 0:
                         chunkWriterManager->writeClass((uint8_t * ) & blockHeader, sizeof(BlockHeader),
-                                                       writeTask.buffer + writeTask.pos, writeTask.bufferLength);
-                        bufferedFileWriter->write((uint8_t * ) & blockHeader, sizeof(BlockHeader));
+                                                       writeTask.buffer + writeTask.pos, writeTask.bufferLength,
+                                                       writeTask.hasBase ? &writeTask.baseFp : nullptr);
+                        recipeWriter->add(blockHeader);
 //                        logicFileOperator->write((uint8_t * ) & blockHeader, sizeof(BlockHeader));
                         break;
                     case 1:
-                        bufferedFileWriter->write((uint8_t * ) & blockHeader, sizeof(BlockHeader));
+                        recipeWriter->add(blockHeader);
 //                        logicFileOperator->write((uint8_t * ) & blockHeader, sizeof(BlockHeader));
                         break;
                     case 2:
-                        bufferedFileWriter->write((uint8_t * ) & blockHeader, sizeof(BlockHeader));
+                        recipeWriter->add(blockHeader);
 //                        chunkWriterManager->writeClass(writeTask.oldClass + TotalVersion - 1,
 //                                                       (uint8_t * ) & blockHeader, sizeof(BlockHeader),
 //                                                       writeTask.buffer + writeTask.pos, writeTask.bufferLength);
@@ -103,11 +151,16 @@ private:
 
                 if (writeTask.countdownLatch) {
                     printf("WritePipeline finish\n");
+                    recipeWriter->finish();
+                    delete recipeWriter;
                     delete bufferedFileWriter;
                     delete logicFileOperator;
                     logicFileOperator = nullptr;
                     delete chunkWriterManager;
                     chunkWriterManager = nullptr;
+                    delete baseReader;
+                    baseReader = nullptr;
+                    writeDeltaReferences();
                     gettimeofday(&t1, NULL);
                     duration += (t1.tv_sec - t0.tv_sec) * 1000000 + t1.tv_usec - t0.tv_usec;
 
@@ -125,6 +178,12 @@ private:
 
     FileOperator *logicFileOperator;
     BufferedFileWriter* bufferedFileWriter;
+    RecipeWriter *recipeWriter;
+    uint64_t expectedLength = 0;
+    uint64_t baseFallBehind = 0;
+    BaseReader *baseReader = nullptr;
+    std::vector<DeltaReference> deltaReferences;
+    std::unordered_set<SHA1FP, TupleHasher, TupleEqualer> deltaChunks;
     char buffer[256];
     bool runningFlag;
     std::thread *worker;
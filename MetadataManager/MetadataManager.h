@@ -6,8 +6,12 @@
 
 #include <map>
 #include "../Utility/StorageTask.h"
+#include "../Utility/Durability.h"
+#include "../Utility/Resemblance.h"
+#include "../Utility/RecipeReader.h"
 #include <unordered_set>
 #include <unordered_map>
+#include <vector>
 
 uint64_t shadMask = 0x7;
 
@@ -15,6 +19,7 @@ int ReplaceThreshold = 10;
 
 extern uint64_t TotalVersion;
 extern std::string KVPath;
+extern std::string LogicFilePath;
 
 struct TupleHasher {
     std::size_t
@@ -36,14 +41,31 @@ enum class LookupResult {
     SkipDedup,
 };
 
+struct FeatureEntry {
+    uint64_t superFeature;
+    SHA1FP fp;
+};
+
 struct FPIndex{
     uint64_t duplicateSize = 0;
     uint64_t totalSize = 0;
     std::unordered_set<SHA1FP, TupleHasher, TupleEqualer> fpTable;
+    // super-features of chunks of the version stored as they are, in a direct-mapped table allocated on first use.
+    std::vector<FeatureEntry> featureTable;
+    // delta chunks of the version, with their bases.
+    std::unordered_map<SHA1FP, SHA1FP, TupleHasher, TupleEqualer> deltaTable;
+    // bases in fpTable which the recipe has not referred to so far, and whose sizes have not been counted.
+    std::unordered_set<SHA1FP, TupleHasher, TupleEqualer> pinnedBases;
 
     void rolling(FPIndex& alter){
         fpTable.clear();
         fpTable.swap(alter.fpTable);
+        featureTable.clear();
+        featureTable.swap(alter.featureTable);
+        deltaTable.clear();
+        deltaTable.swap(alter.deltaTable);
+        pinnedBases.clear();
+        alter.pinnedBases.clear();
         duplicateSize = alter.duplicateSize;
         totalSize = alter.totalSize;
         alter.duplicateSize = 0;
@@ -60,7 +82,7 @@ public:
     LookupResult dedupLookup(const SHA1FP &sha1Fp, uint64_t chunkSize) {
         MutexLockGuard mutexLockGuard(tableLock);
         auto innerDedupIter = laterTable.fpTable.find(sha1Fp);
-        if (innerDedupIter != laterTable.fpTable.end()) {
+        if (innerDedupIter != laterTable.fpTable.end() && !laterTable.pinnedBases.erase(sha1Fp)) {
             return LookupResult::InternalDedup;
         }
 
@@ -77,14 +99,19 @@ public:
     }
 
     uint64_t arrangementGetTruncateSize(){
+        if(arrangementDeferred){
+            return deferredTruncateSize;
+        }
         return earlierTable.totalSize - laterTable.duplicateSize;
     }
 
     int arrangementLookup(const SHA1FP &sha1Fp) {
         MutexLockGuard mutexLockGuard(tableLock);
 
-        auto r = laterTable.fpTable.find(sha1Fp);
-        if (r == laterTable.fpTable.end()) {
+        // a deferred arrangement classifies by the version which has been rolled into earlierTable.
+        FPIndex &survivalTable = arrangementDeferred ? earlierTable : laterTable;
+        auto r = survivalTable.fpTable.find(sha1Fp);
+        if (r == survivalTable.fpTable.end()) {
             return 0;
         } else {
             return 1;
@@ -105,13 +132,76 @@ public:
     int neighborAddRecord(const SHA1FP &sha1Fp) {
         MutexLockGuard mutexLockGuard(tableLock);
 
-        auto pp = laterTable.fpTable.find(sha1Fp);
-        assert(pp == laterTable.fpTable.end());
-
+        // a base pinned by a delta is in the table before the recipe refers to it.
         laterTable.fpTable.insert(sha1Fp);
         return 0;
     }
 
+    // finds a chunk of the previous version sharing a super-feature with a unique chunk, which becomes its base. Delta
+    // chunks are not taken as bases, so that every delta is decoded from a chunk stored as it is.
+    bool resemblanceLookup(const SHA1FP &sha1Fp, const uint64_t *superFeatures, SHA1FP *baseFp) {
+        MutexLockGuard mutexLockGuard(tableLock);
+        if (earlierTable.featureTable.empty()) {
+            return false;
+        }
+        TupleEqualer equaler;
+        for (uint64_t i = 0; i < SuperFeatureAmount; i++) {
+            if (!superFeatures[i]) {
+                continue;
+            }
+            FeatureEntry &entry = earlierTable.featureTable[superFeatures[i] % earlierTable.featureTable.size()];
+            if (entry.superFeature == superFeatures[i] && !equaler(entry.fp, sha1Fp) &&
+                earlierTable.fpTable.count(entry.fp) && !earlierTable.deltaTable.count(entry.fp)) {
+                *baseFp = entry.fp;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    int resemblanceAddRecord(const SHA1FP &sha1Fp, const uint64_t *superFeatures) {
+        MutexLockGuard mutexLockGuard(tableLock);
+        addFeatures(laterTable, sha1Fp, superFeatures);
+        return 0;
+    }
+
+    // The base of a delta chunk is kept in the version of the delta, as if it was referred to by the recipe, so that
+    // arrangement and elimination keep the base as long as the delta.
+    int deltaAddRecord(const SHA1FP &sha1Fp, const SHA1FP &baseFp) {
+        MutexLockGuard mutexLockGuard(tableLock);
+        laterTable.deltaTable[sha1Fp] = baseFp;
+        if (laterTable.fpTable.insert(baseFp).second) {
+            laterTable.pinnedBases.insert(baseFp);
+        }
+        return 0;
+    }
+
+    // a delta chunk of the previous version which is in the new version keeps its base there too.
+    bool deltaInherit(const SHA1FP &sha1Fp, SHA1FP *baseFp) {
+        MutexLockGuard mutexLockGuard(tableLock);
+        auto iter = earlierTable.deltaTable.find(sha1Fp);
+        if (iter == earlierTable.deltaTable.end()) {
+            return false;
+        }
+        *baseFp = iter->second;
+        laterTable.deltaTable[sha1Fp] = iter->second;
+        if (laterTable.fpTable.insert(iter->second).second) {
+            laterTable.pinnedBases.insert(iter->second);
+        }
+        return true;
+    }
+
+    // a delta chunk found in the later table, which holds more than the new version when tables have not been rolled.
+    bool deltaLookup(const SHA1FP &sha1Fp, SHA1FP *baseFp) {
+        MutexLockGuard mutexLockGuard(tableLock);
+        auto iter = laterTable.deltaTable.find(sha1Fp);
+        if (iter == laterTable.deltaTable.end()) {
+            return false;
+        }
+        *baseFp = iter->second;
+        return true;
+    }
+
     int tableRolling() {
         MutexLockGuard mutexLockGuard(tableLock);
 
@@ -121,11 +211,88 @@ public:
         return 0;
     }
 
-    int save(){
+    // Rolls the tables before the arrangement of the previous version, so that the next backup can deduplicate
+    // against the latest version while the arrangement runs in background.
+    int deferredRolling() {
+        MutexLockGuard mutexLockGuard(tableLock);
+
+        deferredTruncateSize = earlierTable.totalSize - laterTable.duplicateSize;
+        earlierTable.rolling(laterTable);
+        arrangementDeferred = true;
+
+        return 0;
+    }
+
+    // Catch-up arrangement classifies chunks by the survival tables of versions [layoutVersion, maxVersion], which are
+    // loaded from recipes. The index is rebuilt from them immediately, since it is valid for both the current layout
+    // and the layout after the catch-up.
+    int catchUpLoad(uint64_t layoutVersion, uint64_t targetVersion, uint64_t maxVersion) {
+        printf("Loading survival tables of version %lu ~ %lu..\n", layoutVersion, maxVersion);
+        survivalTables.clear();
+        survivalTables.resize(maxVersion - layoutVersion + 1);
+        survivalBase = layoutVersion;
+        for (uint64_t v = layoutVersion; v <= maxVersion; v++) {
+            loadRecipeTable(v, survivalTables[v - layoutVersion]);
+        }
+
+        // super-features are not in recipes, and are kept, as lookups check their chunks against the tables.
+        // Those of versions which have not been rolled are in the later table, and are merged into the earlier one.
+        MutexLockGuard mutexLockGuard(tableLock);
+        earlierTable.fpTable.clear();
+        laterTable.fpTable.clear();
+        earlierTable.deltaTable.clear();
+        laterTable.deltaTable.clear();
+        earlierTable.totalSize = 0;
+        earlierTable.duplicateSize = 0;
+        laterTable.totalSize = 0;
+        laterTable.duplicateSize = 0;
+        for (uint64_t v = targetVersion; v <= maxVersion; v++) {
+            FPIndex &survivalTable = survivalTables[v - layoutVersion];
+            FPIndex &table = v == targetVersion ? earlierTable : laterTable;
+            table.fpTable.insert(survivalTable.fpTable.begin(), survivalTable.fpTable.end());
+            table.deltaTable.insert(survivalTable.deltaTable.begin(), survivalTable.deltaTable.end());
+            table.totalSize += survivalTable.totalSize;
+            if (v == targetVersion || v == targetVersion + 1) {
+                table.duplicateSize = survivalTable.duplicateSize;
+            }
+        }
+        mergeFeatures(earlierTable, laterTable);
+        printf("index rebuilt, earlier table %lu items, later table %lu items\n", earlierTable.fpTable.size(),
+               laterTable.fpTable.size());
+        return 0;
+    }
+
+    // returns the last version which the chunk belongs to.
+    uint64_t catchUpLookup(const SHA1FP &sha1Fp, uint64_t birthVersion) {
+        uint64_t firstVersion = std::max(birthVersion, survivalBase);
+        for (uint64_t v = survivalBase + survivalTables.size() - 1; v > firstVersion; v--) {
+            FPIndex &survivalTable = survivalTables[v - survivalBase];
+            if (survivalTable.fpTable.find(sha1Fp) != survivalTable.fpTable.end()) {
+                return v;
+            }
+        }
+        return firstVersion;
+    }
+
+    int arrangementFinish() {
+        if (!survivalTables.empty()) {
+            // index has been rebuilt by catchUpLoad()
+            survivalTables.clear();
+        } else if (arrangementDeferred) {
+            // tables have been rolled by deferredRolling()
+            MutexLockGuard mutexLockGuard(tableLock);
+            arrangementDeferred = false;
+        } else {
+            tableRolling();
+        }
+        return 0;
+    }
+
+    int save(const std::string &path){
         printf("------------------------Saving index----------------------\n");
         printf("Saving index..\n");
         uint64_t size;
-        FileOperator fileOperator((char*)KVPath.data(), FileOpenType::Write);
+        FileOperator fileOperator((char*)path.data(), FileOpenType::Write);
         fileOperator.write((uint8_t*)&earlierTable, sizeof(uint64_t)*2);
         size = earlierTable.fpTable.size();
         fileOperator.write((uint8_t*)&size, sizeof(uint64_t));
@@ -142,17 +309,21 @@ public:
         }
         printf("later table saves %lu items\n", size);
         printf("later total size:%lu, duplicate size:%lu\n", laterTable.totalSize, laterTable.duplicateSize);
-        fileOperator.fdatasync();
+        saveResemblance(fileOperator, earlierTable);
+        saveResemblance(fileOperator, laterTable);
+        savePinnedBases(fileOperator, earlierTable);
+        savePinnedBases(fileOperator, laterTable);
+        GlobalDurability.completed(&fileOperator);
     }
 
-    int load(){
+    int load(const std::string &path){
         printf("-----------------------Loading index-----------------------\n");
         printf("Loading index..\n");
         uint64_t sizeE = 0;
         uint64_t sizeL = 0;
         SHA1FP tempFP;
         uint64_t tempCID;
-        FileOperator fileOperator((char*)KVPath.data(), FileOpenType::Read);
+        FileOperator fileOperator((char*)path.data(), FileOpenType::Read);
         assert(earlierTable.fpTable.size() == 0);
         assert(laterTable.fpTable.size() == 0);
 
@@ -164,19 +335,149 @@ public:
         }
         printf("earlier table load %lu items\n", sizeE);
 
-        fileOperator.read((uint8_t*)&earlierTable, sizeof(uint64_t)*2);
+        fileOperator.read((uint8_t*)&laterTable, sizeof(uint64_t)*2);
         fileOperator.read((uint8_t*)&sizeL, sizeof(uint64_t));
         for(uint64_t i = 0; i<sizeL; i++){
             fileOperator.read((uint8_t*)&tempFP, sizeof(SHA1FP));
             laterTable.fpTable.insert(tempFP);
         }
         printf("later table load %lu items\n", sizeL);
+        // indexes saved before resemblance end here.
+        loadResemblance(fileOperator, earlierTable);
+        loadResemblance(fileOperator, laterTable);
+        // and those saved before pinned bases here.
+        loadPinnedBases(fileOperator, earlierTable);
+        loadPinnedBases(fileOperator, laterTable);
     }
 
 private:
+    // an entry of a super-feature replaces what was there before.
+    void addFeatures(FPIndex &table, const SHA1FP &sha1Fp, const uint64_t *superFeatures) {
+        if (table.featureTable.empty()) {
+            table.featureTable.assign(std::max(FLAGS_ResemblanceIndexEntries, (uint64_t) 1), {0, {0, 0, 0, 0}});
+        }
+        for (uint64_t i = 0; i < SuperFeatureAmount; i++) {
+            if (superFeatures[i]) {
+                table.featureTable[superFeatures[i] % table.featureTable.size()] = {superFeatures[i], sha1Fp};
+            }
+        }
+    }
+
+    // entries of the source replace those of the table whose chunks are not in it.
+    void mergeFeatures(FPIndex &table, const FPIndex &source) {
+        for (auto &item : source.featureTable) {
+            if (!item.superFeature) {
+                continue;
+            }
+            if (table.featureTable.empty()) {
+                table.featureTable.assign(std::max(FLAGS_ResemblanceIndexEntries, (uint64_t) 1), {0, {0, 0, 0, 0}});
+            }
+            FeatureEntry &entry = table.featureTable[item.superFeature % table.featureTable.size()];
+            if (!entry.superFeature || !table.fpTable.count(entry.fp)) {
+                entry = item;
+            }
+        }
+    }
+
+    void saveResemblance(FileOperator &fileOperator, FPIndex &table) {
+        uint64_t size = 0;
+        for (auto &item : table.featureTable) {
+            size += item.superFeature != 0;
+        }
+        fileOperator.write((uint8_t *) &size, sizeof(uint64_t));
+        for (auto &item : table.featureTable) {
+            if (item.superFeature) {
+                fileOperator.write((uint8_t *) &item, sizeof(FeatureEntry));
+            }
+        }
+        size = table.deltaTable.size();
+        fileOperator.write((uint8_t *) &size, sizeof(uint64_t));
+        for (auto &item : table.deltaTable) {
+            DeltaReference deltaReference = {item.first, item.second};
+            fileOperator.write((uint8_t *) &deltaReference, sizeof(DeltaReference));
+        }
+    }
+
+    void loadResemblance(FileOperator &fileOperator, FPIndex &table) {
+        uint64_t size = 0;
+        fileOperator.read((uint8_t *) &size, sizeof(uint64_t));
+        FeatureEntry featureEntry;
+        for (uint64_t i = 0; i < size; i++) {
+            fileOperator.read((uint8_t *) &featureEntry, sizeof(FeatureEntry));
+            uint64_t superFeatures[SuperFeatureAmount] = {featureEntry.superFeature};
+            addFeatures(table, featureEntry.fp, superFeatures);
+        }
+        size = 0;
+        fileOperator.read((uint8_t *) &size, sizeof(uint64_t));
+        DeltaReference deltaReference;
+        for (uint64_t i = 0; i < size; i++) {
+            fileOperator.read((uint8_t *) &deltaReference, sizeof(DeltaReference));
+            table.deltaTable[deltaReference.fp] = deltaReference.base;
+        }
+    }
+
+    // bases are in fpTable, which is saved, and whether their sizes have been counted is kept along with them.
+    void savePinnedBases(FileOperator &fileOperator, FPIndex &table) {
+        uint64_t size = table.pinnedBases.size();
+        fileOperator.write((uint8_t *) &size, sizeof(uint64_t));
+        for (auto &item : table.pinnedBases) {
+            fileOperator.write((uint8_t *) &item, sizeof(SHA1FP));
+        }
+    }
+
+    void loadPinnedBases(FileOperator &fileOperator, FPIndex &table) {
+        uint64_t size = 0;
+        fileOperator.read((uint8_t *) &size, sizeof(uint64_t));
+        SHA1FP sha1Fp;
+        for (uint64_t i = 0; i < size; i++) {
+            fileOperator.read((uint8_t *) &sha1Fp, sizeof(SHA1FP));
+            table.fpTable.insert(sha1Fp);
+            table.pinnedBases.insert(sha1Fp);
+        }
+    }
+
+    int loadRecipeTable(uint64_t version, FPIndex &table) {
+        char pathBuffer[256];
+        sprintf(pathBuffer, LogicFilePath.data(), version);
+        RecipeReader recipe(version);
+        if (!recipe.ok()) {
+            return -1;
+        }
+        FPIndex *previousTable = nullptr;
+        if (version > survivalBase) {
+            previousTable = &survivalTables[version - 1 - survivalBase];
+        }
+        const uint64_t batch = 4096;
+        BlockHeader *blockHeaders = (BlockHeader *) malloc(batch * sizeof(BlockHeader));
+        uint64_t readSize;
+        while ((readSize = recipe.next(blockHeaders, batch)) > 0) {
+            for (uint64_t i = 0; i < readSize; i++) {
+                if (table.fpTable.insert(blockHeaders[i].fp).second) {
+                    table.totalSize += blockHeaders[i].length;
+                    if (previousTable && previousTable->fpTable.count(blockHeaders[i].fp)) {
+                        table.duplicateSize += blockHeaders[i].length;
+                    }
+                }
+            }
+        }
+        free(blockHeaders);
+        // bases are kept by the version of their deltas.
+        for (auto &item : DeltaReferences::load(pathBuffer)) {
+            table.deltaTable[item.fp] = item.base;
+            table.fpTable.insert(item.base);
+        }
+        return 0;
+    }
+
     FPIndex earlierTable;
     FPIndex laterTable;
 
+    bool arrangementDeferred = false;
+    uint64_t deferredTruncateSize = 0;
+
+    std::vector<FPIndex> survivalTables;
+    uint64_t survivalBase = 0;
+
     MutexLock tableLock;
 };
 
@@ -10,17 +10,214 @@
 #include "RestoreWritePipeline.h"
 #include "../Utility/StorageTask.h"
 #include "../Utility/FileOperator.h"
+#include "../Utility/ChunkCompressor.h"
+#include "../Utility/Resemblance.h"
+#include "../Utility/RecipeReader.h"
 #include <thread>
+#include <vector>
+#include <map>
+#include <set>
+#include <atomic>
+#include <algorithm>
 #include <assert.h>
 
+extern std::string LogicFilePath;
+
 DEFINE_uint64(RestoreReadBufferLength,
               8388608, "RestoreReadBufferLength");
+DEFINE_uint64(RestoreParseThreads,
+              4, "threads parsing read buffers and building the restore map");
+DEFINE_uint64(RestoreMemoryBudget,
+              0, "memory (bytes) of the restore map, beyond which the recipe is processed in windows, 0 means unlimited");
+DEFINE_uint64(RestoreOffset,
+              0, "offset of the restored range in the version");
+DEFINE_uint64(RestoreLength,
+              0, "length of the restored range, 0 means to the end of the version");
+
+inline bool operator<(const SHA1FP &lhs, const SHA1FP &rhs) {
+    if (lhs.fp1 != rhs.fp1) return lhs.fp1 < rhs.fp1;
+    if (lhs.fp2 != rhs.fp2) return lhs.fp2 < rhs.fp2;
+    if (lhs.fp3 != rhs.fp3) return lhs.fp3 < rhs.fp3;
+    return lhs.fp4 < rhs.fp4;
+}
+
+// Positions of every chunk in the restored version, as a sorted array of fingerprints, each with the index of its
+// first position in a packed positions array. A directory on the top bits of fingerprints narrows the binary search.
+// It takes 32 bytes for each distinct chunk and 8 bytes for each position, and is read-only once built.
+class RestoreMap {
+public:
+    // peak memory of building, for each recipe entry.
+    static const uint64_t BuildMemoryPerChunk = sizeof(BlockHeader) + 72;
+
+    // builds the map of count recipe entries, the first of which is at position beginPos of the restored file. Entries
+    // marked in skipped are left out, though they still take their positions.
+    void build(const BlockHeader *blockHeaders, uint64_t count, uint64_t threads, uint64_t beginPos = 0,
+               const std::vector<bool> *skipped = nullptr) {
+        struct Item {
+            SHA1FP fp;
+            uint64_t pos;
+
+            bool operator<(const Item &other) const {
+                if (fp < other.fp) return true;
+                if (other.fp < fp) return false;
+                return pos < other.pos;
+            }
+        };
+        std::vector<Item> items;
+        items.reserve(count);
+        uint64_t pos = beginPos;
+        for (uint64_t i = 0; i < count; i++) {
+            if (!skipped || !(*skipped)[i]) {
+                items.push_back({blockHeaders[i].fp, pos});
+            }
+            pos += blockHeaders[i].length;
+        }
+        endPos = pos;
+        count = items.size();
+
+        // sort slices in parallel, then merge adjacent slices in parallel rounds.
+        if (threads < 1 || count < threads * 1024) threads = 1;
+        std::vector<uint64_t> bounds;
+        for (uint64_t t = 0; t <= threads; t++) {
+            bounds.push_back(count * t / threads);
+        }
+        parallelFor(threads, [&](uint64_t t) {
+            std::sort(items.begin() + bounds[t], items.begin() + bounds[t + 1]);
+        });
+        for (uint64_t width = 1; width < threads; width *= 2) {
+            parallelFor((threads + 2 * width - 1) / (2 * width), [&](uint64_t m) {
+                uint64_t first = m * 2 * width, middle = first + width, last = std::min(first + 2 * width, threads);
+                if (middle < last) {
+                    std::inplace_merge(items.begin() + bounds[first], items.begin() + bounds[middle],
+                                       items.begin() + bounds[last]);
+                }
+            });
+        }
+
+        entries.clear();
+        positions.resize(count);
+        for (uint64_t i = 0; i < count; i++) {
+            if (i == 0 || items[i - 1].fp < items[i].fp) {
+                entries.push_back({items[i].fp, i});
+            }
+            positions[i] = items[i].pos;
+        }
+        entries.shrink_to_fit();
+
+        directory.assign(DirectorySize + 1, entries.size());
+        for (uint64_t i = entries.size(); i > 0; i--) {
+            directory[bucket(entries[i - 1].fp)] = i - 1;
+        }
+        for (uint64_t b = DirectorySize; b > 0; b--) {
+            directory[b - 1] = std::min(directory[b - 1], directory[b]);
+        }
+    }
+
+    // returns positions of a chunk, or an empty range when the chunk is not in the restored version.
+    std::pair<const uint64_t *, const uint64_t *> lookup(const SHA1FP &sha1Fp) const {
+        auto begin = entries.begin() + directory[bucket(sha1Fp)];
+        auto end = entries.begin() + directory[bucket(sha1Fp) + 1];
+        auto iter = std::lower_bound(begin, end, sha1Fp, [](const Entry &entry, const SHA1FP &fp) {
+            return entry.fp < fp;
+        });
+        if (iter == end || sha1Fp < iter->fp) {
+            return {nullptr, nullptr};
+        }
+        uint64_t last = iter + 1 == entries.end() ? positions.size() : (iter + 1)->first;
+        return {positions.data() + iter->first, positions.data() + last};
+    }
+
+    uint64_t getEndPos() const {
+        return endPos;
+    }
+
+private:
+    struct Entry {
+        SHA1FP fp;
+        uint64_t first;
+    };
+
+    static const uint64_t DirectoryBits = 16;
+    static const uint64_t DirectorySize = 1 << DirectoryBits;
+
+    static uint64_t bucket(const SHA1FP &sha1Fp) {
+        return sha1Fp.fp1 >> (64 - DirectoryBits);
+    }
+
+    template<typename Function>
+    static void parallelFor(uint64_t n, Function function) {
+        std::vector<std::thread *> threads;
+        for (uint64_t i = 1; i < n; i++) {
+            threads.push_back(new std::thread(function, i));
+        }
+        function(0);
+        for (auto thread : threads) {
+            thread->join();
+            delete thread;
+        }
+    }
+
+    std::vector<Entry> entries;
+    std::vector<uint64_t> positions;
+    std::vector<uint64_t> directory;
+    uint64_t endPos = 0;
+};
+
+// A range of complete chunks. It either refers to a read buffer, or owns a chunk which straddles two buffers.
+struct RestoreParseJob {
+    RestoreParseTask *restoreParseTask = nullptr;
+    uint8_t *ownedBuffer = nullptr;
+    uint8_t *buffer;
+    uint64_t length;
+    bool endFlag = false;
+
+    ~RestoreParseJob() {
+        delete restoreParseTask;
+        if (ownedBuffer) {
+            free(ownedBuffer);
+        }
+    }
+};
 
 class RestoreParserPipeline {
 public:
-    RestoreParserPipeline(uint64_t target, const std::string &path) : taskAmount(0), runningFlag(true), mutexLock(),
-                                                                      condition(mutexLock) {
-        worker = new std::thread(std::bind(&RestoreParserPipeline::restoreParserCallback, this, path));
+    // memory of a base of deltas in deltaBases and baseCache, besides its bytes.
+    static const uint64_t BaseMemoryPerChunk = 2 * sizeof(SHA1FP) + 112;
+
+    explicit RestoreParserPipeline(uint64_t target)
+            : RestoreParserPipeline(target, std::vector<uint64_t>{target}) {
+    }
+
+    // Several recipes are restored as if they were concatenated, and each chunk goes to every version holding it.
+    RestoreParserPipeline(uint64_t target, const std::vector<uint64_t> &versions) : taskAmount(0), runningFlag(true),
+                                                                                  mutexLock(), condition(mutexLock),
+                                                                                  jobMutexLock(),
+                                                                                  jobCondition(jobMutexLock),
+                                                                                  windowMutexLock(),
+                                                                                  windowCondition(windowMutexLock) {
+        char pathBuffer[256];
+        for (auto version : versions) {
+            recipes.push_back(new RecipeReader(version));
+            recipeCounts.push_back(recipes.back()->getCount());
+            recipeCount += recipeCounts.back();
+            sprintf(pathBuffer, LogicFilePath.data(), version);
+            for (auto &item : DeltaReferences::load(pathBuffer)) {
+                deltaReferences[item.fp] = item.base;
+            }
+        }
+        chunkEnd = recipeCount;
+        if (FLAGS_RestoreOffset || FLAGS_RestoreLength) {
+            locateRange(versions[0]);
+        }
+        if (FLAGS_RestoreBase) {
+            baseRecipe = new RecipeReader(FLAGS_RestoreBase);
+        }
+        splitWindows();
+        windowAmount = windowBounds.size() - 1;
+        if (windowAmount > 1) {
+            printf("Restore map exceeds the memory budget, the recipe is processed in %lu windows\n", windowAmount);
+        }
+        worker = new std::thread(std::bind(&RestoreParserPipeline::restoreParserCallback, this));
     }
 
     int addTask(RestoreParseTask *restoreParseTask) {
@@ -30,43 +227,86 @@ public:
         condition.notify();
     }
 
+    // The layout is read once for each window.
+    uint64_t getWindowAmount() {
+        return windowAmount;
+    }
+
+    // whether the recipe is restored in part, so that files are better read only where they hold chunks of the
+    // current window.
+    bool isSelective() {
+        return rangeFlag || baseRecipe || windowAmount > 1;
+    }
+
+    // length of the version restored from a recipe.
+    static uint64_t getVersionLength(uint64_t version) {
+        RecipeReader recipe(version);
+        return recipe.getLength();
+    }
+
+    // restored bytes, which are known once the first window has been published.
+    uint64_t getTotalSize() {
+        return totalSize;
+    }
+
+    // bytes read from volumes and categories, which are known once the restore has finished.
+    uint64_t getReadLength() {
+        return readLength;
+    }
+
+    // returns once the restore map of the window has been built.
+    void waitWindow(uint64_t window) {
+        MutexLockGuard mutexLockGuard(windowMutexLock);
+        while (loadedWindows <= window) {
+            windowCondition.wait();
+        }
+    }
+
+    // chunks of the restored version, and bases of its deltas.
+    bool contains(const SHA1FP &fp) {
+        auto positions = restoreMap.lookup(fp);
+        return positions.first != positions.second || deltaBases.count(fp);
+    }
+
     ~RestoreParserPipeline() {
         printf("restore parser duration :%lu\n", duration);
         runningFlag = false;
         condition.notifyAll();
         worker->join();
+        delete baseRecipe;
     }
 
 private:
-    void restoreParserCallback(const std::string &path) {
-
-        FileOperator recipeFD((char *) path.data(), FileOpenType::Read);
-        uint64_t size = FileOperator::size(path);
-        uint8_t *recipeBuffer = (uint8_t *) malloc(size);
-        recipeFD.read(recipeBuffer, size);
-        uint64_t count = size / sizeof(BlockHeader);
-        assert(count * sizeof(BlockHeader) == size);
-        BlockHeader *blockHeader;
-
-        uint64_t pos = 0;
-        for (uint64_t i = 0; i < count; i++) {
-            blockHeader = (BlockHeader *) (recipeBuffer + i * sizeof(BlockHeader));
-            restoreMap[blockHeader->fp].push_back({pos});
-            pos += blockHeader->length;
+    void restoreParserCallback() {
+        std::vector<uint64_t> versionLengths;
+        if (rangeFlag) {
+            totalSize = rangeEnd - rangeBegin;
+        } else if (windowAmount > 1 || recipes.size() > 1) {
+            for (auto recipe : recipes) {
+                versionLengths.push_back(recipe->getLength());
+                totalSize += versionLengths.back();
+            }
         }
-        GlobalRestoreWritePipelinePtr->setSize(pos);
+        uint64_t window = 0;
+        loadWindow(window, chunkBeginPos);
+        if (!rangeFlag && versionLengths.empty()) {
+            totalSize = restoreMap.getEndPos();
+        }
+        if (recipes.size() > 1) {
+            GlobalRestoreWritePipelinePtr->setOutputSizes(versionLengths);
+        } else {
+            GlobalRestoreWritePipelinePtr->setSize(totalSize);
+        }
+        publishWindow(window);
+        startParsers();
 
         RestoreParseTask *restoreParseTask;
-        uint64_t leftLength = 0;
-        uint64_t copyLength = 0;
-        uint8_t *chunkPtr;
-
-        uint8_t *temp = (uint8_t *) malloc(FLAGS_RestoreReadBufferLength);
+        // bytes of a chunk which straddles read buffers.
+        uint8_t *straddle = nullptr;
+        uint64_t straddleLength = 0;
 
         struct timeval t0, t1;
 
-        uint64_t readLength = 0;
-
         while (likely(runningFlag)) {
             {
                 MutexLockGuard mutexLockGuard(mutexLock);
@@ -82,9 +322,35 @@ private:
 
             gettimeofday(&t0, NULL);
 
+            if (unlikely(restoreParseTask->windowEndFlag)) {
+                // files end at chunk boundaries, so nothing straddles windows.
+                assert(straddleLength == 0);
+                delete restoreParseTask;
+                stopParsers();
+                resolveDeltas();
+                window++;
+                loadWindow(window, restoreMap.getEndPos());
+                publishWindow(window);
+                startParsers();
+                gettimeofday(&t1, NULL);
+                duration += (t1.tv_sec-t0.tv_sec)*1000000 + t1.tv_usec - t0.tv_usec;
+                continue;
+            }
+
             if (unlikely(restoreParseTask->endFlag)) {
-                printf("Read amplification : %f\n", (float)readLength / pos);
                 delete restoreParseTask;
+                stopParsers();
+                resolveDeltas();
+                free(straddle);
+                for (auto recipe : recipes) {
+                    delete recipe;
+                }
+                recipes.clear();
+                printf("Read amplification : %f\n", totalSize ? (float) readLength / totalSize : 0);
+                if (baseRecipe) {
+                    printf("Incremental restore keeps %lu chunks (%lu bytes) of version %lu, writes %lu of %lu bytes\n",
+                           unchangedChunks, unchangedLength, FLAGS_RestoreBase, totalLength.load(), totalSize);
+                }
                 RestoreWriteTask *restoreWriteTask = new RestoreWriteTask(true);
                 GlobalRestoreWritePipelinePtr->addTask(restoreWriteTask);
                 gettimeofday(&t1, NULL);
@@ -92,58 +358,367 @@ private:
                 break;
             }
 
-            readLength += restoreParseTask->length - restoreParseTask->beginPos;
+            // Only chunk boundaries are found here, by walking headers, while chunks are parsed by workers.
+            uint8_t *data = restoreParseTask->buffer + restoreParseTask->beginPos;
+            uint64_t length = restoreParseTask->length - restoreParseTask->beginPos;
+            readLength += length;
+            uint64_t offset = 0;
+
+            if (straddleLength) {
+                // complete the header first, then the chunk.
+                uint64_t copyLength = 0;
+                if (straddleLength < sizeof(BlockHeader)) {
+                    copyLength = std::min(sizeof(BlockHeader) - straddleLength, length);
+                    memcpy(straddle + straddleLength, data, copyLength);
+                    straddleLength += copyLength;
+                    offset += copyLength;
+                }
+                if (straddleLength >= sizeof(BlockHeader)) {
+                    uint64_t chunkLength = sizeof(BlockHeader) + ((BlockHeader *) straddle)->length;
+                    straddle = (uint8_t *) realloc(straddle, chunkLength);
+                    copyLength = std::min(chunkLength - straddleLength, length - offset);
+                    memcpy(straddle + straddleLength, data + offset, copyLength);
+                    straddleLength += copyLength;
+                    offset += copyLength;
+                    if (straddleLength == chunkLength) {
+                        RestoreParseJob *restoreParseJob = new RestoreParseJob();
+                        restoreParseJob->ownedBuffer = straddle;
+                        restoreParseJob->buffer = straddle;
+                        restoreParseJob->length = chunkLength;
+                        addJob(restoreParseJob);
+                        straddle = nullptr;
+                        straddleLength = 0;
+                    }
+                }
+            }
+
+            uint64_t start = offset;
+            while (length - offset >= sizeof(BlockHeader)) {
+                BlockHeader *blockHeader = (BlockHeader *) (data + offset);
+                if (length - offset < sizeof(BlockHeader) + blockHeader->length) {
+                    break;
+                }
+                offset += sizeof(BlockHeader) + blockHeader->length;
+            }
+            if (offset < length) {
+                straddleLength = length - offset;
+                straddle = (uint8_t *) malloc(std::max(straddleLength, (uint64_t) sizeof(BlockHeader)));
+                memcpy(straddle, data + offset, straddleLength);
+            }
 
-            uint64_t taskRemain = 0;
-            if (leftLength + restoreParseTask->length > FLAGS_RestoreReadBufferLength) {
-                copyLength = FLAGS_RestoreReadBufferLength - leftLength;
-                taskRemain = restoreParseTask->length - copyLength;
+            if (offset > start) {
+                RestoreParseJob *restoreParseJob = new RestoreParseJob();
+                restoreParseJob->restoreParseTask = restoreParseTask;
+                restoreParseJob->buffer = data + start;
+                restoreParseJob->length = offset - start;
+                addJob(restoreParseJob);
             } else {
-                copyLength = restoreParseTask->length;
-                taskRemain = 0;
+                delete restoreParseTask;
             }
-            uint64_t parseLeft = copyLength + leftLength;
-            memcpy(temp + leftLength, restoreParseTask->buffer + restoreParseTask->beginPos, copyLength);
 
-            uint64_t readoffset = 0;
+            gettimeofday(&t1, NULL);
+            duration += (t1.tv_sec-t0.tv_sec)*1000000 + t1.tv_usec - t0.tv_usec;
+        }
+    }
 
-            while (1) {
-                blockHeader = (BlockHeader *) (temp + readoffset);
-                if (parseLeft < sizeof(BlockHeader) || parseLeft < sizeof(BlockHeader) + blockHeader->length) {
-                    memcpy(temp, temp + readoffset, parseLeft);
-                    memcpy(temp + parseLeft, restoreParseTask->buffer + copyLength + restoreParseTask->beginPos, taskRemain);
-                    readoffset = 0;
-                    parseLeft += taskRemain;
+    // Splits the restored chunks into windows whose restore maps and bases of deltas fit in the memory budget. A base
+    // is counted at the length of its first delta in the window, which resembles it.
+    void splitWindows() {
+        windowBounds.assign(1, chunkBegin);
+        if (!FLAGS_RestoreMemoryBudget) {
+            windowBounds.push_back(chunkEnd);
+            return;
+        }
+        const uint64_t batch = 4096;
+        BlockHeader *blockHeaders = (BlockHeader *) malloc(batch * sizeof(BlockHeader));
+        std::set<SHA1FP> windowBases;
+        uint64_t windowMemory = 0;
+        for (uint64_t first = chunkBegin; first < chunkEnd; first += batch) {
+            uint64_t count = std::min(batch, chunkEnd - first);
+            readRecipe(first, count, blockHeaders);
+            for (uint64_t i = 0; i < count; i++) {
+                auto reference = deltaReferences.find(blockHeaders[i].fp);
+                bool newBase = reference != deltaReferences.end() && !windowBases.count(reference->second);
+                uint64_t memory = chunkMemory(blockHeaders[i], newBase);
+                if (first + i > windowBounds.back() && windowMemory + memory > FLAGS_RestoreMemoryBudget) {
+                    windowBounds.push_back(first + i);
+                    windowBases.clear();
+                    windowMemory = 0;
+                    newBase = reference != deltaReferences.end();
+                    memory = chunkMemory(blockHeaders[i], newBase);
+                }
+                windowMemory += memory;
+                if (newBase) {
+                    windowBases.insert(reference->second);
+                }
+            }
+        }
+        free(blockHeaders);
+        windowBounds.push_back(chunkEnd);
+    }
 
-                    taskRemain = 0;
-                    copyLength += taskRemain;
-                    blockHeader = (BlockHeader *) (temp + readoffset);
+    static uint64_t chunkMemory(const BlockHeader &blockHeader, bool newBase) {
+        return RestoreMap::BuildMemoryPerChunk + (newBase ? BaseMemoryPerChunk + blockHeader.length : 0);
+    }
 
-                    if (parseLeft < sizeof(BlockHeader) || parseLeft < sizeof(BlockHeader) + blockHeader->length) {
-                        leftLength = parseLeft;
-                        break;
-                    }
+    // builds the map of the window-th window of recipe, whose first chunk is at beginPos.
+    void loadWindow(uint64_t window, uint64_t beginPos) {
+        uint64_t first = windowBounds[window];
+        uint64_t count = windowBounds[window + 1] - first;
+        BlockHeader *blockHeaders = (BlockHeader *) malloc(count * sizeof(BlockHeader));
+        readRecipe(first, count, blockHeaders);
+        std::vector<bool> skipped;
+        if (baseRecipe) {
+            compareBase(blockHeaders, count, beginPos, skipped);
+        }
+        restoreMap.build(blockHeaders, count, FLAGS_RestoreParseThreads, beginPos, baseRecipe ? &skipped : nullptr);
+        free(blockHeaders);
+        // bases are read along with the deltas restored in the window.
+        deltaBases.clear();
+        for (auto &item : deltaReferences) {
+            auto positions = restoreMap.lookup(item.first);
+            if (positions.first != positions.second) {
+                deltaBases.insert(item.second);
+            }
+        }
+        if (!deltaBases.empty()) {
+            printf("Deltas of window %lu refer to %lu bases\n", window, deltaBases.size());
+        }
+    }
+
+    void publishWindow(uint64_t window) {
+        MutexLockGuard mutexLockGuard(windowMutexLock);
+        loadedWindows = window + 1;
+        windowCondition.notifyAll();
+    }
+
+    // reads count entries of the concatenated recipes, from the first-th.
+    void readRecipe(uint64_t first, uint64_t count, BlockHeader *blockHeaders) {
+        for (uint64_t i = 0; i < recipes.size() && count > 0; i++) {
+            if (first >= recipeCounts[i]) {
+                first -= recipeCounts[i];
+                continue;
+            }
+            uint64_t n = std::min(count, recipeCounts[i] - first);
+            recipes[i]->read(first, n, blockHeaders);
+            blockHeaders += n;
+            count -= n;
+            first = 0;
+        }
+    }
+
+    // finds chunks of the recipe which overlap the restored range.
+    void locateRange(uint64_t version) {
+        RecipeReader recipe(version);
+        const uint64_t batch = 4096;
+        BlockHeader *blockHeaders = (BlockHeader *) malloc(batch * sizeof(BlockHeader));
+        uint64_t readSize, index = 0, pos = 0;
+        rangeBegin = FLAGS_RestoreOffset;
+        rangeEnd = FLAGS_RestoreLength ? FLAGS_RestoreOffset + FLAGS_RestoreLength : -1;
+        chunkBegin = chunkEnd = recipeCount;
+        while ((readSize = recipe.next(blockHeaders, batch)) > 0) {
+            for (uint64_t i = 0; i < readSize; i++, index++) {
+                if (chunkBegin == recipeCount && pos + blockHeaders[i].length > rangeBegin) {
+                    chunkBegin = index;
+                    chunkBeginPos = pos;
+                }
+                if (chunkEnd == recipeCount && pos >= rangeEnd) {
+                    chunkEnd = index;
                 }
-                chunkPtr = temp + readoffset + sizeof(BlockHeader);
-                auto iter = restoreMap.find(blockHeader->fp);
-                // if we allow arrangement to fall behind, below assert must be commented.
-                //assert(iter->second.size() > 0);
-                if(iter != restoreMap.end()){
-                    for (auto item : iter->second) {
-                        totalLength += blockHeader->length;
-                        RestoreWriteTask *restoreWriteTask = new RestoreWriteTask(chunkPtr, item, blockHeader->length);
-                        GlobalRestoreWritePipelinePtr->addTask(restoreWriteTask);
+                pos += blockHeaders[i].length;
+            }
+        }
+        free(blockHeaders);
+        rangeBegin = std::min(rangeBegin, pos);
+        rangeEnd = std::min(rangeEnd, pos);
+        if (chunkBegin > chunkEnd) {
+            chunkBegin = chunkEnd;
+        }
+        rangeFlag = true;
+        printf("Restore bytes %lu ~ %lu of %lu, in chunks %lu ~ %lu of %lu\n", rangeBegin, rangeEnd, pos, chunkBegin,
+               chunkEnd, recipeCount);
+    }
+
+    // marks chunks which the base version holds at the same position, so that the restored file already has them.
+    // Windows are loaded in order, so the base recipe is walked once.
+    void compareBase(const BlockHeader *blockHeaders, uint64_t count, uint64_t beginPos, std::vector<bool> &skipped) {
+        skipped.assign(count, false);
+        uint64_t pos = beginPos;
+        for (uint64_t i = 0; i < count; i++) {
+            BlockHeader *base;
+            while ((base = currentBase()) && basePos < pos) {
+                basePos += base->length;
+                baseIndex++;
+            }
+            if (base && basePos == pos && base->length == blockHeaders[i].length &&
+                !(base->fp < blockHeaders[i].fp) && !(blockHeaders[i].fp < base->fp)) {
+                skipped[i] = true;
+                unchangedChunks++;
+                unchangedLength += blockHeaders[i].length;
+            }
+            pos += blockHeaders[i].length;
+        }
+    }
+
+    BlockHeader *currentBase() {
+        if (baseIndex == baseHeaders.size()) {
+            const uint64_t batch = 4096;
+            baseHeaders.resize(batch);
+            baseHeaders.resize(baseRecipe->next(baseHeaders.data(), batch));
+            baseIndex = 0;
+            if (baseHeaders.empty()) {
+                return nullptr;
+            }
+        }
+        return &baseHeaders[baseIndex];
+    }
+
+    void startParsers() {
+        uint64_t parserAmount = FLAGS_RestoreParseThreads ? FLAGS_RestoreParseThreads : 1;
+        for (uint64_t i = 0; i < parserAmount; i++) {
+            parsers.push_back(new std::thread(std::bind(&RestoreParserPipeline::parseJobCallback, this)));
+        }
+    }
+
+    // returns once every job so far has been parsed.
+    void stopParsers() {
+        for (uint64_t i = 0; i < parsers.size(); i++) {
+            RestoreParseJob *restoreParseJob = new RestoreParseJob();
+            restoreParseJob->endFlag = true;
+            addJob(restoreParseJob);
+        }
+        for (auto parser : parsers) {
+            parser->join();
+            delete parser;
+        }
+        parsers.clear();
+    }
+
+    void addJob(RestoreParseJob *restoreParseJob) {
+        MutexLockGuard mutexLockGuard(jobMutexLock);
+        jobList.push_back(restoreParseJob);
+        jobCondition.notify();
+    }
+
+    void parseJobCallback() {
+        RestoreParseJob *restoreParseJob;
+        std::vector<uint8_t> decodeBuffer;
+        while (true) {
+            {
+                MutexLockGuard mutexLockGuard(jobMutexLock);
+                while (jobList.empty()) {
+                    jobCondition.wait();
+                }
+                restoreParseJob = jobList.front();
+                jobList.pop_front();
+            }
+            if (restoreParseJob->endFlag) {
+                delete restoreParseJob;
+                break;
+            }
+
+            uint64_t offset = 0;
+            while (offset < restoreParseJob->length) {
+                BlockHeader *blockHeader = (BlockHeader *) (restoreParseJob->buffer + offset);
+                const uint8_t *chunkPtr = restoreParseJob->buffer + offset + sizeof(BlockHeader);
+                uint64_t chunkLength = ChunkCompressor::chunkLength(blockHeader);
+                // chunks which do not belong to the restored version are skipped, when arrangement falls behind
+                // or categories are shared with other versions.
+                auto positions = restoreMap.lookup(blockHeader->fp);
+                bool isBase = !deltaBases.empty() && deltaBases.count(blockHeader->fp);
+                // encoded chunks are decoded once they are found to be restored, deltas once their bases are.
+                if (blockHeader->encoding == (uint32_t) ChunkEncoding::Delta) {
+                    if (positions.first != positions.second) {
+                        chunkPtr = decodeDelta(blockHeader, chunkPtr, decodeBuffer);
+                        if (!chunkPtr) {
+                            deferDelta(blockHeader);
+                            positions.second = positions.first;
+                        }
+                    }
+                } else if ((positions.first != positions.second || isBase) && blockHeader->encoding) {
+                    chunkPtr = ChunkCompressor::decode(blockHeader, chunkPtr, decodeBuffer);
+                    if (!chunkPtr) {
+                        printf("Can not decode chunk of encoding %u\n", blockHeader->encoding);
+                        positions.second = positions.first;
                     }
                 }
+                if (isBase && chunkPtr) {
+                    cacheBase(blockHeader->fp, chunkPtr, chunkLength);
+                }
+                writeChunk(positions, chunkPtr, chunkLength);
+                offset += sizeof(BlockHeader) + blockHeader->length;
+            }
+            delete restoreParseJob;
+        }
+    }
+
+    void writeChunk(std::pair<const uint64_t *, const uint64_t *> positions, const uint8_t *chunkPtr,
+                    uint64_t chunkLength) {
+        for (auto item = positions.first; item != positions.second; item++) {
+            // chunks at the ends of a restored range are written in part.
+            uint64_t begin = std::max(*item, rangeBegin);
+            uint64_t end = std::min(*item + chunkLength, rangeEnd);
+            if (begin >= end) continue;
+            totalLength += end - begin;
+            RestoreWriteTask *restoreWriteTask = new RestoreWriteTask((uint8_t *) chunkPtr + (begin - *item),
+                                                                      begin - rangeBegin, end - begin);
+            GlobalRestoreWritePipelinePtr->addTask(restoreWriteTask);
+        }
+    }
 
-                readoffset += sizeof(BlockHeader) + blockHeader->length;
-                parseLeft -= sizeof(BlockHeader) + blockHeader->length;
+    // Bases are kept until the end of the window, and a base is not changed once cached, so that it is read without
+    // the lock.
+    void cacheBase(const SHA1FP &fp, const uint8_t *chunkPtr, uint64_t chunkLength) {
+        MutexLockGuard mutexLockGuard(deltaMutexLock);
+        if (baseCache.find(fp) == baseCache.end()) {
+            baseCache[fp].assign(chunkPtr, chunkPtr + chunkLength);
+        }
+    }
+
+    // returns the chunk of a delta decoded into buffer, or nullptr when its base has not been parsed yet.
+    const uint8_t *decodeDelta(const BlockHeader *blockHeader, const uint8_t *data, std::vector<uint8_t> &buffer) {
+        const std::vector<uint8_t> *base;
+        {
+            MutexLockGuard mutexLockGuard(deltaMutexLock);
+            auto iter = baseCache.find(DeltaCompressor::baseOf(data));
+            if (iter == baseCache.end()) {
+                return nullptr;
             }
+            base = &iter->second;
+        }
+        buffer.resize(blockHeader->decodedLength);
+        if (!DeltaCompressor::decode(base->data(), base->size(), data, blockHeader->length, buffer.data(),
+                                     blockHeader->decodedLength)) {
+            printf("Can not decode delta chunk\n");
+            return nullptr;
+        }
+        return buffer.data();
+    }
 
-            delete restoreParseTask;
-            gettimeofday(&t1, NULL);
-            duration += (t1.tv_sec-t0.tv_sec)*1000000 + t1.tv_usec - t0.tv_usec;
+    // keeps a copy of a delta whose base has not been parsed, which is decoded at the end of the window.
+    void deferDelta(const BlockHeader *blockHeader) {
+        MutexLockGuard mutexLockGuard(deltaMutexLock);
+        deferredDeltas.emplace_back((const uint8_t *) blockHeader,
+                                    (const uint8_t *) blockHeader + sizeof(BlockHeader) + blockHeader->length);
+    }
+
+    // called when every job of the window has been parsed, so that every base of the window has been cached.
+    void resolveDeltas() {
+        std::vector<uint8_t> decodeBuffer;
+        for (auto &item : deferredDeltas) {
+            BlockHeader *blockHeader = (BlockHeader *) item.data();
+            const uint8_t *chunkPtr = decodeDelta(blockHeader, item.data() + sizeof(BlockHeader), decodeBuffer);
+            if (!chunkPtr) {
+                printf("Base of delta chunk is missing\n");
+                continue;
+            }
+            writeChunk(restoreMap.lookup(blockHeader->fp), chunkPtr, blockHeader->decodedLength);
         }
+        if (!deferredDeltas.empty()) {
+            printf("%lu delta chunks are decoded after their bases\n", deferredDeltas.size());
+        }
+        deferredDeltas.clear();
+        baseCache.clear();
     }
 
     bool runningFlag;
@@ -153,9 +728,46 @@ private:
     MutexLock mutexLock;
     Condition condition;
 
-    uint64_t totalLength = 0;
+    std::vector<std::thread *> parsers;
+    std::list<RestoreParseJob *> jobList;
+    MutexLock jobMutexLock;
+    Condition jobCondition;
+
+    std::atomic<uint64_t> totalLength{0};
+    uint64_t totalSize = 0;
+    uint64_t readLength = 0;
+
+    RestoreMap restoreMap;
+    std::vector<RecipeReader *> recipes;
+    std::vector<uint64_t> recipeCounts;
+    uint64_t recipeCount = 0;
+    // first chunk of each window, and the end of the last one.
+    std::vector<uint64_t> windowBounds;
+    uint64_t windowAmount = 1;
+    uint64_t loadedWindows = 0;
+    MutexLock windowMutexLock;
+    Condition windowCondition;
+
+    bool rangeFlag = false;
+    uint64_t rangeBegin = 0;
+    uint64_t rangeEnd = -1;
+    uint64_t chunkBegin = 0;
+    uint64_t chunkEnd = 0;
+    uint64_t chunkBeginPos = 0;
+
+    RecipeReader *baseRecipe = nullptr;
+    std::vector<BlockHeader> baseHeaders;
+    uint64_t baseIndex = 0;
+    uint64_t basePos = 0;
+    uint64_t unchangedChunks = 0;
+    uint64_t unchangedLength = 0;
 
-    std::unordered_map<SHA1FP, std::list<uint64_t>, TupleHasher, TupleEqualer> restoreMap;
+    // delta chunks of the restored versions with their bases, bases of the current window, and those parsed.
+    std::map<SHA1FP, SHA1FP> deltaReferences;
+    std::set<SHA1FP> deltaBases;
+    std::map<SHA1FP, std::vector<uint8_t>> baseCache;
+    std::vector<std::vector<uint8_t>> deferredDeltas;
+    MutexLock deltaMutexLock;
 
     uint64_t duration = 0;
 };
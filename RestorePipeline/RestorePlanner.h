@@ -0,0 +1,297 @@
+//  Copyright (c) Xiangyu Zou, 2020. All rights reserved.
+//  This source code is licensed under the GPLv2
+
+#ifndef MFDEDUP_RESTOREPLANNER_H
+#define MFDEDUP_RESTOREPLANNER_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <functional>
+#include "gflags/gflags.h"
+#include "../Utility/StorageTask.h"
+#include "../Utility/FileOperator.h"
+#include "../Utility/ChunkIndex.h"
+
+extern std::string VersionFilePath;
+extern std::string ClassFilePath;
+extern std::string ClassFileAppendPath;
+extern std::string RestoreCalibrationPath;
+
+DEFINE_uint64(RestoreCoalesceGap,
+              1048576, "unneeded bytes between two extents below which a selective plan reads them as one");
+DEFINE_bool(RestoreSkipChunks,
+            true, "when arrangement falls behind, read only extents of files holding chunks of the restored version");
+DEFINE_double(RestorePlanThroughput,
+              200, "restore throughput in MB/s which a restore plan assumes before any restore has been timed");
+
+const uint64_t RestoreCalibrationRecords = 16;
+
+// A contiguous range of a file which is parsed as a stream of chunks.
+struct ReadExtent {
+    std::string path;
+    uint64_t offset;
+    uint64_t length;
+    uint64_t index;
+};
+
+// A file of the plan, with what is read of it.
+struct PlannedFile {
+    std::string path;
+    uint64_t fileLength;
+    uint64_t readLength;
+    uint64_t extents;
+    bool indexed;
+    // the file had no current sidecar, and has been scanned for its chunks by this plan.
+    bool scanned;
+};
+
+// Decides which ranges of volumes and categories a restore reads, from the manifest, volume headers and chunk indexes,
+// without reading chunks.
+class RestorePlanner {
+public:
+    // lists files required by the restored versions. Files required by several versions are planned once, and volumes
+    // are read as far as the newest version requires.
+    void planFiles(RestoreTask *restoreTask) {
+        volumeSections.clear();
+        classSet.clear();
+        std::vector<uint64_t> targetVersions = restoreTask->targetVersions;
+        if (targetVersions.empty()) {
+            targetVersions.push_back(restoreTask->targetVersion);
+        }
+        for (auto targetVersion : targetVersions) {
+            std::vector<uint64_t> classList, versionList;
+            baseClass = planVersion(restoreTask, targetVersion, versionList, classList);
+            for (auto item : versionList) {
+                volumeSections[item] = std::max(volumeSections[item], targetVersion);
+            }
+            classSet.insert(classList.begin(), classList.end());
+        }
+    }
+
+    // plans the required files as a whole.
+    void planExtents(std::vector<ReadExtent> &extents) {
+        extents.clear();
+        plannedFiles.clear();
+        for (auto &volume : volumeSections) {
+            // chunks of a restored version v are in the first v sections of a volume.
+            uint64_t item = volume.first, restoreVersion = volume.second;
+            sprintf(filePath, VersionFilePath.data(), item);
+            FileOperator versionReader(filePath, FileOpenType::Read);
+            if (!versionReader.ok()) {
+                printf("Planned file %s is missing, the restore fails\n", filePath);
+                exit(1);
+            }
+            VolumeFileHeader volumeFileHeader;
+            versionReader.read((uint8_t *) &volumeFileHeader, sizeof(VolumeFileHeader));
+            uint64_t *offset = (uint64_t *) malloc(volumeFileHeader.offsetCount * sizeof(uint64_t));
+            versionReader.read((uint8_t *) offset, volumeFileHeader.offsetCount * sizeof(uint64_t));
+            uint64_t length = 0;
+            for (uint64_t i = 0; i < restoreVersion; i++) {
+                length += offset[i];
+            }
+            free(offset);
+            addExtent(extents, filePath, sizeof(VolumeFileHeader) + volumeFileHeader.offsetCount * sizeof(uint64_t),
+                      length, item);
+        }
+        for (auto &item : classSet) {
+            sprintf(filePath, ClassFilePath.data(), item);
+            addExtent(extents, filePath, 0, FileOperator::size(filePath), item);
+        }
+        printf("Trying to load append file.\n");
+        sprintf(filePath, ClassFileAppendPath.data(), baseClass);
+        if (FileOperator::size(filePath)) {
+            addExtent(extents, filePath, 0, FileOperator::size(filePath), baseClass);
+        } else {
+            printf("Append file not exists, ignore it.\n");
+        }
+    }
+
+    // Replaces each file of the plan with its extents holding chunks which are contained, found by the chunk index of
+    // the file. Extents separated by less than RestoreCoalesceGap are read as one. Files without an index are scanned
+    // unless scanFiles is false, in which case the file is read as a whole. It is called on the extents of planExtents()
+    // for each window of a restore, and indexes are loaded, or files scanned, once for all of them.
+    void selectExtents(std::vector<ReadExtent> &extents, const std::function<bool(const SHA1FP &)> &contains,
+                       bool scanFiles = true) {
+        std::vector<ReadExtent> fileExtents;
+        fileExtents.swap(extents);
+        uint64_t plannedLength = 0, selectedLength = 0, scannedFiles = 0;
+        for (uint64_t f = 0; f < fileExtents.size(); f++) {
+            ReadExtent &fileExtent = fileExtents[f];
+            PlannedFile &plannedFile = plannedFiles[f];
+            plannedLength += fileExtent.length;
+            auto loaded = chunkIndexes.find(fileExtent.path);
+            bool scanned = false;
+            if (loaded == chunkIndexes.end()) {
+                loaded = chunkIndexes.emplace(fileExtent.path, ChunkIndex()).first;
+                if (loaded->second.load(fileExtent.path, fileExtent.offset, scanFiles) != 0) {
+                    unindexedFiles.insert(fileExtent.path);
+                }
+                scanned = loaded->second.isScanned();
+                scannedFiles += scanned;
+            }
+            if (unindexedFiles.count(fileExtent.path)) {
+                extents.push_back(fileExtent);
+                selectedLength += fileExtent.length;
+                continue;
+            }
+            const ChunkIndex &chunkIndex = loaded->second;
+            plannedFile.indexed = true;
+            plannedFile.scanned = scanned;
+            plannedFile.readLength = 0;
+            plannedFile.extents = 0;
+            uint64_t end = fileExtent.offset + fileExtent.length;
+            uint64_t extentBegin = 0, extentEnd = 0;
+            for (auto &entry : chunkIndex.getEntries()) {
+                if (entry.offset + entry.length > end) break;
+                if (!contains(entry.fp)) continue;
+                if (extentEnd && entry.offset <= extentEnd + FLAGS_RestoreCoalesceGap) {
+                    extentEnd = entry.offset + entry.length;
+                    continue;
+                }
+                if (extentEnd) {
+                    extents.push_back({fileExtent.path, extentBegin, extentEnd - extentBegin, fileExtent.index});
+                    plannedFile.readLength += extentEnd - extentBegin;
+                    plannedFile.extents++;
+                }
+                extentBegin = entry.offset;
+                extentEnd = entry.offset + entry.length;
+            }
+            if (extentEnd) {
+                extents.push_back({fileExtent.path, extentBegin, extentEnd - extentBegin, fileExtent.index});
+                plannedFile.readLength += extentEnd - extentBegin;
+                plannedFile.extents++;
+            }
+            selectedLength += plannedFile.readLength;
+        }
+        printf("Selective plan reads %lu of %lu bytes in %lu extents, %lu files without chunk index scanned\n",
+               selectedLength, plannedLength, extents.size(), scannedFiles);
+    }
+
+    const std::vector<PlannedFile> &getPlannedFiles() const {
+        return plannedFiles;
+    }
+
+    // bytes which the plan reads. A file without a current sidecar is counted as a whole, since it is either read or
+    // scanned as a whole.
+    uint64_t getPredictedLength() const {
+        uint64_t length = 0;
+        for (auto &plannedFile : plannedFiles) {
+            length += plannedFile.indexed && !plannedFile.scanned ? plannedFile.readLength : plannedFile.fileLength;
+        }
+        return length;
+    }
+
+private:
+    // lists volumes and categories required by a version, and returns the base category of the layout.
+    uint64_t planVersion(RestoreTask *restoreTask, uint64_t targetVersion, std::vector<uint64_t> &versionList,
+                         std::vector<uint64_t> &classList) {
+        uint64_t baseClass = 0;
+        if(restoreTask->fallBehind == 0){
+            for (uint64_t i = targetVersion; i <= restoreTask->maxVersion - 1; i++) {
+                versionList.push_back(i);
+                printf("version # %lu is required\n", i);
+            }
+            baseClass = (restoreTask->maxVersion - 1) * restoreTask->maxVersion / 2 + 1;
+            for (uint64_t i = baseClass; i < baseClass + targetVersion; i++) {
+                classList.push_back(i);
+                printf("category # %lu is required\n", i);
+            }
+            printf("append category # %lu is optional\n", baseClass);
+        }else{
+            //processing when arrangement falls behind.
+            printf("Arrangement falls %lu versions behind\n", restoreTask->fallBehind);
+            // versions covered by the existing OPT layout
+            uint64_t layoutVersion = restoreTask->maxVersion - restoreTask->fallBehind;
+            printf("Load the last version in existing OPT layout..\n");
+            for (uint64_t i = targetVersion; i + 1 <= layoutVersion; i++) {
+                versionList.push_back(i);
+                printf("version # %lu is required\n", i);
+            }
+            baseClass = layoutVersion ? (layoutVersion - 1) * layoutVersion / 2 + 1 : 1;
+            uint64_t layoutClasses = std::min(targetVersion, layoutVersion);
+            for (uint64_t i = baseClass; i < baseClass + layoutClasses; i++) {
+                classList.push_back(i);
+                printf("category # %lu is required\n", i);
+            }
+            printf("append category # %lu is optional\n", baseClass);
+            // read unique chunks of following versions.
+            printf("The new categories of following versions..\n");
+            for (uint64_t i = layoutVersion + 1; i <= targetVersion; i++){
+                classList.push_back(i*(i+1)/2);
+                printf("category # %lu is required\n", i*(i+1)/2);
+            }
+        }
+        return baseClass;
+    }
+
+    void addExtent(std::vector<ReadExtent> &extents, const char *path, uint64_t offset, uint64_t length,
+                   uint64_t index) {
+        extents.push_back({path, offset, length, index});
+        plannedFiles.push_back({path, length, length, 1, false, false});
+    }
+
+    char filePath[256];
+    uint64_t baseClass = 0;
+    std::map<uint64_t, uint64_t> volumeSections;
+    std::set<uint64_t> classSet;
+    std::vector<PlannedFile> plannedFiles;
+    std::map<std::string, ChunkIndex> chunkIndexes;
+    std::set<std::string> unindexedFiles;
+};
+
+// Read bytes and durations of the latest restores, from which a restore plan estimates how long it takes.
+class RestoreCalibration {
+public:
+    RestoreCalibration() {
+        FileOperator fileOperator((char *) RestoreCalibrationPath.data(), FileOpenType::Read);
+        if (!fileOperator.ok()) {
+            return;
+        }
+        records.resize(RestoreCalibrationRecords);
+        uint64_t readSize = fileOperator.read((uint8_t *) records.data(), records.size() * sizeof(Record));
+        records.resize(readSize / sizeof(Record));
+    }
+
+    // keeps the latest records only, so that the estimate follows changes of the device.
+    int record(uint64_t readLength, uint64_t duration) {
+        if (readLength == 0 || duration == 0) {
+            return -1;
+        }
+        records.push_back({readLength, duration});
+        if (records.size() > RestoreCalibrationRecords) {
+            records.erase(records.begin(), records.end() - RestoreCalibrationRecords);
+        }
+        FileOperator fileOperator((char *) RestoreCalibrationPath.data(), FileOpenType::Write);
+        if (!fileOperator.ok()) {
+            return -1;
+        }
+        fileOperator.write((uint8_t *) records.data(), records.size() * sizeof(Record));
+        return 0;
+    }
+
+    bool isCalibrated() const {
+        return !records.empty();
+    }
+
+    // bytes per microsecond, i.e. MB/s.
+    double getThroughput() const {
+        uint64_t readLength = 0, duration = 0;
+        for (auto &item : records) {
+            readLength += item.readLength;
+            duration += item.duration;
+        }
+        return duration ? (double) readLength / duration : FLAGS_RestorePlanThroughput;
+    }
+
+private:
+    struct Record {
+        uint64_t readLength;
+        uint64_t duration;
+    };
+
+    std::vector<Record> records;
+};
+
+#endif //MFDEDUP_RESTOREPLANNER_H
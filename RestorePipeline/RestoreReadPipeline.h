@@ -6,13 +6,20 @@
 
 #include <fcntl.h>
 #include "RestoreParserPipeline.h"
+#include "RestorePlanner.h"
 
 extern std::string ClassFileAppendPath;
 
+DEFINE_uint64(RestoreReadThreads,
+              4, "how many files are read concurrently by restore");
+DEFINE_uint64(RestoreReadQueueLength,
+              2, "read buffers of a file waiting for the parser, which bounds the memory of concurrent reads");
+
 class RestoreReadPipeline {
 public:
     RestoreReadPipeline() : taskAmount(0), runningFlag(true), mutexLock(),
-                            condition(mutexLock) {
+                            condition(mutexLock), readMutexLock(), readCondition(readMutexLock) {
+        GlobalRestoreIOLimiter.configure(FLAGS_RestoreBandwidth, FLAGS_RestoreIOPS);
         worker = new std::thread(std::bind(&RestoreReadPipeline::restoreReadCallback, this));
     }
 
@@ -35,6 +42,8 @@ private:
         RestoreTask *restoreTask;
 
         struct timeval t0, t1;
+        // restore is latency-critical
+        setIOPriority(IOPriorityClass::BestEffort, 0);
 
         while (likely(runningFlag)) {
             {
@@ -50,50 +59,53 @@ private:
             }
             gettimeofday(&t0, NULL);
 
-            uint64_t baseClass = 0;
-            std::vector<uint64_t> classList, versionList;
-            if(restoreTask->fallBehind == 0 || (restoreTask->maxVersion - restoreTask->fallBehind) >= restoreTask->targetVersion){
-                for (uint64_t i = restoreTask->targetVersion; i <= restoreTask->maxVersion - 1; i++) {
-                    versionList.push_back(i);
-                    printf("version # %lu is required\n", i);
-                }
-                uint64_t baseClass = (restoreTask->maxVersion - 1) * restoreTask->maxVersion / 2 + 1;
-                for (uint64_t i = baseClass; i < baseClass + restoreTask->targetVersion; i++) {
-                    classList.push_back(i);
-                    printf("category # %lu is required\n", i);
+            RestorePlanner restorePlanner;
+            restorePlanner.planFiles(restoreTask);
+            std::vector<ReadExtent> fileExtents;
+            restorePlanner.planExtents(fileExtents);
+            readExtents = 0;
+            peakReadingUnits = 0;
+
+            // files are read concurrently, and delivered to the parser in the order of the plan. Each window of
+            // recipe reads only the extents holding its chunks, which are found by the chunk indexes loaded with the
+            // first window.
+            // When arrangement falls behind, categories hold chunks of other versions, which are skipped.
+            uint64_t windowAmount = GlobalRestoreParserPipelinePtr->getWindowAmount();
+            bool selective = GlobalRestoreParserPipelinePtr->isSelective() ||
+                             (restoreTask->fallBehind && FLAGS_RestoreSkipChunks);
+            uint64_t plannedLength = 0;
+            for (uint64_t window = 0; window < windowAmount; window++) {
+                std::vector<ReadExtent> extents = fileExtents;
+                if (selective) {
+                    GlobalRestoreParserPipelinePtr->waitWindow(window);
+                    restorePlanner.selectExtents(extents, [](const SHA1FP &fp) {
+                        return GlobalRestoreParserPipelinePtr->contains(fp);
+                    });
                 }
-                printf("append category # %lu is optional\n", baseClass);
-            }else{
-                //processing when arrangement falls behind.
-                printf("Arrangement falls %lu versions behind\n", restoreTask->fallBehind);
-                // read the last version in previous OPT layout
-                printf("Load the last version in existing OPT layout..\n");
-                for (uint64_t i = restoreTask->targetVersion; i <= restoreTask->maxVersion - 1 - restoreTask->fallBehind; i++) {
-                    versionList.push_back(i);
-                    printf("version # %lu is required\n", i);
+                readUnits.clear();
+                nextReadUnit = 0;
+                for (auto &extent : extents) {
+                    addReadUnit(extent.path.data(), extent.offset, extent.length, extent.index);
                 }
-                baseClass = (restoreTask->maxVersion - 1 - restoreTask->fallBehind) * (restoreTask->maxVersion - restoreTask->fallBehind) / 2 + 1;
-                for (uint64_t i = baseClass; i < baseClass + restoreTask->targetVersion - restoreTask->fallBehind; i++) {
-                    classList.push_back(i);
-                    printf("category # %lu is required\n", i);
+                readExtents += extents.size();
+                plannedLength += restorePlanner.getPredictedLength();
+                startReaders();
+                for (uint64_t i = 0; i < readUnits.size(); i++) {
+                    deliverReadUnit(i);
                 }
-                printf("append category # %lu is optional\n", baseClass);
-                // read unique chunks of following versions.
-                printf("The new categories of following versions..\n");
-                for (uint64_t i = restoreTask->maxVersion - restoreTask->fallBehind + 1; i<= restoreTask->maxVersion; i++){
-                    classList.push_back(i*(i+1)/2);
-                    printf("category # %lu is required\n", i*(i+1)/2);
+                stopReaders();
+                if (window + 1 < windowAmount) {
+                    RestoreParseTask *restoreParseTask = new RestoreParseTask(nullptr, 0);
+                    restoreParseTask->windowEndFlag = true;
+                    GlobalRestoreParserPipelinePtr->addTask(restoreParseTask);
                 }
             }
 
+            printf("Restore read %lu extents, up to %lu of them at once\n", readExtents, peakReadingUnits);
 
-            for (auto &item : versionList) {
-                readFromVolumeFile(item, restoreTask->targetVersion);
-            }
-            for (auto &item : classList) {
-                readFromCategoryFile(item);
-            }
-            readFromAppendCategoryFile(baseClass);
+            GlobalRestoreParserPipelinePtr->waitWindow(windowAmount - 1);
+            uint64_t totalSize = GlobalRestoreParserPipelinePtr->getTotalSize();
+            printf("Predicted read amplification : %f\n", totalSize ? (float) plannedLength / totalSize : 0);
 
             RestoreParseTask *restoreParseTask = new RestoreParseTask(true);
             GlobalRestoreParserPipelinePtr->addTask(restoreParseTask);
@@ -104,101 +116,126 @@ private:
         }
     }
 
-    int readFromVolumeFile(uint64_t versionId, uint64_t restoreVersion) {
-        sprintf(filePath, VersionFilePath.data(), versionId);
-        FileOperator versionReader(filePath, FileOpenType::Read);
-        FILE* versionFileFD = versionReader.getFP();
-
-        VolumeFileHeader* volumeFileHeader;
-
-        uint64_t leftLength = 0;
-        {
-            uint8_t *readBuffer = (uint8_t *) malloc(FLAGS_RestoreReadBufferLength);
-            uint64_t bytesToRead = FLAGS_RestoreReadBufferLength;
-            uint64_t bytesFinallyRead = fread(readBuffer, 1, bytesToRead, versionFileFD);
-            volumeFileHeader = (VolumeFileHeader*)readBuffer;
-            uint64_t* offset = (uint64_t*)(readBuffer + sizeof(VolumeFileHeader));
-            for(int i=0; i<restoreVersion; i++){
-                leftLength += offset[i];
-            }
-            uint64_t totalHeaderLength = sizeof(VolumeFileHeader) + volumeFileHeader->offsetCount * sizeof(uint64_t);
-
-            if(leftLength < bytesFinallyRead - totalHeaderLength){
-                RestoreParseTask* restoreParseTask = new RestoreParseTask(readBuffer, leftLength);
-                restoreParseTask->index = versionId;
-                restoreParseTask->beginPos = totalHeaderLength;
-                GlobalRestoreParserPipelinePtr->addTask(restoreParseTask);
-                leftLength = 0;
-            }else{
-                RestoreParseTask* restoreParseTask = new RestoreParseTask(readBuffer, bytesFinallyRead - totalHeaderLength);
-                restoreParseTask->index = versionId;
-                restoreParseTask->beginPos = totalHeaderLength;
-                GlobalRestoreParserPipelinePtr->addTask(restoreParseTask);
-                leftLength -= bytesFinallyRead - totalHeaderLength;
-            }
-        }
-
-        while (leftLength > 0) {
-            uint8_t *readBuffer = (uint8_t *) malloc(FLAGS_RestoreReadBufferLength);
-            uint64_t bytesToRead =
-                    leftLength > FLAGS_RestoreReadBufferLength ? FLAGS_RestoreReadBufferLength : leftLength;
-            uint64_t bytesFinallyRead = fread(readBuffer, 1, bytesToRead, versionFileFD);
-            leftLength -= bytesFinallyRead;
+    // A range of a file of the plan, with its buffers waiting for delivery.
+    struct ReadUnit {
+        std::string path;
+        uint64_t offset;
+        uint64_t length;
+        uint64_t index;
+        std::list<RestoreParseTask *> buffers;
+        bool finished = false;
+    };
+
+    void addReadUnit(const char *path, uint64_t offset, uint64_t length, uint64_t index) {
+        readUnits.emplace_back();
+        ReadUnit &readUnit = readUnits.back();
+        readUnit.path = path;
+        readUnit.offset = offset;
+        readUnit.length = length;
+        readUnit.index = index;
+    }
 
-            RestoreParseTask* restoreParseTask = new RestoreParseTask(readBuffer, bytesFinallyRead);
-            restoreParseTask->index = versionId;
-            GlobalRestoreParserPipelinePtr->addTask(restoreParseTask);
+    void startReaders() {
+        uint64_t readers = FLAGS_RestoreReadThreads ? FLAGS_RestoreReadThreads : 1;
+        for (uint64_t i = 0; i < readers; i++) {
+            readerThreads.push_back(new std::thread(std::bind(&RestoreReadPipeline::readerCallback, this)));
         }
     }
 
-
-    int readFromCategoryFile(uint64_t classId) {
-        sprintf(filePath, ClassFilePath.data(), classId);
-        FileOperator classReader(filePath, FileOpenType::Read);
-        int fd = classReader.getFd();
-
-        uint64_t leftLength = FileOperator::size(filePath);
-
-        while (leftLength > 0) {
-            uint8_t *readBuffer = (uint8_t *) malloc(FLAGS_RestoreReadBufferLength);
-            uint64_t bytesToRead =
-                    leftLength > FLAGS_RestoreReadBufferLength ? FLAGS_RestoreReadBufferLength : leftLength;
-            uint64_t bytesFinallyRead = read(fd, readBuffer, bytesToRead);
-
-            leftLength -= bytesFinallyRead;
-
-            RestoreParseTask *restoreParseTask = new RestoreParseTask(readBuffer, bytesFinallyRead);
-            restoreParseTask->index = classId;
-            GlobalRestoreParserPipelinePtr->addTask(restoreParseTask);
+    void stopReaders() {
+        for (auto reader : readerThreads) {
+            reader->join();
+            delete reader;
         }
+        readerThreads.clear();
     }
 
-    int readFromAppendCategoryFile(uint64_t classId) {
-        printf("Trying to load append file.\n");
-        sprintf(filePath, ClassFileAppendPath.data(), classId);
-        FileOperator classReader(filePath, FileOpenType::Read);
-        if(classReader.ok()){
-            int fd = classReader.getFd();
-
-            uint64_t leftLength = FileOperator::size(filePath);
-
+    // Each reader takes the next file of the plan, and reads it sequentially. At most RestoreReadQueueLength buffers
+    // of a file wait for delivery, so readers of later files block until the parser catches up.
+    void readerCallback() {
+        setIOPriority(IOPriorityClass::BestEffort, 0);
+        while (true) {
+            ReadUnit *readUnit;
+            {
+                MutexLockGuard mutexLockGuard(readMutexLock);
+                if (nextReadUnit >= readUnits.size()) {
+                    break;
+                }
+                readUnit = &readUnits[nextReadUnit++];
+                readingUnits++;
+                peakReadingUnits = std::max(peakReadingUnits, readingUnits);
+            }
+            FileOperator reader((char *) readUnit->path.data(), FileOpenType::Read);
+            // a planned file may be missing, e.g. removed by an arrangement committed since, and the restore fails.
+            if (!reader.ok()) {
+                printf("Planned file %s is missing, the restore fails\n", readUnit->path.data());
+                exit(1);
+            }
+            int fd = reader.getFd();
+            uint64_t offset = readUnit->offset;
+            uint64_t leftLength = readUnit->length;
+            // direct reads start at the block of the extent, whose data then begins at beginPos of the buffer.
+            bool direct = FLAGS_DirectIO && reader.setDirect(true) == 0;
+            if (!direct) {
+                reader.adviseSequential(offset, offset + leftLength, FLAGS_ReadAdviceWindow);
+            }
+            uint64_t bufferLength = direct ? alignUp(FLAGS_RestoreReadBufferLength) : FLAGS_RestoreReadBufferLength;
             while (leftLength > 0) {
-                uint8_t *readBuffer = (uint8_t *) malloc(FLAGS_RestoreReadBufferLength);
-                uint64_t bytesToRead =
-                        leftLength > FLAGS_RestoreReadBufferLength ? FLAGS_RestoreReadBufferLength : leftLength;
-                uint64_t bytesFinallyRead = read(fd, readBuffer, bytesToRead);
-
+                uint64_t beginPos = direct ? offset - alignDown(offset) : 0;
+                uint8_t *readBuffer = direct ? alignedMalloc(bufferLength) : (uint8_t *) malloc(bufferLength);
+                uint64_t bytesToRead = std::min(leftLength, bufferLength - beginPos);
+                int64_t bytesFinallyRead = direct
+                                           ? pread(fd, readBuffer, alignUp(beginPos + bytesToRead), offset - beginPos)
+                                           : pread(fd, readBuffer, bytesToRead, offset);
+                if (bytesFinallyRead <= (int64_t) beginPos) {
+                    printf("Can not read %s : %s, the restore fails\n", readUnit->path.data(), strerror(errno));
+                    exit(1);
+                }
+                GlobalRestoreIOLimiter.acquire(bytesFinallyRead);
+                bytesFinallyRead = std::min(bytesFinallyRead - beginPos, bytesToRead);
+                offset += bytesFinallyRead;
                 leftLength -= bytesFinallyRead;
+                if (!direct) {
+                    reader.advise(offset);
+                }
+
+                RestoreParseTask *restoreParseTask = new RestoreParseTask(readBuffer, beginPos + bytesFinallyRead);
+                restoreParseTask->beginPos = beginPos;
+                restoreParseTask->index = readUnit->index;
 
-                RestoreParseTask *restoreParseTask = new RestoreParseTask(readBuffer, bytesFinallyRead);
-                restoreParseTask->index = classId;
-                GlobalRestoreParserPipelinePtr->addTask(restoreParseTask);
+                MutexLockGuard mutexLockGuard(readMutexLock);
+                while (readUnit->buffers.size() >= FLAGS_RestoreReadQueueLength) {
+                    readCondition.wait();
+                }
+                readUnit->buffers.push_back(restoreParseTask);
+                readCondition.notifyAll();
             }
-        }else{
-            printf("Append file not exists, ignore it.\n");
+            MutexLockGuard mutexLockGuard(readMutexLock);
+            readUnit->finished = true;
+            readingUnits--;
+            readCondition.notifyAll();
         }
     }
 
+    void deliverReadUnit(uint64_t i) {
+        ReadUnit &readUnit = readUnits[i];
+        while (true) {
+            RestoreParseTask *restoreParseTask;
+            {
+                MutexLockGuard mutexLockGuard(readMutexLock);
+                while (readUnit.buffers.empty() && !readUnit.finished) {
+                    readCondition.wait();
+                }
+                if (readUnit.buffers.empty()) {
+                    break;
+                }
+                restoreParseTask = readUnit.buffers.front();
+                readUnit.buffers.pop_front();
+                readCondition.notifyAll();
+            }
+            GlobalRestoreParserPipelinePtr->addTask(restoreParseTask);
+        }
+    }
 
     char filePath[256];
     bool runningFlag;
@@ -209,6 +246,16 @@ private:
     Condition condition;
 
     uint64_t duration = 0;
+
+    std::vector<ReadUnit> readUnits;
+    uint64_t nextReadUnit = 0;
+    // units taken by readers and not finished, which tells how many files are read concurrently.
+    uint64_t readingUnits = 0;
+    uint64_t peakReadingUnits = 0;
+    uint64_t readExtents = 0;
+    std::vector<std::thread *> readerThreads;
+    MutexLock readMutexLock;
+    Condition readCondition;
 };
 
 static RestoreReadPipeline *GlobalRestoreReadPipelinePtr;
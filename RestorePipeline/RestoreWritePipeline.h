@@ -4,9 +4,25 @@
 #ifndef MFDEDUP_RESTOREWRITEPIPELINE_H
 #define MFDEDUP_RESTOREWRITEPIPELINE_H
 
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <fcntl.h>
+#include "../Utility/Durability.h"
+
+DEFINE_bool(RestoreStream,
+            false, "write the restored version in order, which is implied when the restore path is - (stdout), a pipe or a device");
+DEFINE_uint64(RestoreReorderWindow,
+              268435456, "memory (bytes) of chunks which arrive ahead of the streaming position");
+DEFINE_string(RestoreSpillPath,
+              "", "file holding chunks beyond the reorder window, empty means the window grows instead");
+DEFINE_uint64(RestoreBase,
+              0, "version which the restore path already holds, only chunks differing from it are written, 0 means none");
+
 class FileFlusher{
 public:
-    FileFlusher(FileOperator* f): runningFlag(true), taskAmount(0), mutexLock(), condition(mutexLock), fileOperator(f){
+    // a task is the index of the file to be flushed.
+    FileFlusher(const std::vector<FileOperator*>& f): runningFlag(true), taskAmount(0), mutexLock(), condition(mutexLock), fileOperators(f){
         worker = new std::thread(std::bind(&FileFlusher::fileFlusherCallback, this));
     }
 
@@ -15,6 +31,7 @@ public:
         taskList.push_back(task);
         taskAmount++;
         condition.notify();
+        return 0;
     }
 
     ~FileFlusher(){
@@ -44,7 +61,7 @@ private:
                 break;
             }
 
-            fileOperator->fdatasync();
+            fileOperators[task]->fdatasync();
         }
     }
 
@@ -54,14 +71,44 @@ private:
     std::list<uint64_t> taskList;
     MutexLock mutexLock;
     Condition condition;
-    FileOperator* fileOperator;
+    std::vector<FileOperator*> fileOperators;
 };
 
 class RestoreWritePipeline {
 public:
-    RestoreWritePipeline(std::string restorePath, CountdownLatch *cd) : taskAmount(0), runningFlag(true), mutexLock(),
-                                               condition(mutexLock), countdownLatch(cd) {
-        fileOperator = new FileOperator((char*)restorePath.data(), FileOpenType::Write);
+    RestoreWritePipeline(std::string restorePath, CountdownLatch *cd) : countdownLatch(cd), runningFlag(true),
+                                                                         taskAmount(0), mutexLock(),
+                                                                         condition(mutexLock) {
+        gettimeofday(&startTime, NULL);
+        struct stat statBuffer;
+        if (restorePath == "-") {
+            // restored data take over stdout, and reports (including those still buffered) go to stderr.
+            streamFlag = true;
+            streamFd = dup(STDOUT_FILENO);
+            dup2(STDERR_FILENO, STDOUT_FILENO);
+        } else if (FLAGS_RestoreStream ||
+                   (stat(restorePath.data(), &statBuffer) == 0 && !S_ISREG(statBuffer.st_mode))) {
+            streamFlag = true;
+            streamFd = open(restorePath.data(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        } else {
+            // an incremental restore updates the existing copy of the base version in place.
+            outputs.push_back(new FileOperator((char*)restorePath.data(),
+                                               FLAGS_RestoreBase ? FileOpenType::ReadWrite : FileOpenType::Write));
+        }
+        if (streamFlag && !FLAGS_RestoreSpillPath.empty()) {
+            spillOperator = new FileOperator((char*)FLAGS_RestoreSpillPath.data(), FileOpenType::Write);
+        }
+        worker = new std::thread(std::bind(&RestoreWritePipeline::restoreWriteCallback, this));
+    }
+
+    // Restores several versions at once. Positions of chunks are those in the versions concatenated, see
+    // setOutputSizes().
+    RestoreWritePipeline(const std::vector<std::string> &restorePaths, CountdownLatch *cd)
+            : countdownLatch(cd), runningFlag(true), taskAmount(0), mutexLock(), condition(mutexLock) {
+        gettimeofday(&startTime, NULL);
+        for (auto &restorePath : restorePaths) {
+            outputs.push_back(new FileOperator((char*)restorePath.data(), FileOpenType::Write));
+        }
         worker = new std::thread(std::bind(&RestoreWritePipeline::restoreWriteCallback, this));
     }
 
@@ -70,6 +117,7 @@ public:
         taskList.push_back(restoreWriteTask);
         taskAmount++;
         condition.notify();
+        return 0;
     }
 
     ~RestoreWritePipeline() {
@@ -81,9 +129,21 @@ public:
 
     int setSize(uint64_t size){
         totalSize = size;
-        if (fileOperator){
-            fileOperator->trunc(size);
+        if (outputs.size() == 1){
+            outputs[0]->trunc(size);
         }
+        return 0;
+    }
+
+    int setOutputSizes(const std::vector<uint64_t> &sizes){
+        totalSize = 0;
+        outputStarts.clear();
+        for (uint64_t i = 0; i < sizes.size(); i++){
+            outputStarts.push_back(totalSize);
+            outputs[i]->trunc(sizes[i]);
+            totalSize += sizes[i];
+        }
+        return 0;
     }
 
     uint64_t getTotalSize(){
@@ -92,11 +152,16 @@ public:
 
 private:
     void restoreWriteCallback() {
+        if (streamFlag) {
+            restoreStreamCallback();
+            return;
+        }
         RestoreWriteTask *restoreWriteTask;
-        int fd = fileOperator->getFd();
-        FileFlusher fileFlusher(fileOperator);
+        FileFlusher fileFlusher(outputs);
+        std::vector<uint64_t> flushCounters(outputs.size(), 0);
 
         struct timeval t0, t1;
+        setIOPriority(IOPriorityClass::BestEffort, 0);
 
         while (likely(runningFlag)) {
             {
@@ -114,18 +179,31 @@ private:
 
             if (unlikely(restoreWriteTask->endFlag)) {
                 delete restoreWriteTask;
-                fileOperator->fdatasync();
+                for (auto output : outputs) {
+                    GlobalDurability.completed(output);
+                }
                 countdownLatch->countDown();
                 gettimeofday(&t1, NULL);
                 duration += (t1.tv_sec-t0.tv_sec)*1000000 + t1.tv_usec - t0.tv_usec;
                 break;
             }
 
-            pwrite(fd, restoreWriteTask->buffer, restoreWriteTask->length, restoreWriteTask->pos);
+            uint64_t output = 0, pos = restoreWriteTask->pos;
+            if (outputs.size() > 1) {
+                output = std::upper_bound(outputStarts.begin(), outputStarts.end(), pos) - outputStarts.begin() - 1;
+                pos -= outputStarts[output];
+            }
+            GlobalRestoreIOLimiter.acquire(restoreWriteTask->length);
+            pwrite(outputs[output]->getFd(), restoreWriteTask->buffer, restoreWriteTask->length, pos);
 
             syncCounter++;
             if(syncCounter > 1024){
-                fileFlusher.addTask(1);
+                // every 1024 writes are a flush of each output.
+                for (uint64_t i = 0; i < outputs.size(); i++) {
+                    if (GlobalDurability.flushed(outputs[i], flushCounters[i])) {
+                        fileFlusher.addTask(i);
+                    }
+                }
                 syncCounter = 0;
             }
 
@@ -136,6 +214,129 @@ private:
     }
 
 
+    // Chunks are written at the streaming position. A chunk arriving ahead of it waits in the reorder window, and
+    // when the window is full, the chunk needed last goes to the spill file.
+    void restoreStreamCallback() {
+        RestoreWriteTask *restoreWriteTask;
+        struct timeval t0, t1;
+        setIOPriority(IOPriorityClass::BestEffort, 0);
+
+        while (likely(runningFlag)) {
+            {
+                MutexLockGuard mutexLockGuard(mutexLock);
+                while (!taskAmount) {
+                    condition.wait();
+                    if (unlikely(!runningFlag)) break;
+                }
+                if (unlikely(!runningFlag)) continue;
+                taskAmount--;
+                restoreWriteTask = taskList.front();
+                taskList.pop_front();
+            }
+            gettimeofday(&t0, NULL);
+
+            if (unlikely(restoreWriteTask->endFlag)) {
+                delete restoreWriteTask;
+                assert(windowChunks.empty() && spilledChunks.empty());
+                if (streamPos != totalSize) {
+                    printf("Stream ends at %lu of %lu bytes\n", streamPos, totalSize);
+                }
+                fdatasync(streamFd);
+                close(streamFd);
+                if (spillOperator) {
+                    delete spillOperator;
+                    remove(FLAGS_RestoreSpillPath.data());
+                }
+                gettimeofday(&t1, NULL);
+                duration += (t1.tv_sec-t0.tv_sec)*1000000 + t1.tv_usec - t0.tv_usec;
+                uint64_t streamDuration = (t1.tv_sec-startTime.tv_sec)*1000000 + t1.tv_usec - startTime.tv_usec;
+                printf("Time to first byte : %lu us, stream throughput : %f MB/s\n", firstByteTime,
+                       (float) streamPos / streamDuration);
+                printf("Reorder window peak : %lu bytes, spilled : %lu bytes\n", windowPeak, spillLength);
+                countdownLatch->countDown();
+                break;
+            }
+
+            if (restoreWriteTask->pos == streamPos) {
+                streamWrite(restoreWriteTask->buffer, restoreWriteTask->length);
+                delete restoreWriteTask;
+                drainWindow();
+            } else {
+                windowChunks[restoreWriteTask->pos] = restoreWriteTask;
+                windowLength += restoreWriteTask->length;
+                if (windowLength > windowPeak) {
+                    windowPeak = windowLength;
+                }
+                while (spillOperator && windowLength > FLAGS_RestoreReorderWindow) {
+                    spill();
+                }
+                if (!spillOperator && windowLength > FLAGS_RestoreReorderWindow && !windowWarned) {
+                    printf("Reorder window exceeded without a spill file, see --RestoreSpillPath\n");
+                    windowWarned = true;
+                }
+            }
+            gettimeofday(&t1, NULL);
+            duration += (t1.tv_sec-t0.tv_sec)*1000000 + t1.tv_usec - t0.tv_usec;
+        }
+    }
+
+    // writes the chunks following the streaming position.
+    void drainWindow() {
+        while (true) {
+            auto windowIter = windowChunks.find(streamPos);
+            if (windowIter != windowChunks.end()) {
+                RestoreWriteTask *restoreWriteTask = windowIter->second;
+                windowChunks.erase(windowIter);
+                windowLength -= restoreWriteTask->length;
+                streamWrite(restoreWriteTask->buffer, restoreWriteTask->length);
+                delete restoreWriteTask;
+                continue;
+            }
+            auto spillIter = spilledChunks.find(streamPos);
+            if (spillIter != spilledChunks.end()) {
+                uint64_t length = spillIter->second.length;
+                uint8_t *buffer = (uint8_t *) malloc(length);
+                pread(spillOperator->getFd(), buffer, length, spillIter->second.offset);
+                spilledChunks.erase(spillIter);
+                streamWrite(buffer, length);
+                free(buffer);
+                continue;
+            }
+            break;
+        }
+    }
+
+    void spill() {
+        auto iter = std::prev(windowChunks.end());
+        RestoreWriteTask *restoreWriteTask = iter->second;
+        pwrite(spillOperator->getFd(), restoreWriteTask->buffer, restoreWriteTask->length, spillLength);
+        spilledChunks[iter->first] = {spillLength, restoreWriteTask->length};
+        spillLength += restoreWriteTask->length;
+        windowLength -= restoreWriteTask->length;
+        windowChunks.erase(iter);
+        delete restoreWriteTask;
+    }
+
+    void streamWrite(uint8_t *buffer, uint64_t length) {
+        GlobalRestoreIOLimiter.acquire(length);
+        uint64_t written = 0;
+        while (written < length) {
+            ssize_t result = write(streamFd, buffer + written, length - written);
+            if (result < 0) {
+                if (errno == EINTR) continue;
+                printf("Stream write failed : %s\n", strerror(errno));
+                exit(1);
+            }
+            written += result;
+        }
+        if (streamPos == 0) {
+            struct timeval now;
+            gettimeofday(&now, NULL);
+            firstByteTime = (now.tv_sec-startTime.tv_sec)*1000000 + now.tv_usec - startTime.tv_usec;
+        }
+        streamPos += length;
+    }
+
     CountdownLatch *countdownLatch;
     bool runningFlag;
     std::thread *worker;
@@ -143,13 +344,31 @@ private:
     std::list<RestoreWriteTask *> taskList;
     MutexLock mutexLock;
     Condition condition;
-    FileOperator* fileOperator = nullptr;
+    std::vector<FileOperator*> outputs;
+    std::vector<uint64_t> outputStarts;
 
     uint64_t totalSize = 0;
 
     uint64_t duration = 0;
 
     uint64_t syncCounter = 0;
+
+    struct SpilledChunk {
+        uint64_t offset;
+        uint64_t length;
+    };
+    bool streamFlag = false;
+    int streamFd = -1;
+    uint64_t streamPos = 0;
+    std::map<uint64_t, RestoreWriteTask *> windowChunks;
+    uint64_t windowLength = 0;
+    uint64_t windowPeak = 0;
+    bool windowWarned = false;
+    std::map<uint64_t, SpilledChunk> spilledChunks;
+    FileOperator *spillOperator = nullptr;
+    uint64_t spillLength = 0;
+    struct timeval startTime;
+    uint64_t firstByteTime = 0;
 };
 
 static RestoreWritePipeline *GlobalRestoreWritePipelinePtr;
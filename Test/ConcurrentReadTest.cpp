@@ -0,0 +1,55 @@
+//  Copyright (c) Xiangyu Zou, 2020. All rights reserved.
+//  This source code is licensed under the GPLv2
+
+// Behavior test of the restore readers, which read several files of the plan concurrently and deliver their buffers to
+// the parser in the order of the plan. Read buffers are much shorter than chunks, so that almost every chunk straddles
+// buffers, and a buffer delivered out of order corrupts the restored version.
+// Usage: ConcurrentReadTest --Binary=[MFDedup executable] --TestPath=[working path]
+
+#include "TestUtility.h"
+
+const uint64_t ReadVersions = 5;
+const char *SmallBuffers = "--RestoreReadBufferLength=4099 --RestoreReadQueueLength=1";
+
+static std::vector<std::vector<uint8_t>> versions;
+
+static void checkReads(TestRepository &repository, uint64_t version, uint64_t readers,
+                       const std::string &arguments = "") {
+    TEST_CHECK(repository.restore(version, std::string(SmallBuffers) + " --RestoreReadThreads=" +
+                                           std::to_string(readers) + " " + arguments) == 0);
+    TEST_CHECK(fileEquals(repository.outputPath(), versions[version - 1]));
+}
+
+int main(int argc, char **argv) {
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+    TestWorkload workload(31);
+    versions.push_back(workload.region(1048576));
+    for (uint64_t v = 1; v < ReadVersions; v++) {
+        versions.push_back(workload.mutate(versions.back(), 40, 0));
+    }
+
+    TestRepository repository(10);
+    TEST_CHECK(repository.writeVersions(versions) == 0);
+
+    // version 1 is in every volume and its category, each of which is a file of the plan.
+    printf("Reads by a single reader..\n");
+    checkReads(repository, 1, 1);
+    TEST_CHECK(repository.logged("Restore read 5 extents, up to 1 of them at once"));
+
+    // a reader blocks in a later file until the files before it are delivered, so every reader holds a file at once.
+    printf("Concurrent reads..\n");
+    checkReads(repository, 1, 4);
+    TEST_CHECK(repository.logged("Restore read 5 extents, up to 4 of them at once"));
+    checkReads(repository, 1, 16);
+    TEST_CHECK(repository.logged("Restore read 5 extents, up to 5 of them at once"));
+    checkReads(repository, ReadVersions, 4);
+
+    printf("Concurrent reads of extents, in windows of 50 chunks..\n");
+    checkReads(repository, 2, 4, "--RestoreMemoryBudget=5200");
+    TEST_CHECK(repository.restore(3, std::string(SmallBuffers) +
+                                     " --RestoreReadThreads=4 --RestoreOffset=100000 --RestoreLength=400000") == 0);
+    TEST_CHECK(fileEquals(repository.outputPath(), versions[2].data() + 100000, 400000));
+
+    return testResult("ConcurrentReadTest");
+}
@@ -0,0 +1,195 @@
+//  Copyright (c) Xiangyu Zou, 2020. All rights reserved.
+//  This source code is licensed under the GPLv2
+
+// Test of delta encoding: DeltaCompressor round trips and rejection of malformed deltas, and restores of versions
+// holding deltas, including deltas whose bases come later in the version, and so later in a restore window.
+// Usage: DeltaTest --Binary=[MFDedup executable] --TestPath=[working path]
+
+#include "TestUtility.h"
+#include "../Utility/Resemblance.h"
+
+const uint64_t DeltaLimit = 65536;
+
+static bool roundTrip(const std::vector<uint8_t> &base, const std::vector<uint8_t> &target, uint64_t *deltaLength) {
+    SHA1FP baseFp = {1, 2, 3, 4};
+    std::vector<uint8_t> delta(DeltaLimit), decoded(target.size());
+    std::vector<uint32_t> table;
+    *deltaLength = DeltaCompressor::encode(baseFp, base.data(), base.size(), target.data(), target.size(),
+                                           delta.data(), delta.size(), table);
+    if (*deltaLength == 0) {
+        return false;
+    }
+    SHA1FP referred = DeltaCompressor::baseOf(delta.data());
+    return memcmp(&referred, &baseFp, sizeof(SHA1FP)) == 0 &&
+           DeltaCompressor::decode(base.data(), base.size(), delta.data(), *deltaLength, decoded.data(),
+                                   decoded.size()) && decoded == target;
+}
+
+static void checkRoundTrips(TestWorkload &workload) {
+    uint64_t deltaLength;
+    std::vector<uint8_t> base = workload.random(8192);
+
+    // identical chunks are a single copy.
+    TEST_CHECK(roundTrip(base, base, &deltaLength));
+    TEST_CHECK(deltaLength < sizeof(SHA1FP) + 8);
+
+    // edits inside, at both ends, insertions and deletions.
+    std::vector<uint8_t> target = base;
+    target[0] ^= 1;
+    target[4000] ^= 1;
+    target[target.size() - 1] ^= 1;
+    TEST_CHECK(roundTrip(base, target, &deltaLength));
+    TEST_CHECK(deltaLength < target.size() / 8);
+    target.insert(target.begin() + 1000, 300, 'x');
+    target.erase(target.begin() + 6000, target.begin() + 6500);
+    TEST_CHECK(roundTrip(base, target, &deltaLength));
+    TEST_CHECK(deltaLength < target.size() / 8);
+
+    // an unrelated target is inserted as a whole.
+    target = workload.random(8192);
+    TEST_CHECK(roundTrip(base, target, &deltaLength));
+    TEST_CHECK(deltaLength > target.size());
+
+    // targets and bases too short to be matched give no delta.
+    std::vector<uint8_t> shortChunk = workload.random(DeltaWindow - 1);
+    TEST_CHECK(!roundTrip(base, shortChunk, &deltaLength));
+    TEST_CHECK(!roundTrip(shortChunk, base, &deltaLength));
+
+    // a delta exceeding the limit is given up.
+    SHA1FP baseFp = {1, 2, 3, 4};
+    std::vector<uint8_t> delta(DeltaLimit);
+    std::vector<uint32_t> table;
+    TEST_CHECK(DeltaCompressor::encode(baseFp, base.data(), base.size(), target.data(), target.size(), delta.data(),
+                                       target.size() / 2, table) == 0);
+}
+
+static bool decodes(const std::vector<uint8_t> &base, const std::vector<uint8_t> &delta, uint64_t targetLength) {
+    std::vector<uint8_t> decoded(targetLength + 1);
+    return DeltaCompressor::decode(base.data(), base.size(), delta.data(), delta.size(), decoded.data(),
+                                   targetLength);
+}
+
+// a delta of the fingerprint followed by instructions.
+static std::vector<uint8_t> makeDelta(const std::vector<uint8_t> &instructions) {
+    std::vector<uint8_t> delta(sizeof(SHA1FP), 0);
+    delta.insert(delta.end(), instructions.begin(), instructions.end());
+    return delta;
+}
+
+static void checkMalformed(TestWorkload &workload) {
+    std::vector<uint8_t> base = workload.random(4096);
+
+    // copy of 16 bytes from 100, then an insert of 2 bytes.
+    std::vector<uint8_t> delta = makeDelta({16 << 1 | 1, 100, 2 << 1, 'a', 'b'});
+    TEST_CHECK(decodes(base, delta, 18));
+    // targets of another length.
+    TEST_CHECK(!decodes(base, delta, 17));
+    TEST_CHECK(!decodes(base, delta, 19));
+    // truncated inside an insert, and inside a copy.
+    TEST_CHECK(!decodes(base, std::vector<uint8_t>(delta.begin(), delta.end() - 1), 18));
+    TEST_CHECK(!decodes(base, std::vector<uint8_t>(delta.begin(), delta.begin() + sizeof(SHA1FP) + 1), 16));
+    // a varint which does not end.
+    TEST_CHECK(!decodes(base, makeDelta({0x80, 0x80, 0x80}), 16));
+    TEST_CHECK(!decodes(base, makeDelta(std::vector<uint8_t>(11, 0xff)), 16));
+    // copies beyond the base, starting in it or not.
+    TEST_CHECK(!decodes(base, makeDelta({16 << 1 | 1, 0xf8, 0x1f}), 16));
+    TEST_CHECK(!decodes(base, makeDelta({16 << 1 | 1, 0x80, 0x40}), 16));
+    // an instruction longer than the target.
+    TEST_CHECK(!decodes(base, makeDelta({0x80, 0x01, 'a'}), 16));
+    // a delta of only the fingerprint is an empty target.
+    TEST_CHECK(decodes(base, makeDelta({}), 0));
+    TEST_CHECK(!decodes(base, makeDelta({}), 1));
+
+    // random corruptions are rejected or decoded within bounds, which the sanitizers check.
+    std::vector<uint8_t> target = base;
+    target[2000] ^= 1;
+    std::vector<uint8_t> encoded(DeltaLimit);
+    std::vector<uint32_t> table;
+    SHA1FP baseFp = {1, 2, 3, 4};
+    uint64_t deltaLength = DeltaCompressor::encode(baseFp, base.data(), base.size(), target.data(), target.size(),
+                                                   encoded.data(), encoded.size(), table);
+    TEST_CHECK(deltaLength > sizeof(SHA1FP));
+    encoded.resize(deltaLength);
+    for (uint64_t i = 0; i < 1000; i++) {
+        std::vector<uint8_t> corrupted = encoded;
+        corrupted[sizeof(SHA1FP) + workload.next() % (deltaLength - sizeof(SHA1FP))] = workload.next();
+        corrupted.resize(sizeof(SHA1FP) + workload.next() % (deltaLength - sizeof(SHA1FP) + 1));
+        decodes(base, corrupted, target.size());
+    }
+}
+
+// The head of version 2 is an edited copy of version 1, which follows it, so that deltas of the head are restored
+// before their bases.
+static void checkRestores(TestWorkload &workload, const std::string &arguments) {
+    std::vector<std::vector<uint8_t>> versions;
+    versions.push_back(workload.region(1048576));
+    std::vector<uint8_t> head(versions[0].begin(), versions[0].begin() + 262144);
+    for (uint64_t i = 0; i < head.size(); i += 2048) {
+        head[i + workload.next() % 2048] ^= 0x5a;
+    }
+    head.insert(head.end(), versions[0].begin(), versions[0].end());
+    versions.push_back(head);
+    versions.push_back(workload.mutate(versions.back(), 10, 64));
+    versions.push_back(workload.mutate(versions.back(), 10, 64));
+
+    TestRepository repository(10);
+    for (uint64_t v = 1; v <= versions.size(); v++) {
+        TEST_CHECK(repository.write(versions[v - 1], "--Resemblance=true " + arguments) == 0);
+        if (v > 1) {
+            TEST_CHECK(repository.logged("Resembling chunks : "));
+            TEST_CHECK(!repository.logged("Resembling chunks : 0 of"));
+        }
+    }
+    for (uint64_t v = 1; v <= versions.size(); v++) {
+        TEST_CHECK(repository.restore(v, arguments) == 0);
+        TEST_CHECK(fileEquals(repository.outputPath(), versions[v - 1]));
+        // windows of 50 chunks, which the bases of the head of version 2 are out of.
+        TEST_CHECK(repository.restore(v, "--RestoreMemoryBudget=5200 " + arguments) == 0);
+        TEST_CHECK(fileEquals(repository.outputPath(), versions[v - 1]));
+    }
+    TEST_CHECK(repository.restore(2, "--RestoreOffset=4096 --RestoreLength=131072 " + arguments) == 0);
+    TEST_CHECK(fileEquals(repository.outputPath(), versions[1].data() + 4096, 131072));
+}
+
+// Versions are written by separate runs whose arrangement falls behind, so that bases pinned by deltas are kept by
+// the saved index, then caught up, and eliminated down to the retention.
+static void checkRestarts(TestWorkload &workload) {
+    std::vector<std::vector<uint8_t>> versions;
+    versions.push_back(workload.region(1048576));
+    for (uint64_t v = 1; v < 6; v++) {
+        versions.push_back(workload.mutate(versions.back(), 10, 128));
+    }
+
+    const uint64_t retention = 4;
+    TestRepository repository(retention);
+    for (uint64_t v = 1; v <= versions.size(); v++) {
+        TEST_CHECK(repository.write(versions[v - 1], std::string("--Resemblance=true") +
+                                                     (v <= retention ? " --ApplyArrangement=false" : "")) == 0);
+        if (v == retention) {
+            TEST_CHECK(repository.run("--task=arrange") == 0);
+        }
+        uint64_t retained = std::min(v, retention);
+        for (uint64_t r = 1; r <= retained; r++) {
+            TEST_CHECK(repository.restore(r) == 0);
+            TEST_CHECK(fileEquals(repository.outputPath(), versions[v - retained + r - 1]));
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+    TestWorkload workload(49);
+    printf("Round trips..\n");
+    checkRoundTrips(workload);
+    printf("Malformed deltas..\n");
+    checkMalformed(workload);
+    printf("Restores of deltas..\n");
+    checkRestores(workload, "");
+    printf("Restores of deltas, arranged in background and compressed..\n");
+    checkRestores(workload, "--BackgroundArrangement=true --Compression=lz4");
+    printf("Deltas across restarts, catch-up and elimination..\n");
+    checkRestarts(workload);
+
+    return testResult("DeltaTest");
+}
@@ -0,0 +1,52 @@
+//  Copyright (c) Xiangyu Zou, 2020. All rights reserved.
+//  This source code is licensed under the GPLv2
+
+// Behavior test of incremental restores, which write only chunks of the restored version that a copy of a base version
+// does not hold at the same position, on a layout whose last versions fall behind the arrangement, and again after
+// catching up.
+// Usage: IncrementalTest --Binary=[MFDedup executable] --TestPath=[working path]
+
+#include "TestUtility.h"
+
+const uint64_t IncrementalVersions = 5;
+
+static std::vector<std::vector<uint8_t>> versions;
+
+static void checkIncremental(TestRepository &repository, uint64_t base, uint64_t target,
+                             const std::string &arguments = "") {
+    TEST_CHECK(repository.restore(base) == 0);
+    TEST_CHECK(fileEquals(repository.outputPath(), versions[base - 1]));
+    TEST_CHECK(repository.restore(target, "--RestoreBase=" + std::to_string(base) + " " + arguments) == 0);
+    TEST_CHECK(repository.logged("Incremental restore keeps"));
+    TEST_CHECK(fileEquals(repository.outputPath(), versions[target - 1]));
+}
+
+int main(int argc, char **argv) {
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+    TestWorkload workload(37);
+    versions.push_back(workload.region(1048576));
+    for (uint64_t v = 1; v < IncrementalVersions; v++) {
+        versions.push_back(workload.mutate(versions.back(), 40, 0));
+    }
+
+    TestRepository repository(10);
+    TEST_CHECK(repository.writeVersions(versions, 2) == 0);
+
+    printf("Incremental restores..\n");
+    checkIncremental(repository, 3, IncrementalVersions);
+    // onto a longer base, which is truncated.
+    checkIncremental(repository, IncrementalVersions, 2);
+    // onto the version itself, which writes nothing.
+    checkIncremental(repository, 4, 4);
+    TEST_CHECK(repository.logged(", writes 0 of"));
+    // in windows of 50 chunks, over which the base recipe is walked once.
+    checkIncremental(repository, 2, IncrementalVersions, "--RestoreMemoryBudget=5200");
+
+    printf("Incremental restores after catching up..\n");
+    TEST_CHECK(repository.run("--task=arrange") == 0);
+    TEST_CHECK(repository.logged("Arrangement falls 0 versions behind now."));
+    checkIncremental(repository, 1, IncrementalVersions);
+
+    return testResult("IncrementalTest");
+}
@@ -0,0 +1,51 @@
+//  Copyright (c) Xiangyu Zou, 2020. All rights reserved.
+//  This source code is licensed under the GPLv2
+
+// Behavior test of multi-version restores, which restore several versions in one pass over the layout, on a layout
+// whose last versions fall behind the arrangement, and again after catching up.
+// Usage: MultiVersionTest --Binary=[MFDedup executable] --TestPath=[working path]
+
+#include "TestUtility.h"
+
+const uint64_t MultiVersions = 5;
+
+static std::vector<std::vector<uint8_t>> versions;
+
+static void checkMultiVersion(TestRepository &repository, const std::vector<uint64_t> &restored,
+                              const std::string &arguments = "") {
+    std::string recipes;
+    for (uint64_t version : restored) {
+        recipes += (recipes.empty() ? "" : ",") + std::to_string(version);
+    }
+    TEST_CHECK(repository.run("--task=restore --RestorePath=" + repository.outputPath() + "%lu --RestoreRecipes=" +
+                              recipes + " " + arguments) == 0);
+    for (uint64_t version : restored) {
+        TEST_CHECK(fileEquals(repository.outputPath() + std::to_string(version), versions[version - 1]));
+    }
+}
+
+int main(int argc, char **argv) {
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+    TestWorkload workload(38);
+    versions.push_back(workload.region(1048576));
+    for (uint64_t v = 1; v < MultiVersions; v++) {
+        versions.push_back(workload.mutate(versions.back(), 40, 0));
+    }
+
+    TestRepository repository(10);
+    TEST_CHECK(repository.writeVersions(versions, 2) == 0);
+
+    printf("Multi-version restores..\n");
+    checkMultiVersion(repository, {1, 3, MultiVersions});
+    // in windows of 50 chunks, across the ends of versions.
+    checkMultiVersion(repository, {2, 3, 4}, "--RestoreMemoryBudget=5200");
+    checkMultiVersion(repository, {MultiVersions});
+
+    printf("Multi-version restores after catching up..\n");
+    TEST_CHECK(repository.run("--task=arrange") == 0);
+    TEST_CHECK(repository.logged("Arrangement falls 0 versions behind now."));
+    checkMultiVersion(repository, {1, 2, 3, 4, MultiVersions});
+
+    return testResult("MultiVersionTest");
+}
@@ -0,0 +1,62 @@
+//  Copyright (c) Xiangyu Zou, 2020. All rights reserved.
+//  This source code is licensed under the GPLv2
+
+// Behavior test of range restores, which read volumes and categories only in extents holding chunks of the range, on
+// a layout whose last versions fall behind the arrangement, and again after catching up.
+// Usage: RangeTest --Binary=[MFDedup executable] --TestPath=[working path]
+
+#include "TestUtility.h"
+
+const uint64_t RangeVersions = 5;
+// 50 chunks for each window of a restore.
+const char *SmallBudget = "--RestoreMemoryBudget=5200";
+
+static std::vector<std::vector<uint8_t>> versions;
+
+static void checkRange(TestRepository &repository, uint64_t version, uint64_t offset, uint64_t length,
+                       const std::string &arguments = "") {
+    const std::vector<uint8_t> &data = versions[version - 1];
+    uint64_t end = length ? std::min(offset + length, (uint64_t) data.size()) : data.size();
+    TEST_CHECK(repository.restore(version, "--RestoreOffset=" + std::to_string(offset) + " --RestoreLength=" +
+                                           std::to_string(length) + " " + arguments) == 0);
+    TEST_CHECK(fileEquals(repository.outputPath(), data.data() + offset, end - offset));
+}
+
+static void checkRanges(TestRepository &repository) {
+    for (uint64_t version : {(uint64_t) 2, RangeVersions}) {
+        uint64_t size = versions[version - 1].size();
+        checkRange(repository, version, 0, 1000);
+        checkRange(repository, version, 123457, 300000);
+        checkRange(repository, version, size / 2, 0);
+        checkRange(repository, version, size - 10, 0);
+        checkRange(repository, version, 4096, size);
+        checkRange(repository, version, 77777, 500000, SmallBudget);
+        checkRange(repository, version, 77777, 500000, "--RestoreSkipChunks=false");
+        // chunk indexes are saved when files are written, so that none is scanned.
+        TEST_CHECK(repository.logged("0 files without chunk index scanned"));
+    }
+}
+
+int main(int argc, char **argv) {
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+    TestWorkload workload(36);
+    versions.push_back(workload.region(1048576));
+    for (uint64_t v = 1; v < RangeVersions; v++) {
+        versions.push_back(workload.mutate(versions.back(), 40, 0));
+    }
+
+    // the last two versions fall behind, so that ranges are also read from unarranged categories.
+    TestRepository repository(10);
+    TEST_CHECK(repository.writeVersions(versions, 2) == 0);
+
+    printf("Range restores..\n");
+    checkRanges(repository);
+
+    printf("Range restores after catching up..\n");
+    TEST_CHECK(repository.run("--task=arrange") == 0);
+    TEST_CHECK(repository.logged("Arrangement falls 0 versions behind now."));
+    checkRanges(repository);
+
+    return testResult("RangeTest");
+}
@@ -0,0 +1,207 @@
+//  Copyright (c) Xiangyu Zou, 2020. All rights reserved.
+//  This source code is licensed under the GPLv2
+
+// Test of compact recipes: round trips through RecipeWriter and RecipeReader, reads which start and stop inside runs
+// or go back before the cursor, the cutoff of reference chains, and the detach of the recipe of the second version
+// when the earliest one is eliminated.
+// Usage: RecipeTest --Binary=[MFDedup executable] --TestPath=[working path]
+
+#include "TestUtility.h"
+#include "../DedupPipeline/RecipeWriter.h"
+
+std::string LogicFilePath;
+std::string KVPath;
+uint64_t TotalVersion = 0;
+
+const uint64_t RecipeVersions = 8;
+const uint64_t ChainLength = 3;
+
+static BlockHeader makeHeader(uint64_t id, TestWorkload &workload) {
+    BlockHeader blockHeader;
+    memset(&blockHeader, 0, sizeof(BlockHeader));
+    blockHeader.fp.fp1 = id * 0x9e3779b97f4a7c15;
+    blockHeader.fp.fp2 = id;
+    blockHeader.fp.fp3 = id >> 32;
+    blockHeader.fp.fp4 = ~id;
+    blockHeader.length = workload.next() % 65536 + 1;
+    return blockHeader;
+}
+
+// the previous version with runs replaced, removed, moved and repeated.
+static std::vector<BlockHeader> mutate(const std::vector<BlockHeader> &previous, uint64_t &nextId,
+                                       TestWorkload &workload) {
+    std::vector<BlockHeader> headers = previous;
+    for (uint64_t i = 0; i < 20; i++) {
+        uint64_t position = workload.next() % headers.size();
+        uint64_t length = std::min(workload.next() % 300 + 1, (uint64_t) headers.size() - position);
+        switch (workload.next() % 4) {
+            case 0:
+                for (uint64_t j = 0; j < length; j++) {
+                    headers[position + j] = makeHeader(nextId++, workload);
+                }
+                break;
+            case 1:
+                headers.erase(headers.begin() + position, headers.begin() + position + length);
+                break;
+            case 2: {
+                std::vector<BlockHeader> run(headers.begin() + position, headers.begin() + position + length);
+                headers.erase(headers.begin() + position, headers.begin() + position + length);
+                headers.insert(headers.begin() + workload.next() % (headers.size() + 1), run.begin(), run.end());
+                break;
+            }
+            default: {
+                std::vector<BlockHeader> run(headers.begin() + position, headers.begin() + position + length);
+                headers.insert(headers.begin() + workload.next() % (headers.size() + 1), run.begin(), run.end());
+                break;
+            }
+        }
+    }
+    for (uint64_t i = 0; i < 500; i++) {
+        headers.push_back(makeHeader(nextId++, workload));
+    }
+    return headers;
+}
+
+static void writeRecipe(uint64_t version, const std::vector<BlockHeader> &headers, bool compact) {
+    char pathBuffer[256];
+    sprintf(pathBuffer, LogicFilePath.data(), version);
+    FLAGS_CompactRecipe = compact;
+    FileOperator fileOperator(pathBuffer, FileOpenType::Write);
+    // a small buffer, so that ops are split across flushes.
+    BufferedFileWriter bufferedFileWriter(&fileOperator, 4099);
+    RecipeWriter recipeWriter(&bufferedFileWriter, version);
+    for (auto &blockHeader : headers) {
+        TEST_CHECK(recipeWriter.add(blockHeader) == 0);
+    }
+    TEST_CHECK(recipeWriter.finish() == 0);
+}
+
+static bool sameEntries(const BlockHeader *read, const BlockHeader *expected, uint64_t count) {
+    for (uint64_t i = 0; i < count; i++) {
+        if (memcmp(&read[i].fp, &expected[i].fp, sizeof(SHA1FP)) != 0 || read[i].length != expected[i].length) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void checkRecipe(uint64_t version, const std::vector<BlockHeader> &headers, TestWorkload &workload) {
+    RecipeReader recipe(version);
+    TEST_CHECK(recipe.ok());
+    TEST_CHECK(recipe.getCount() == headers.size());
+    uint64_t totalLength = 0;
+    for (auto &blockHeader : headers) {
+        totalLength += blockHeader.length;
+    }
+    TEST_CHECK(recipe.getLength() == totalLength);
+
+    // sequential reads in batches which end inside runs.
+    std::vector<BlockHeader> blockHeaders(headers.size() + 1);
+    uint64_t position = 0, readCount;
+    while ((readCount = recipe.next(blockHeaders.data() + position, workload.next() % 7 + 1)) > 0) {
+        position += readCount;
+    }
+    TEST_CHECK(position == headers.size());
+    TEST_CHECK(sameEntries(blockHeaders.data(), headers.data(), headers.size()));
+
+    // random reads, which go back before the cursor and reset to a seek point, or continue near it.
+    for (uint64_t i = 0; i < 300; i++) {
+        uint64_t first = workload.next() % headers.size();
+        uint64_t count = workload.next() % 200 + 1;
+        uint64_t expected = std::min(count, (uint64_t) headers.size() - first);
+        TEST_CHECK(recipe.read(first, count, blockHeaders.data()) == expected);
+        TEST_CHECK(sameEntries(blockHeaders.data(), headers.data() + first, expected));
+        if (i % 3 == 0 && first + expected < headers.size()) {
+            uint64_t next = std::min((uint64_t) headers.size() - first - expected, (uint64_t) 5);
+            TEST_CHECK(recipe.read(first + expected, next, blockHeaders.data()) == next);
+            TEST_CHECK(sameEntries(blockHeaders.data(), headers.data() + first + expected, next));
+        }
+    }
+    TEST_CHECK(recipe.read(headers.size(), 1, blockHeaders.data()) == 0);
+}
+
+static void checkRoundTrips(TestWorkload &workload) {
+    LogicFilePath = FLAGS_TestPath + "/Recipe%lu";
+    std::string command = "rm -rf " + FLAGS_TestPath;
+    system(command.data());
+    mkdir(FLAGS_TestPath.data(), 0755);
+    FLAGS_RecipeSeekInterval = 64;
+    FLAGS_RecipeChainLength = ChainLength;
+
+    uint64_t nextId = 1;
+    std::vector<std::vector<BlockHeader>> versions(1);
+    for (uint64_t i = 0; i < 5000; i++) {
+        versions[0].push_back(makeHeader(nextId++, workload));
+    }
+    for (uint64_t v = 1; v < RecipeVersions; v++) {
+        versions.push_back(mutate(versions.back(), nextId, workload));
+    }
+
+    // version 6 is flat, which version 7 refers to as to any other.
+    for (uint64_t v = 1; v <= RecipeVersions; v++) {
+        writeRecipe(v, versions[v - 1], v != 6);
+    }
+    // a chain holds at most ChainLength recipes through the previous ones, beyond which a recipe refers to none.
+    uint64_t expectedDepths[RecipeVersions] = {0, 1, 2, 3, 0, 0, 1, 2};
+    for (uint64_t v = 1; v <= RecipeVersions; v++) {
+        RecipeReader recipe(v);
+        TEST_CHECK(recipe.isCompact() == (v != 6));
+        TEST_CHECK(recipe.getDepth() == expectedDepths[v - 1]);
+    }
+    for (uint64_t v = 1; v <= RecipeVersions; v++) {
+        checkRecipe(v, versions[v - 1], workload);
+    }
+
+    // a corrupted op is reported rather than read beyond the ops.
+    char pathBuffer[256];
+    sprintf(pathBuffer, LogicFilePath.data(), (uint64_t) 1);
+    {
+        FileOperator fileOperator(pathBuffer, FileOpenType::ReadWrite);
+        uint8_t zero = 0;
+        TEST_CHECK(fileOperator.writeAt(&zero, 1, 0) == 1);
+    }
+    RecipeReader corrupted(1);
+    std::vector<BlockHeader> blockHeaders(16);
+    TEST_CHECK(corrupted.read(0, 16, blockHeaders.data()) == 0);
+}
+
+// Elimination renames recipes onto the previous versions. The recipe of the second version refers to the eliminated
+// one, and is rewritten without references before it becomes the first.
+static void checkDetach(TestWorkload &workload) {
+    std::vector<std::vector<uint8_t>> versions;
+    versions.push_back(workload.region(1048576));
+    for (uint64_t v = 1; v < 6; v++) {
+        versions.push_back(workload.mutate(versions.back(), 20, 0));
+    }
+
+    const uint64_t retention = 3;
+    TestRepository repository(retention);
+    LogicFilePath = repository.homePath() + "/logicFiles/Recipe%lu";
+    for (uint64_t v = 1; v <= versions.size(); v++) {
+        TEST_CHECK(repository.write(versions[v - 1], "--CompactRecipe=true") == 0);
+        uint64_t retained = std::min(v, retention);
+        for (uint64_t r = 1; r <= retained; r++) {
+            RecipeReader recipe(r);
+            TEST_CHECK(recipe.ok());
+            TEST_CHECK(recipe.isCompact());
+            // depths of renamed recipes are not rewritten, and bound their chains from above.
+            TEST_CHECK(r == 1 ? recipe.getDepth() == 0 : recipe.getDepth() > 0);
+        }
+        for (uint64_t r = 1; r <= retained; r++) {
+            TEST_CHECK(repository.restore(r) == 0);
+            TEST_CHECK(fileEquals(repository.outputPath(), versions[v - retained + r - 1]));
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+    TestWorkload workload(50);
+    printf("Round trips..\n");
+    checkRoundTrips(workload);
+    printf("Detach on elimination..\n");
+    checkDetach(workload);
+
+    return testResult("RecipeTest");
+}
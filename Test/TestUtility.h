@@ -0,0 +1,206 @@
+//  Copyright (c) Xiangyu Zou, 2020. All rights reserved.
+//  This source code is licensed under the GPLv2
+
+#ifndef MFDEDUP_TESTUTILITY_H
+#define MFDEDUP_TESTUTILITY_H
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "gflags/gflags.h"
+
+DEFINE_string(Binary,
+              "./MFDedup", "MFDedup executable which behavior tests drive");
+DEFINE_string(TestPath,
+              "/tmp/MFDedupTest", "working path of tests, whose content is removed");
+
+static uint64_t FailedChecks = 0;
+
+#define TEST_CHECK(condition)                                                       \
+    do {                                                                            \
+        if (!(condition)) {                                                         \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition);    \
+            FailedChecks++;                                                         \
+        }                                                                           \
+    } while (0)
+
+// reports the checks of a test, and returns the exit code of it.
+inline int testResult(const char *name) {
+    printf("%s: %s, %lu checks failed\n", name, FailedChecks ? "FAILED" : "passed", FailedChecks);
+    return FailedChecks ? 1 : 0;
+}
+
+// Versions of a workload, each of which is the previous one with some regions replaced or slightly edited, and some
+// data appended. Regions are either random or text-like, so that chunks compress, deduplicate and resemble each other.
+class TestWorkload {
+public:
+    explicit TestWorkload(uint64_t seed) : state(seed | 1) {
+    }
+
+    std::vector<uint8_t> random(uint64_t length) {
+        std::vector<uint8_t> data(length);
+        for (uint64_t i = 0; i < length; i++) {
+            data[i] = next() >> 56;
+        }
+        return data;
+    }
+
+    std::vector<uint8_t> text(uint64_t length) {
+        static const char *words[] = {"backup", "version", "chunk", "category", "volume", "recipe", "restore",
+                                      "arrangement", "deduplication", "locality", "index", "layout"};
+        std::vector<uint8_t> data;
+        while (data.size() < length) {
+            const char *word = words[next() % (sizeof(words) / sizeof(words[0]))];
+            data.insert(data.end(), word, word + strlen(word));
+            data.push_back(' ');
+        }
+        data.resize(length);
+        return data;
+    }
+
+    std::vector<uint8_t> region(uint64_t length) {
+        return next() % 2 ? text(length) : random(length);
+    }
+
+    // replaces regions, flips a byte in others, which leaves their chunks resembling the previous ones, and appends.
+    std::vector<uint8_t> mutate(const std::vector<uint8_t> &previous, uint64_t replaces, uint64_t edits) {
+        std::vector<uint8_t> data = previous;
+        for (uint64_t i = 0; i < replaces && data.size() > 8192; i++) {
+            uint64_t offset = next() % (data.size() - 8192);
+            std::vector<uint8_t> replacement = region(next() % 8192 + 1);
+            data.erase(data.begin() + offset, data.begin() + offset + next() % 8192 + 1);
+            data.insert(data.begin() + offset, replacement.begin(), replacement.end());
+        }
+        for (uint64_t i = 0; i < edits && !data.empty(); i++) {
+            data[next() % data.size()] ^= 0x5a;
+        }
+        std::vector<uint8_t> appended = region(next() % 65536);
+        data.insert(data.end(), appended.begin(), appended.end());
+        return data;
+    }
+
+    uint64_t next() {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    }
+
+private:
+    uint64_t state;
+};
+
+inline bool writeFile(const std::string &path, const std::vector<uint8_t> &data) {
+    FILE *file = fopen(path.data(), "wb");
+    if (!file) {
+        return false;
+    }
+    bool result = fwrite(data.data(), 1, data.size(), file) == data.size();
+    fclose(file);
+    return result;
+}
+
+inline bool readFile(const std::string &path, std::vector<uint8_t> &data) {
+    FILE *file = fopen(path.data(), "rb");
+    if (!file) {
+        return false;
+    }
+    data.clear();
+    uint8_t buffer[65536];
+    size_t readLength;
+    while ((readLength = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        data.insert(data.end(), buffer, buffer + readLength);
+    }
+    fclose(file);
+    return true;
+}
+
+inline bool fileEquals(const std::string &path, const uint8_t *expected, uint64_t length) {
+    std::vector<uint8_t> data;
+    return readFile(path, data) && data.size() == length && (length == 0 || memcmp(data.data(), expected, length) == 0);
+}
+
+inline bool fileEquals(const std::string &path, const std::vector<uint8_t> &expected) {
+    return fileEquals(path, expected.data(), expected.size());
+}
+
+// A repository in the test path, which is initialized as build/init.sh does, and driven by the executable. Output of
+// the last task is kept in the log.
+class TestRepository {
+public:
+    explicit TestRepository(uint64_t retention) : path(FLAGS_TestPath + "/home") {
+        std::string command = "rm -rf " + FLAGS_TestPath;
+        system(command.data());
+        mkdir(FLAGS_TestPath.data(), 0755);
+        mkdir(path.data(), 0755);
+        mkdir((path + "/logicFiles").data(), 0755);
+        mkdir((path + "/storageFiles").data(), 0755);
+        configPath = FLAGS_TestPath + "/config.toml";
+        FILE *config = fopen(configPath.data(), "w");
+        fprintf(config, "path = \"%s\"\nretention = %lu\n", path.data(), retention);
+        fclose(config);
+    }
+
+    // runs a task with arguments, and returns the exit code.
+    int run(const std::string &arguments) {
+        std::string command = FLAGS_Binary + " --ConfigFile=" + configPath + " " + arguments + " > " + logPath() +
+                              " 2>&1";
+        int status = system(command.data());
+        return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    }
+
+    int write(const std::vector<uint8_t> &version, const std::string &arguments = "") {
+        std::string inputPath = FLAGS_TestPath + "/input";
+        if (!writeFile(inputPath, version)) {
+            return -1;
+        }
+        return run("--task=write --InputFile=" + inputPath + " " + arguments);
+    }
+
+    // writes versions in order, the last behind of which fall behind the arrangement, and returns the number of
+    // failed writes.
+    int writeVersions(const std::vector<std::vector<uint8_t>> &versions, uint64_t behind = 0) {
+        int failed = 0;
+        for (uint64_t v = 1; v <= versions.size(); v++) {
+            failed += write(versions[v - 1], v + behind > versions.size() ? "--ApplyArrangement=false" : "") != 0;
+        }
+        return failed;
+    }
+
+    int restore(uint64_t version, const std::string &arguments = "") {
+        return run("--task=restore --RestorePath=" + outputPath() + " --RestoreRecipe=" + std::to_string(version) +
+                   " " + arguments);
+    }
+
+    std::string outputPath() const {
+        return FLAGS_TestPath + "/output";
+    }
+
+    std::string logPath() const {
+        return FLAGS_TestPath + "/log";
+    }
+
+    std::string homePath() const {
+        return path;
+    }
+
+    // whether the log of the last task holds text.
+    bool logged(const std::string &text) {
+        std::vector<uint8_t> data;
+        if (!readFile(logPath(), data)) {
+            return false;
+        }
+        return std::string(data.begin(), data.end()).find(text) != std::string::npos;
+    }
+
+private:
+    std::string path;
+    std::string configPath;
+};
+
+#endif //MFDEDUP_TESTUTILITY_H
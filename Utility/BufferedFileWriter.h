@@ -4,15 +4,46 @@
 #ifndef MFDEDUP_BUFFEREDFILEWRITER_H
 #define MFDEDUP_BUFFEREDFILEWRITER_H
 
+#include "Durability.h"
+
+// Writes through a buffer from the current position of the file. With direct I/O, the buffer starts at the block of
+// the position, and is written as whole blocks; the last block is padded, and the padding truncated when the writer
+// is deleted.
 class BufferedFileWriter {
 public:
-    BufferedFileWriter(FileOperator *fd, uint64_t size, uint64_t st) : fileOperator(fd), bufferSize(size), syncThreshold(st) {
+    BufferedFileWriter(FileOperator *fd, uint64_t size, bool directIO = false) : bufferSize(size), fileOperator(fd) {
+        if (directIO && fileOperator->setDirect(true) == 0) {
+            direct = true;
+            bufferSize = alignUp(size);
+            writeBuffer = alignedMalloc(bufferSize);
+            uint64_t position = fileOperator->tell();
+            filePosition = alignDown(position);
+            struct stat statBuffer;
+            fstat(fileOperator->getFd(), &statBuffer);
+            initialSize = statBuffer.st_size;
+            // keeps what precedes the position in its block.
+            if (position != filePosition) {
+                fileOperator->readAt(writeBuffer, DirectIOAlignment, filePosition);
+            }
+            writeBufferAvailable = bufferSize - (position - filePosition);
+            return;
+        }
         writeBuffer = (uint8_t *) malloc(bufferSize);
         writeBufferAvailable = bufferSize;
     }
 
     int write(uint8_t *data, int dataLen) {
-        if (dataLen > writeBufferAvailable) {
+        if (direct) {
+            // data is split at the end of the buffer, so that every flush is a whole buffer.
+            while (dataLen > writeBufferAvailable) {
+                int length = writeBufferAvailable;
+                memcpy(writeBuffer + bufferSize - writeBufferAvailable, data, length);
+                writeBufferAvailable = 0;
+                data += length;
+                dataLen -= length;
+                flush();
+            }
+        } else if (dataLen > writeBufferAvailable) {
             flush();
         }
         uint8_t *writePoint = writeBuffer + bufferSize - writeBufferAvailable;
@@ -21,21 +52,65 @@ public:
         return 0;
     }
 
+    // the file is complete unless more is written to it directly.
     ~BufferedFileWriter() {
-        counter += syncThreshold;
-        flush();
+        if (direct) {
+            writeTail();
+            uint64_t end = tell();
+            fileOperator->trunc(std::max(end, initialSize));
+            fileOperator->setDirect(false);
+            fileOperator->seek(end);
+        } else {
+            fileOperator->write(writeBuffer, bufferSize - writeBufferAvailable);
+        }
+        fileOperator->trim();
+        GlobalDurability.completed(fileOperator);
         free(writeBuffer);
     }
 
+    // flushes buffered data and makes it durable regardless of the durability mode, e.g. before a checkpoint.
+    int sync() {
+        if (direct) {
+            writeTail();
+        } else {
+            fileOperator->write(writeBuffer, bufferSize - writeBufferAvailable);
+            writeBufferAvailable = bufferSize;
+        }
+        fileOperator->fdatasync();
+        counter = 0;
+        return 0;
+    }
+
+    // position of the next write.
+    uint64_t tell() {
+        if (direct) {
+            return filePosition + bufferSize - writeBufferAvailable;
+        }
+        return fileOperator->tell() + bufferSize - writeBufferAvailable;
+    }
+
 private:
 
     int flush() {
-        fileOperator->write(writeBuffer, bufferSize - writeBufferAvailable);
+        if (direct) {
+            fileOperator->writeAt(writeBuffer, bufferSize, filePosition);
+            filePosition += bufferSize;
+        } else {
+            fileOperator->write(writeBuffer, bufferSize - writeBufferAvailable);
+        }
         writeBufferAvailable = bufferSize;
-        counter++;
-        if(counter >= syncThreshold){
+        if(GlobalDurability.flushed(fileOperator, counter)){
             fileOperator->fdatasync();
-            counter = 0;
+        }
+        return 0;
+    }
+
+    // writes the partly filled buffer up to the end of its block, and keeps it for following writes.
+    void writeTail() {
+        uint64_t length = bufferSize - writeBufferAvailable;
+        if (length) {
+            memset(writeBuffer + length, 0, alignUp(length) - length);
+            fileOperator->writeAt(writeBuffer, alignUp(length), filePosition);
         }
     }
 
@@ -45,7 +120,11 @@ private:
     FileOperator *fileOperator;
 
     uint64_t counter = 0;
-    uint64_t syncThreshold = 0;
+
+    bool direct = false;
+    // offset of the buffer in the file, and size of the file before writing.
+    uint64_t filePosition = 0;
+    uint64_t initialSize = 0;
 };
 
 #endif //MFDEDUP_BUFFEREDFILEWRITER_H
@@ -0,0 +1,193 @@
+//  Copyright (c) Xiangyu Zou, 2020. All rights reserved.
+//  This source code is licensed under the GPLv2
+
+#ifndef MFDEDUP_CHUNKCOMPRESSOR_H
+#define MFDEDUP_CHUNKCOMPRESSOR_H
+
+#include <thread>
+#include <functional>
+#include <vector>
+#include <list>
+#include "lz4.h"
+#include "gflags/gflags.h"
+#include "Lock.h"
+#include "StorageTask.h"
+
+// compressed chunks are not read by versions before compression, so that it is enabled by the user.
+DEFINE_string(Compression,
+              "none", "encoding of chunks of new categories, lz4 or none, chunks of either are read regardless");
+
+DEFINE_uint64(CompressionThreads,
+              4, "threads compressing the write buffers of the new category");
+
+enum class ChunkEncoding : uint32_t {
+    Raw = 0,
+    LZ4 = 1,
+    // a delta against a base chunk, see Resemblance.h.
+    Delta = 2,
+};
+
+// chunks are stored compressed only when this saves an eighth of them at least.
+const uint64_t CompressionSavingShift = 3;
+const uint64_t CompressionMinLength = 64;
+const uint64_t CompressionMaxLength = (1 << 24) - 1;
+// bytes sampled by the entropy check.
+const uint64_t CompressionSampleLength = 4096;
+
+// Encodes chunks of new categories and decodes chunks read from categories and volumes. Headers keep the fingerprint,
+// so that arrangement moves encoded chunks as they are.
+class ChunkCompressor {
+public:
+    // length of the chunk following a header of a category or volume.
+    static uint64_t chunkLength(const BlockHeader *blockHeader) {
+        return blockHeader->encoding ? blockHeader->decodedLength : blockHeader->length;
+    }
+
+    // writes the header and the chunk to out, and returns the length written, which is at most that of both. Chunks
+    // found incompressible by their sampled entropy, or by compression running out of the space it may save, are
+    // written as they are.
+    static uint64_t encode(const BlockHeader *blockHeader, const uint8_t *chunk, uint8_t *out, bool *compressed) {
+        BlockHeader *outHeader = (BlockHeader *) out;
+        uint8_t *data = out + sizeof(BlockHeader);
+        uint64_t length = blockHeader->length;
+        *outHeader = *blockHeader;
+        outHeader->encoding = (uint32_t) ChunkEncoding::Raw;
+        outHeader->decodedLength = 0;
+        *compressed = false;
+        if (length >= CompressionMinLength && length <= CompressionMaxLength && compressible(chunk, length)) {
+            int limit = length - (length >> CompressionSavingShift);
+            int r = LZ4_compress_default((const char *) chunk, (char *) data, length, limit);
+            if (r > 0) {
+                outHeader->length = r;
+                outHeader->encoding = (uint32_t) ChunkEncoding::LZ4;
+                outHeader->decodedLength = length;
+                *compressed = true;
+                return sizeof(BlockHeader) + r;
+            }
+        }
+        return store(blockHeader, chunk, out);
+    }
+
+    // writes the header and the chunk to out as they are.
+    static uint64_t store(const BlockHeader *blockHeader, const uint8_t *chunk, uint8_t *out) {
+        BlockHeader *outHeader = (BlockHeader *) out;
+        *outHeader = *blockHeader;
+        outHeader->encoding = (uint32_t) ChunkEncoding::Raw;
+        outHeader->decodedLength = 0;
+        memcpy(out + sizeof(BlockHeader), chunk, blockHeader->length);
+        return sizeof(BlockHeader) + blockHeader->length;
+    }
+
+    // returns the chunk following a header, which is decoded into buffer where it is encoded, or nullptr when it can
+    // not be decoded, as deltas are without their bases.
+    static const uint8_t *decode(const BlockHeader *blockHeader, const uint8_t *data, std::vector<uint8_t> &buffer) {
+        switch ((ChunkEncoding) blockHeader->encoding) {
+            case ChunkEncoding::Raw:
+                return data;
+            case ChunkEncoding::LZ4: {
+                buffer.resize(blockHeader->decodedLength);
+                int r = LZ4_decompress_safe((const char *) data, (char *) buffer.data(), blockHeader->length,
+                                            blockHeader->decodedLength);
+                if (r != (int) blockHeader->decodedLength) {
+                    return nullptr;
+                }
+                return buffer.data();
+            }
+            case ChunkEncoding::Delta:
+                // deltas are decoded against their bases by DeltaCompressor.
+                return nullptr;
+        }
+        return nullptr;
+    }
+
+private:
+    // estimates the collision entropy of sampled bytes, which underestimates their Shannon entropy, and finds chunks
+    // above 7.5 bits per byte incompressible, i.e. the sum of squared counts is below samples^2 / 2^7.5.
+    static bool compressible(const uint8_t *chunk, uint64_t length) {
+        uint32_t counts[256] = {0};
+        uint64_t stride = (length + CompressionSampleLength - 1) / CompressionSampleLength;
+        uint64_t samples = 0;
+        for (uint64_t i = 0; i < length; i += stride) {
+            counts[chunk[i]]++;
+            samples++;
+        }
+        uint64_t squares = 0;
+        for (uint64_t i = 0; i < 256; i++) {
+            squares += (uint64_t) counts[i] * counts[i];
+        }
+        return squares * 181 >= samples * samples;
+    }
+};
+
+// Threads which run the parts of a job, so that the caller waits for the slowest part rather than for all of them.
+class CompressionPool {
+public:
+    CompressionPool(uint64_t threads) : mutexLock(), condition(mutexLock) {
+        for (uint64_t i = 0; i < std::max(threads, (uint64_t) 1); i++) {
+            workers.push_back(new std::thread(std::bind(&CompressionPool::workerCallback, this)));
+        }
+    }
+
+    ~CompressionPool() {
+        {
+            MutexLockGuard mutexLockGuard(mutexLock);
+            runningFlag = false;
+            condition.notifyAll();
+        }
+        for (auto worker : workers) {
+            worker->join();
+            delete worker;
+        }
+    }
+
+    uint64_t size() {
+        return workers.size();
+    }
+
+    // runs function(0) .. function(n - 1) on the workers, and returns when all of them have returned.
+    void parallelFor(uint64_t n, const std::function<void(uint64_t)> &function) {
+        CountdownLatch countdownLatch(n);
+        {
+            MutexLockGuard mutexLockGuard(mutexLock);
+            for (uint64_t i = 0; i < n; i++) {
+                jobList.push_back({&function, i, &countdownLatch});
+            }
+            condition.notifyAll();
+        }
+        countdownLatch.wait();
+    }
+
+private:
+    struct Job {
+        const std::function<void(uint64_t)> *function;
+        uint64_t index;
+        CountdownLatch *countdownLatch;
+    };
+
+    void workerCallback() {
+        while (true) {
+            Job job;
+            {
+                MutexLockGuard mutexLockGuard(mutexLock);
+                while (jobList.empty() && runningFlag) {
+                    condition.wait();
+                }
+                if (jobList.empty()) {
+                    break;
+                }
+                job = jobList.front();
+                jobList.pop_front();
+            }
+            (*job.function)(job.index);
+            job.countdownLatch->countDown();
+        }
+    }
+
+    bool runningFlag = true;
+    std::vector<std::thread *> workers;
+    std::list<Job> jobList;
+    MutexLock mutexLock;
+    Condition condition;
+};
+
+#endif //MFDEDUP_CHUNKCOMPRESSOR_H
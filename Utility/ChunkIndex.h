@@ -0,0 +1,167 @@
+//  Copyright (c) Xiangyu Zou, 2020. All rights reserved.
+//  This source code is licensed under the GPLv2
+
+#ifndef MFDEDUP_CHUNKINDEX_H
+#define MFDEDUP_CHUNKINDEX_H
+
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include "StorageTask.h"
+#include "FileOperator.h"
+#include "Durability.h"
+
+const uint64_t ChunkIndexMagic = 0x58444e494b4e4843;
+
+struct ChunkIndexHeader {
+    uint64_t magic;
+    // identity of the indexed file, a sidecar which does not match is stale.
+    uint64_t inode;
+    uint64_t size;
+    uint64_t mtime;
+    uint64_t begin;
+    uint64_t count;
+};
+
+// Sidecar of a volume or category file, which lists where each chunk is stored, so that a restore reads only the
+// regions holding chunks it requires. It is kept next to the file as [file].idx, and saved by whoever writes the file,
+// as entries are added along with chunks. Files of repositories written before sidecars were saved are scanned for
+// chunk headers instead, which a restore does without writing anything.
+class ChunkIndex {
+public:
+    struct Entry {
+        SHA1FP fp;
+        // offset of the chunk header in the file, and length of the chunk including its header.
+        uint64_t offset;
+        uint64_t length;
+    };
+
+    // loads the index of a file whose chunks start at begin, and scans the file when the sidecar is missing or stale
+    // unless scan is false.
+    int load(const std::string &path, uint64_t begin, bool scan = true) {
+        entries.clear();
+        struct stat statBuffer;
+        if (stat(path.data(), &statBuffer) != 0) {
+            return -1;
+        }
+        ChunkIndexHeader expected = identity(statBuffer, begin);
+        if (readSidecar(path, expected)) {
+            return 0;
+        }
+        if (!scan) {
+            return -1;
+        }
+        scanned = true;
+        return this->scan(path, begin, expected.size);
+    }
+
+    // adds a chunk which has been written at offset, before the index is saved.
+    void add(const SHA1FP &fp, uint64_t offset, uint64_t length) {
+        entries.push_back({fp, offset, length});
+    }
+
+    // scans chunks from begin up to end, e.g. those written before an interrupted writer resumes after them.
+    int scan(const std::string &path, uint64_t begin, uint64_t end) {
+        FileOperator fileReader((char *) path.data(), FileOpenType::Read);
+        if (!fileReader.ok()) {
+            return -1;
+        }
+        int fd = fileReader.getFd();
+        uint64_t offset = begin;
+        BlockHeader blockHeader;
+        // chunks are stored as headers followed by data, and a zero length marks the preallocated tail of a volume.
+        while (offset + sizeof(BlockHeader) <= end) {
+            if (pread(fd, &blockHeader, sizeof(BlockHeader), offset) != sizeof(BlockHeader)) {
+                break;
+            }
+            if (blockHeader.length == 0 || offset + sizeof(BlockHeader) + blockHeader.length > end) {
+                break;
+            }
+            entries.push_back({blockHeader.fp, offset, sizeof(BlockHeader) + blockHeader.length});
+            offset += sizeof(BlockHeader) + blockHeader.length;
+        }
+        return 0;
+    }
+
+    // saves the sidecar of a file which fileOperator has completed, so nothing is written to it afterwards. The sidecar
+    // is completed in turn, and becomes durable along with the file.
+    int save(FileOperator *fileOperator, const std::string &path, uint64_t begin) {
+        struct stat statBuffer;
+        if (fstat(fileOperator->getFd(), &statBuffer) != 0) {
+            return -1;
+        }
+        ChunkIndexHeader header = identity(statBuffer, begin);
+        header.count = entries.size();
+        std::string indexPath = path + ".idx";
+        FileOperator indexWriter((char *) indexPath.data(), FileOpenType::Write);
+        if (!indexWriter.ok()) {
+            return -1;
+        }
+        if (indexWriter.write((uint8_t *) &header, sizeof(ChunkIndexHeader)) != sizeof(ChunkIndexHeader) ||
+            indexWriter.write((uint8_t *) entries.data(), entries.size() * sizeof(Entry)) !=
+            entries.size() * sizeof(Entry)) {
+            return -1;
+        }
+        return GlobalDurability.completed(&indexWriter);
+    }
+
+    const std::vector<Entry> &getEntries() const {
+        return entries;
+    }
+
+    bool isScanned() const {
+        return scanned;
+    }
+
+    // keeps the sidecar with its file, a sidecar left behind would be found stale anyway.
+    static void rename(const char *oldPath, const char *newPath) {
+        std::string oldIndex = std::string(oldPath) + ".idx", newIndex = std::string(newPath) + ".idx";
+        if (::rename(oldIndex.data(), newIndex.data()) != 0) {
+            ::remove(newIndex.data());
+        }
+    }
+
+    static void remove(const char *path) {
+        std::string index = std::string(path) + ".idx";
+        ::remove(index.data());
+    }
+
+private:
+    static ChunkIndexHeader identity(const struct stat &statBuffer, uint64_t begin) {
+        return {
+                ChunkIndexMagic,
+                (uint64_t) statBuffer.st_ino,
+                (uint64_t) statBuffer.st_size,
+                (uint64_t) statBuffer.st_mtim.tv_sec * 1000000000 + statBuffer.st_mtim.tv_nsec,
+                begin,
+                0
+        };
+    }
+
+    bool readSidecar(const std::string &path, const ChunkIndexHeader &expected) {
+        std::string indexPath = path + ".idx";
+        FileOperator indexReader((char *) indexPath.data(), FileOpenType::Read);
+        if (!indexReader.ok()) {
+            return false;
+        }
+        ChunkIndexHeader header;
+        if (indexReader.read((uint8_t *) &header, sizeof(ChunkIndexHeader)) != sizeof(ChunkIndexHeader)) {
+            return false;
+        }
+        if (header.magic != expected.magic || header.inode != expected.inode || header.size != expected.size ||
+            header.mtime != expected.mtime || header.begin != expected.begin) {
+            return false;
+        }
+        entries.resize(header.count);
+        if (indexReader.read((uint8_t *) entries.data(), header.count * sizeof(Entry)) != header.count * sizeof(Entry)) {
+            entries.clear();
+            return false;
+        }
+        return true;
+    }
+
+    std::vector<Entry> entries;
+    bool scanned = false;
+};
+
+#endif //MFDEDUP_CHUNKINDEX_H
@@ -4,92 +4,364 @@
 #ifndef MFDEDUP_CHUNKWRITERMANAGER_H
 #define MFDEDUP_CHUNKWRITERMANAGER_H
 
+#include <sys/uio.h>
+#include <climits>
+#include <algorithm>
 #include "Likely.h"
+#include "Durability.h"
+#include "ChunkCompressor.h"
+#include "Resemblance.h"
+#include "ChunkIndex.h"
 
 DEFINE_uint64(WriteBufferLength,
               8388608, "WriteBufferLength");
 
-DEFINE_uint64(ChunkWriterManagerFlushThreshold,
-              8, "WriteBufferLength");
+DEFINE_uint64(ChunkWriterBuffers,
+              4, "write buffers of the new category, one is filled while the others are written in the background");
+
+DEFINE_bool(ChunkWriterScatter,
+            true, "write unique chunks from the input buffer by writev, rather than copying them into write buffers");
+
+DEFINE_uint64(ChunkWriterIovecs,
+              1024, "entries of a writev batch, two for each chunk");
 
 extern std::string ClassFilePath;
 extern std::string VersionFilePath;
 
-int WorkerExitMagicNumber = -1;
-
+// In scatter mode, buffer holds only chunk headers, and iov points at them and at chunks in the input buffer.
 struct WriteBuffer {
     char *buffer;
     uint64_t totalLength;
     uint64_t available;
+    struct iovec *iov = nullptr;
+    uint64_t iovCount = 0;
+    uint64_t length = 0;
+    uint64_t chunkCount = 0;
+    // ordinals of delta chunks in the buffer, with their bases.
+    std::vector<std::pair<uint64_t, SHA1FP>> bases;
 };
 
+// reads the chunk of a fingerprint into a buffer, returns false when it can not.
+typedef std::function<bool(const SHA1FP &, std::vector<uint8_t> &)> ChunkReader;
 
+
+// Buffers unique chunks of the new category, and writes them in the background. Full buffers are handed to a writer
+// thread, so that writeClass only waits when every buffer of the ring is being written.
+// Chunks written in scatter mode are referred to rather than copied, so the input buffer must outlive the manager,
+// whose destructor returns after everything has been written.
+// With direct I/O, chunks are copied into aligned buffers which are written whole, and the padding of the last one is
+// truncated when the manager is deleted.
+// With compression, the writer thread encodes each buffer by the compression pool before writing it, which keeps
+// compression off the path of deduplication. Encoded buffers are written in whole blocks under direct I/O, and the
+// rest is carried to the next one.
+// Chunks with a base are encoded as deltas against it by the compression pool as well, whether or not they are
+// compressed, and stored as deltas where this beats compression.
+// The chunk index of the category is saved when it is complete. Chunks are added to it as they are buffered, or as
+// they are encoded by the writer thread, which is where their stored lengths are known.
 class ChunkWriterManager {
 public:
-    ChunkWriterManager(uint64_t currentVersion):runningFlag(true), taskAmount(0), mutexLock(), condition(mutexLock) {
+    // expectedLength is an upper bound of the category, which is preallocated. Bases are read by baseReader.
+    ChunkWriterManager(uint64_t currentVersion, uint64_t expectedLength = 0, const ChunkReader &reader = nullptr)
+            : baseReader(reader), runningFlag(true), taskAmount(0), mutexLock(), condition(mutexLock),
+              freeCondition(mutexLock) {
         classId = (currentVersion + 1) * currentVersion / 2;
 
         sprintf(pathBuffer, ClassFilePath.data(), classId);
         writer = new FileOperator(pathBuffer, FileOpenType::Write);
+        writer->preallocate(0, expectedLength);
         syncCounter = 0;
-        writeBuffer = {
-                (char *) malloc(FLAGS_WriteBufferLength),
-                FLAGS_WriteBufferLength,
-                FLAGS_WriteBufferLength,
-        };
+        direct = FLAGS_DirectIO && writer->setDirect(true) == 0;
+        compress = FLAGS_Compression == "lz4";
+        if (compress || baseReader) {
+            compressionPool = new CompressionPool(FLAGS_CompressionThreads);
+        }
+        // encoding copies chunks anyway, so they are only referred to until then.
+        scatter = FLAGS_ChunkWriterScatter && (!direct || compressionPool);
+        iovAmount = std::min(std::max(FLAGS_ChunkWriterIovecs, (uint64_t) 2), (uint64_t) IOV_MAX);
+        uint64_t bufferLength = scatter ? iovAmount / 2 * sizeof(BlockHeader) : FLAGS_WriteBufferLength;
+        if (direct) {
+            bufferLength = alignUp(bufferLength);
+        }
+        uint64_t bufferAmount = std::max(FLAGS_ChunkWriterBuffers, (uint64_t) 2);
+        for (uint64_t i = 0; i < bufferAmount; i++) {
+            freeList.push_back({
+                                       direct ? (char *) alignedMalloc(bufferLength) : (char *) malloc(bufferLength),
+                                       bufferLength,
+                                       bufferLength,
+                                       nullptr,
+                                       0,
+                                       0,
+                                       0,
+                                       {},
+                               });
+            if (scatter) {
+                freeList.back().iov = (struct iovec *) malloc(iovAmount * sizeof(struct iovec));
+            }
+        }
+        writeBuffer = freeList.front();
+        freeList.pop_front();
 
         syncWorker = new std::thread(std::bind(&ChunkWriterManager::ChunkWriterManagerCallback, this));
     }
 
-    int writeClass(uint8_t *header, uint64_t headerLen, uint8_t *buffer, uint64_t bufferLen) {
-
-        if ((headerLen + bufferLen) > writeBuffer.available) {
-            classFlush();
+    int writeClass(uint8_t *header, uint64_t headerLen, uint8_t *buffer, uint64_t bufferLen,
+                   const SHA1FP *baseFp = nullptr) {
+        if (scatter) {
+            scatterClass(header, headerLen, buffer, bufferLen);
+        } else if (direct && !compressionPool) {
+            copyClass((uint8_t *) header, headerLen);
+            copyClass(buffer, bufferLen);
+        } else {
+            if ((headerLen + bufferLen) > writeBuffer.available) {
+                classFlush();
+            }
+            char *writePoint = writeBuffer.buffer + writeBuffer.totalLength - writeBuffer.available;
+            memcpy(writePoint, header, headerLen);
+            writeBuffer.available -= headerLen;
+            writePoint += headerLen;
+            memcpy(writePoint, buffer, bufferLen);
+            writeBuffer.available -= bufferLen;
+            writeBuffer.length += headerLen + bufferLen;
         }
-        char *writePoint = writeBuffer.buffer + writeBuffer.totalLength - writeBuffer.available;
-        memcpy(writePoint, header, headerLen);
-        writeBuffer.available -= headerLen;
-        writePoint += headerLen;
-        memcpy(writePoint, buffer, bufferLen);
-        writeBuffer.available -= bufferLen;
+        if (!compressionPool) {
+            chunkIndex.add(((BlockHeader *) header)->fp, indexOffset, headerLen + bufferLen);
+            indexOffset += headerLen + bufferLen;
+        }
+        if (baseFp && baseReader) {
+            writeBuffer.bases.push_back({writeBuffer.chunkCount, *baseFp});
+        }
+        writeBuffer.chunkCount++;
 
         return 0;
     }
 
 
     ~ChunkWriterManager() {
-        addTask(WorkerExitMagicNumber);
+        bool pending = writeBuffer.length;
+        if (pending) {
+            addTask(writeBuffer);
+        }
+        addTask({nullptr, 0, 0, nullptr, 0, 0, 0, {}});
         syncWorker->join();
-        classFlush();
-        writer->fdatasync();
+        if (!pending) {
+            freeList.push_back(writeBuffer);
+        }
+        if (direct) {
+            if (carry) {
+                memset(encoded + carry, 0, alignUp(carry) - carry);
+                writer->writeAt(encoded, alignUp(carry), writeOffset);
+                writeOffset += carry;
+            }
+            writer->trunc(writeOffset);
+            writer->setDirect(false);
+            writer->seek(writeOffset);
+        }
+        writer->trim();
+        GlobalDurability.completed(writer);
+        chunkIndex.save(writer, pathBuffer, 0);
         delete writer;
-        delete writeBuffer.buffer;
+        for (auto &item : freeList) {
+            free(item.buffer);
+            free(item.iov);
+        }
+        printf("Chunk writer waited %lu us for free buffers\n", stallDuration);
+        if (compressionPool) {
+            printf("Compression stored %lu bytes of chunks in %lu bytes, %lu of %lu chunks compressed, %lu as deltas\n",
+                   rawLength, encodedLength, compressedChunks, totalChunks, deltaChunks);
+            delete compressionPool;
+        }
+        free(encoded);
     }
 
 private:
+    // copies only the header, the chunk is written from where it is.
+    int scatterClass(uint8_t *header, uint64_t headerLen, uint8_t *buffer, uint64_t bufferLen) {
+        if (headerLen > writeBuffer.available || writeBuffer.iovCount + 2 > iovAmount ||
+            writeBuffer.length + headerLen + bufferLen > FLAGS_WriteBufferLength) {
+            classFlush();
+        }
+        char *writePoint = writeBuffer.buffer + writeBuffer.totalLength - writeBuffer.available;
+        memcpy(writePoint, header, headerLen);
+        writeBuffer.available -= headerLen;
+        writeBuffer.iov[writeBuffer.iovCount++] = {writePoint, headerLen};
+        writeBuffer.iov[writeBuffer.iovCount++] = {buffer, bufferLen};
+        writeBuffer.length += headerLen + bufferLen;
+        return 0;
+    }
+
+    // fills buffers up to their end, so that only the last one written is partial.
+    void copyClass(uint8_t *data, uint64_t dataLen) {
+        while (dataLen) {
+            if (!writeBuffer.available) {
+                classFlush();
+            }
+            uint64_t length = std::min(dataLen, writeBuffer.available);
+            memcpy(writeBuffer.buffer + writeBuffer.totalLength - writeBuffer.available, data, length);
+            writeBuffer.available -= length;
+            writeBuffer.length += length;
+            data += length;
+            dataLen -= length;
+        }
+    }
+
+    // hands the current buffer to the writer thread, and continues with a free one.
     int classFlush() {
-        uint64_t flushLength = writeBuffer.totalLength - writeBuffer.available;
-        writer->write((uint8_t *) writeBuffer.buffer, flushLength);
-        writeBuffer.available = writeBuffer.totalLength;
-        if(syncCounter >= FLAGS_ChunkWriterManagerFlushThreshold){
-            addTask(classId);
-            syncCounter = 0;
-        }else{
-            syncCounter++;
+        addTask(writeBuffer);
+        struct timeval t0, t1;
+        gettimeofday(&t0, NULL);
+        {
+            MutexLockGuard mutexLockGuard(mutexLock);
+            while (freeList.empty()) {
+                freeCondition.wait();
+            }
+            writeBuffer = freeList.front();
+            freeList.pop_front();
         }
+        gettimeofday(&t1, NULL);
+        stallDuration += (t1.tv_sec - t0.tv_sec) * 1000000 + t1.tv_usec - t0.tv_usec;
         return 0;
 
     }
 
-    int addTask(uint64_t classId) {
+    int addTask(const WriteBuffer &fullBuffer) {
         MutexLockGuard mutexLockGuard(mutexLock);
-        taskList.push_back(classId);
+        taskList.push_back(fullBuffer);
         taskAmount++;
         condition.notify();
+        return 0;
+    }
+
+    // encodes the chunks of a buffer after the carry of encoded, in parts which are taken by the compression pool.
+    // Each part is encoded where its chunks would be copied, since it does not outgrow them, and parts are then moved
+    // together.
+    uint64_t encodeBuffer(const WriteBuffer &fullBuffer) {
+        chunks.clear();
+        if (fullBuffer.iov) {
+            for (uint64_t i = 0; i + 1 < fullBuffer.iovCount; i += 2) {
+                chunks.push_back({(BlockHeader *) fullBuffer.iov[i].iov_base,
+                                  (uint8_t *) fullBuffer.iov[i + 1].iov_base});
+            }
+        } else {
+            for (uint64_t offset = 0; offset < fullBuffer.length;) {
+                BlockHeader *blockHeader = (BlockHeader *) (fullBuffer.buffer + offset);
+                chunks.push_back({blockHeader, (uint8_t *) blockHeader + sizeof(BlockHeader)});
+                offset += sizeof(BlockHeader) + blockHeader->length;
+            }
+        }
+        uint64_t capacity = carry + fullBuffer.length + DirectIOAlignment;
+        if (capacity > encodedCapacity) {
+            uint8_t *newEncoded = direct ? alignedMalloc(capacity) : (uint8_t *) malloc(capacity);
+            if (carry) {
+                memcpy(newEncoded, encoded, carry);
+            }
+            free(encoded);
+            encoded = newEncoded;
+            encodedCapacity = capacity;
+        }
+
+        uint64_t parts = std::min((uint64_t) chunks.size(), compressionPool->size());
+        std::vector<uint64_t> partBegin(parts + 1), partOffset(parts), partLength(parts), partCompressed(parts),
+                partDeltas(parts);
+        chunkLengths.resize(chunks.size());
+        uint64_t rawOffset = 0;
+        for (uint64_t i = 0, p = 0; i < chunks.size(); i++) {
+            if (p < parts && i == chunks.size() * p / parts) {
+                partBegin[p] = i;
+                partOffset[p++] = rawOffset;
+            }
+            rawOffset += sizeof(BlockHeader) + chunks[i].first->length;
+        }
+        partBegin[parts] = chunks.size();
+        compressionPool->parallelFor(parts, [&](uint64_t p) {
+            uint8_t *out = encoded + carry + partOffset[p];
+            DeltaScratch deltaScratch;
+            auto base = std::lower_bound(fullBuffer.bases.begin(), fullBuffer.bases.end(), partBegin[p],
+                                         [](const std::pair<uint64_t, SHA1FP> &item, uint64_t ordinal) {
+                                             return item.first < ordinal;
+                                         });
+            for (uint64_t i = partBegin[p]; i < partBegin[p + 1]; i++) {
+                const SHA1FP *baseFp = nullptr;
+                if (base != fullBuffer.bases.end() && base->first == i) {
+                    baseFp = &base->second;
+                    base++;
+                }
+                ChunkEncoding encoding;
+                uint64_t length = encodeChunk(chunks[i].first, chunks[i].second, out + partLength[p], baseFp,
+                                              deltaScratch, &encoding);
+                chunkLengths[i] = length;
+                partLength[p] += length;
+                partCompressed[p] += encoding == ChunkEncoding::LZ4;
+                partDeltas[p] += encoding == ChunkEncoding::Delta;
+            }
+        });
+        uint64_t length = 0;
+        for (uint64_t p = 0; p < parts; p++) {
+            memmove(encoded + carry + length, encoded + carry + partOffset[p], partLength[p]);
+            length += partLength[p];
+            compressedChunks += partCompressed[p];
+            deltaChunks += partDeltas[p];
+        }
+        for (uint64_t i = 0; i < chunks.size(); i++) {
+            chunkIndex.add(chunks[i].first->fp, indexOffset, chunkLengths[i]);
+            indexOffset += chunkLengths[i];
+        }
+        totalChunks += chunks.size();
+        rawLength += rawOffset;
+        encodedLength += length;
+        return length;
     }
 
+    struct DeltaScratch {
+        std::vector<uint8_t> base;
+        std::vector<uint8_t> delta;
+        std::vector<uint32_t> table;
+    };
+
+    // writes a chunk to out compressed, or as it is, or as a delta against its base where this is shorter by an eighth
+    // of the chunk at least. The result does not outgrow the chunk.
+    uint64_t encodeChunk(const BlockHeader *blockHeader, const uint8_t *chunk, uint8_t *out, const SHA1FP *baseFp,
+                         DeltaScratch &deltaScratch, ChunkEncoding *encoding) {
+        bool compressed = false;
+        uint64_t length = compress ? ChunkCompressor::encode(blockHeader, chunk, out, &compressed)
+                                   : ChunkCompressor::store(blockHeader, chunk, out);
+        *encoding = compressed ? ChunkEncoding::LZ4 : ChunkEncoding::Raw;
+        uint64_t rawLength = blockHeader->length;
+        if (!baseFp || rawLength > CompressionMaxLength || !baseReader(*baseFp, deltaScratch.base)) {
+            return length;
+        }
+        uint64_t limit = std::min(length - sizeof(BlockHeader) - 1, rawLength - (rawLength >> CompressionSavingShift));
+        deltaScratch.delta.resize(limit);
+        uint64_t deltaLength = DeltaCompressor::encode(*baseFp, deltaScratch.base.data(), deltaScratch.base.size(),
+                                                       chunk, rawLength, deltaScratch.delta.data(), limit,
+                                                       deltaScratch.table);
+        if (!deltaLength) {
+            return length;
+        }
+        BlockHeader *outHeader = (BlockHeader *) out;
+        *outHeader = *blockHeader;
+        outHeader->length = deltaLength;
+        outHeader->encoding = (uint32_t) ChunkEncoding::Delta;
+        outHeader->decodedLength = rawLength;
+        memcpy(out + sizeof(BlockHeader), deltaScratch.delta.data(), deltaLength);
+        *encoding = ChunkEncoding::Delta;
+        return sizeof(BlockHeader) + deltaLength;
+    }
+
+    // writes whole blocks of the carry and the encoded buffer following it, and carries the rest.
+    void writeEncoded(uint64_t length) {
+        uint64_t total = carry + length;
+        uint64_t whole = alignDown(total);
+        if (whole) {
+            writer->writeAt(encoded, whole, writeOffset);
+            writeOffset += whole;
+        }
+        carry = total - whole;
+        memmove(encoded, encoded + whole, carry);
+    }
+
+    // a buffer without memory tells the writer thread to exit.
     void ChunkWriterManagerCallback(){
-        uint64_t classId;
+        WriteBuffer fullBuffer;
         while (likely(runningFlag)) {
             {
                 MutexLockGuard mutexLockGuard(mutexLock);
@@ -99,15 +371,45 @@ private:
                 }
                 if (unlikely(!runningFlag)) continue;
                 taskAmount--;
-                classId = taskList.front();
+                fullBuffer = taskList.front();
                 taskList.pop_front();
             }
 
-            if(classId == WorkerExitMagicNumber){
+            if (fullBuffer.buffer == nullptr) {
                 break;
             }
 
-            writer->fdatasync();
+            if (compressionPool) {
+                uint64_t length = encodeBuffer(fullBuffer);
+                if (direct) {
+                    writeEncoded(length);
+                } else {
+                    writer->write(encoded, length);
+                }
+            } else if (direct) {
+                uint64_t alignedLength = alignUp(fullBuffer.length);
+                memset(fullBuffer.buffer + fullBuffer.length, 0, alignedLength - fullBuffer.length);
+                writer->writeAt((uint8_t *) fullBuffer.buffer, alignedLength, writeOffset);
+                writeOffset += fullBuffer.length;
+            } else if (fullBuffer.iov) {
+                writer->writev(fullBuffer.iov, fullBuffer.iovCount);
+            } else {
+                writer->write((uint8_t *) fullBuffer.buffer, fullBuffer.length);
+            }
+            if (GlobalDurability.flushed(writer, syncCounter)) {
+                writer->fdatasync();
+            }
+
+            fullBuffer.available = fullBuffer.totalLength;
+            fullBuffer.iovCount = 0;
+            fullBuffer.length = 0;
+            fullBuffer.chunkCount = 0;
+            fullBuffer.bases.clear();
+            {
+                MutexLockGuard mutexLockGuard(mutexLock);
+                freeList.push_back(fullBuffer);
+                freeCondition.notify();
+            }
         }
     }
 
@@ -116,13 +418,39 @@ private:
     uint64_t syncCounter = 0;
     uint64_t classId;
     char pathBuffer[256];
+    uint64_t stallDuration = 0;
+    uint64_t iovAmount;
+    bool scatter;
+    bool direct;
+    // end of what the writer thread has written in direct mode.
+    uint64_t writeOffset = 0;
+    // added by the main thread, or by the writer thread when chunks are encoded.
+    ChunkIndex chunkIndex;
+    uint64_t indexOffset = 0;
+
+    CompressionPool *compressionPool = nullptr;
+    bool compress;
+    ChunkReader baseReader;
+    std::vector<std::pair<BlockHeader *, uint8_t *>> chunks;
+    std::vector<uint64_t> chunkLengths;
+    // encoded chunks, which start with the carry, what is left of the previous buffer to write in direct mode.
+    uint8_t *encoded = nullptr;
+    uint64_t encodedCapacity = 0;
+    uint64_t carry = 0;
+    uint64_t rawLength = 0;
+    uint64_t encodedLength = 0;
+    uint64_t compressedChunks = 0;
+    uint64_t deltaChunks = 0;
+    uint64_t totalChunks = 0;
 
     std::thread* syncWorker;
     bool runningFlag;
     uint64_t taskAmount;
-    std::list<uint64_t> taskList;
+    std::list<WriteBuffer> taskList;
+    std::list<WriteBuffer> freeList;
     MutexLock mutexLock;
     Condition condition;
+    Condition freeCondition;
 };
 
 #endif //MFDEDUP_CHUNKWRITERMANAGER_H
@@ -12,6 +12,8 @@ extern std::string ManifestPath;
 extern std::string KVPath;
 extern std::string HomePath;
 extern std::string ClassFileAppendPath;
+extern std::string JournalFilePath;
+extern std::string RestoreCalibrationPath;
 extern uint64_t RetentionTime;
 
 class ConfigReader{
@@ -26,6 +28,8 @@ public:
         KVPath = path + "kvstore";
         HomePath = path;
         ClassFileAppendPath = path + "/storageFiles/Category%lu_append";
+        JournalFilePath = path + "/arrangementJournal";
+        RestoreCalibrationPath = path + "/restoreCalibration";
         int64_t rt = toml::find<int64_t>(data, "retention");
         RetentionTime = rt;
         printf("-----------------------Configure-----------------------\n");
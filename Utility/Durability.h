@@ -0,0 +1,120 @@
+//  Copyright (c) Xiangyu Zou, 2020. All rights reserved.
+//  This source code is licensed under the GPLv2
+
+#ifndef MFDEDUP_DURABILITY_H
+#define MFDEDUP_DURABILITY_H
+
+#include <map>
+#include <string>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "gflags/gflags.h"
+#include "Lock.h"
+#include "FileOperator.h"
+
+DEFINE_string(Durability,
+              "version", "strict: files are synced at every flush, periodic: every --DurabilitySyncInterval flushes, "
+                         "version: only once, together, when the version commits");
+DEFINE_uint64(DurabilitySyncInterval,
+              8, "flushes between syncs of a file under the periodic durability mode");
+DEFINE_bool(DurabilityWriteBehind,
+            true, "start writeback of each flush which is not synced, so that syncs find little dirty data");
+
+enum class DurabilityMode {
+    Strict,
+    Periodic,
+    Version,
+};
+
+// Decides when recipes, categories, volumes, the index and restored files are synced. Files are synced at flushes by
+// the mode, and when complete, either at once or, under the version mode, in a group commit with the other files of
+// the version right before the manifest refers to them. Checkpoints of the arrangement journal sync regardless of the
+// mode, since resuming relies on them.
+class Durability {
+public:
+    // called after a flush of a file, whose flushes since its last sync are counted by counter. Returns whether the
+    // file is to be synced now, which the caller does, possibly in another thread.
+    bool flushed(FileOperator *fileOperator, uint64_t &counter) {
+        DurabilityMode mode = getMode();
+        counter++;
+        if (mode == DurabilityMode::Strict ||
+            (mode == DurabilityMode::Periodic && counter >= FLAGS_DurabilitySyncInterval)) {
+            counter = 0;
+            return true;
+        }
+        if (FLAGS_DurabilityWriteBehind) {
+            fileOperator->writeBehind();
+        }
+        return false;
+    }
+
+    // called when a file has been completely written, before it is closed.
+    int completed(FileOperator *fileOperator) {
+        if (getMode() != DurabilityMode::Version) {
+            return fileOperator->fdatasync();
+        }
+        fflush(fileOperator->getFP());
+        if (FLAGS_DurabilityWriteBehind) {
+            fileOperator->writeBehind();
+        }
+        struct stat statBuffer;
+        if (fstat(fileOperator->getFd(), &statBuffer) != 0) {
+            return fileOperator->fdatasync();
+        }
+        // a file completed twice, e.g. a volume whose header is written last, is synced once.
+        MutexLockGuard mutexLockGuard(lock);
+        auto key = std::make_pair((uint64_t) statBuffer.st_dev, (uint64_t) statBuffer.st_ino);
+        if (pendingFiles.find(key) == pendingFiles.end()) {
+            pendingFiles[key] = dup(fileOperator->getFd());
+        }
+        return 0;
+    }
+
+    // syncs files completed since the last commit.
+    int sync() {
+        MutexLockGuard mutexLockGuard(lock);
+        for (auto &item : pendingFiles) {
+            ::fdatasync(item.second);
+            close(item.second);
+            groupSyncs++;
+        }
+        fileSyncCounter += pendingFiles.size();
+        pendingFiles.clear();
+        return 0;
+    }
+
+    // reports the syncs since the last report.
+    void report(const char *name) {
+        uint64_t syncs = fileSyncCounter - committedSyncs;
+        committedSyncs += syncs;
+        printf("Durability %s: %lu fsyncs for %s, %lu of them in group commit\n", FLAGS_Durability.data(), syncs,
+               name, groupSyncs);
+        groupSyncs = 0;
+    }
+
+    int commit(const char *name) {
+        sync();
+        report(name);
+        return 0;
+    }
+
+private:
+    DurabilityMode getMode() {
+        if (FLAGS_Durability == "strict") {
+            return DurabilityMode::Strict;
+        } else if (FLAGS_Durability == "version") {
+            return DurabilityMode::Version;
+        }
+        return DurabilityMode::Periodic;
+    }
+
+    MutexLock lock;
+    // open descriptors of completed files, by device and inode.
+    std::map<std::pair<uint64_t, uint64_t>, int> pendingFiles;
+    uint64_t committedSyncs = 0;
+    uint64_t groupSyncs = 0;
+};
+
+static Durability GlobalDurability;
+
+#endif //MFDEDUP_DURABILITY_H
@@ -2,10 +2,15 @@
 #define REDUNDANCY_DETECTION_FILEOPERATOR_H
 
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <string>
+#include <vector>
+#include <atomic>
 #include <cstring>
 #include <cassert>
+#include "IOLimiter.h"
 
 enum class FileOpenType {
     Read,
@@ -14,7 +19,40 @@ enum class FileOpenType {
     Append,
 };
 
+DEFINE_bool(DirectIO,
+            false, "bypass the page cache for new categories, arrangement and restore reads, falls back to buffered I/O "
+                   "where the file system does not support it");
+
+DEFINE_bool(Preallocate,
+            true, "preallocate categories, volumes and recipes from their expected sizes, so that they are allocated "
+                  "contiguously, and release what is left unused when they are closed");
+
+DEFINE_uint64(ReadAdviceWindow,
+              67108864, "bytes prefetched ahead of sequential reads of input, arrangement and restore, which also drop "
+                        "what they have read from the page cache, 0 disables");
+
 uint64_t fileCounter = 0;
+std::atomic<uint64_t> fileSyncCounter(0);
+
+// offsets, lengths and buffers of direct I/O are aligned to it, which covers logical blocks of common devices.
+const uint64_t DirectIOAlignment = 4096;
+
+inline uint64_t alignDown(uint64_t value) {
+    return value / DirectIOAlignment * DirectIOAlignment;
+}
+
+inline uint64_t alignUp(uint64_t value) {
+    return (value + DirectIOAlignment - 1) / DirectIOAlignment * DirectIOAlignment;
+}
+
+// buffers of direct I/O, which are released by free().
+inline uint8_t *alignedMalloc(uint64_t length) {
+    void *buffer = nullptr;
+    if (posix_memalign(&buffer, DirectIOAlignment, alignUp(length)) != 0) {
+        return nullptr;
+    }
+    return (uint8_t *) buffer;
+}
 
 class FileOperator {
 public:
@@ -62,17 +100,156 @@ public:
     }
 
     uint64_t read(uint8_t *buffer, uint64_t length) {
-        return fread(buffer, 1, length, file);
+        uint64_t r = fread(buffer, 1, length, file);
+        if (limiter) limiter->acquire(r);
+        return r;
     }
 
     uint64_t write(uint8_t *buffer, uint64_t length) {
+        if (limiter) limiter->acquire(length);
         return fwrite(buffer, 1, length, file);
     }
 
+    // writes the buffers in order after what has been written by write, returns the bytes written.
+    uint64_t writev(const struct iovec *iov, uint64_t iovcnt) {
+        uint64_t length = 0;
+        for (uint64_t i = 0; i < iovcnt; i++) {
+            length += iov[i].iov_len;
+        }
+        if (limiter) limiter->acquire(length);
+        fflush(file);
+        std::vector<struct iovec> pending(iov, iov + iovcnt);
+        struct iovec *current = pending.data();
+        uint64_t remaining = iovcnt, written = 0;
+        while (remaining) {
+            ssize_t r = ::writev(fileno(file), current, remaining);
+            if (r <= 0) {
+                if (r < 0 && errno == EINTR) continue;
+                break;
+            }
+            written += r;
+            // skips what has been written, and resumes inside a partly written buffer.
+            while (remaining && (uint64_t) r >= current->iov_len) {
+                r -= current->iov_len;
+                current++;
+                remaining--;
+            }
+            if (remaining) {
+                current->iov_base = (char *) current->iov_base + r;
+                current->iov_len -= r;
+            }
+        }
+        return written;
+    }
+
+    // positional reads and writes bypass the stdio buffer, and are used for direct I/O.
+    uint64_t readAt(uint8_t *buffer, uint64_t length, uint64_t offset) {
+        uint64_t done = 0;
+        while (done < length) {
+            ssize_t r = pread(fileno(file), buffer + done, length - done, offset + done);
+            if (r <= 0) {
+                if (r < 0 && errno == EINTR) continue;
+                break;
+            }
+            done += r;
+        }
+        if (limiter) limiter->acquire(done);
+        return done;
+    }
+
+    uint64_t writeAt(uint8_t *buffer, uint64_t length, uint64_t offset) {
+        if (limiter) limiter->acquire(length);
+        uint64_t done = 0;
+        while (done < length) {
+            ssize_t r = pwrite(fileno(file), buffer + done, length - done, offset + done);
+            if (r <= 0) {
+                if (r < 0 && errno == EINTR) continue;
+                break;
+            }
+            done += r;
+        }
+        return done;
+    }
+
+    // With O_DIRECT, reads and writes bypass the page cache, and must be aligned in memory, offset and length.
+    // Returns -1 when the file system does not support it.
+    int setDirect(bool direct) {
+        fflush(file);
+        int flags = fcntl(fileno(file), F_GETFL);
+        flags = direct ? flags | O_DIRECT : flags & ~O_DIRECT;
+        return fcntl(fileno(file), F_SETFL, flags);
+    }
+
+    // Tells the kernel that [begin, end) is read sequentially once. With a window, advise() prefetches the window ahead
+    // of the cursor and drops what is behind it, so that the page cache holds about a window of the file.
+    void adviseSequential(uint64_t begin, uint64_t end, uint64_t window) {
+        adviceWindow = window;
+        adviceEnd = end;
+        prefetchedEnd = droppedEnd = alignDown(begin);
+        posix_fadvise(fileno(file), begin, end - begin, POSIX_FADV_SEQUENTIAL);
+        advise(begin);
+    }
+
+    // called as the cursor of the read moves to offset. Advices are issued for half a window at least, rather than
+    // for every read.
+    void advise(uint64_t offset) {
+        if (!adviceWindow) {
+            return;
+        }
+        if (prefetchedEnd < adviceEnd && prefetchedEnd < offset + adviceWindow / 2) {
+            uint64_t begin = std::max(prefetchedEnd, offset);
+            prefetchedEnd = std::min(offset + adviceWindow, adviceEnd);
+            posix_fadvise(fileno(file), begin, prefetchedEnd - begin, POSIX_FADV_WILLNEED);
+        }
+        // the end of the read drops the rest.
+        bool finished = offset >= adviceEnd;
+        uint64_t behind = finished ? offset : alignDown(offset);
+        if (behind > droppedEnd && (behind >= droppedEnd + adviceWindow / 2 || finished)) {
+            posix_fadvise(fileno(file), droppedEnd, behind - droppedEnd, POSIX_FADV_DONTNEED);
+            droppedEnd = behind;
+        }
+    }
+
+    // reserves [offset, offset + length) without changing the size of the file, so that it is allocated contiguously
+    // as it grows. Returns -1 when the file system does not support it.
+    int preallocate(uint64_t offset, uint64_t length) {
+        if (!FLAGS_Preallocate || !length) {
+            return 0;
+        }
+        int r = fallocate(fileno(file), FALLOC_FL_KEEP_SIZE, offset, length);
+        if (r == 0) {
+            preallocated = true;
+        }
+        return r;
+    }
+
+    // releases what has been preallocated beyond the end of the file, truncating to its own size frees the blocks.
+    int trim() {
+        if (!preallocated) {
+            return 0;
+        }
+        fflush(file);
+        struct stat statBuffer;
+        if (fstat(fileno(file), &statBuffer) != 0) {
+            return -1;
+        }
+        preallocated = false;
+        return ftruncate64(fileno(file), statBuffer.st_size);
+    }
+
+    // reads and writes are charged to the budget of a task.
+    void setLimiter(IOLimiter *ioLimiter) {
+        limiter = ioLimiter;
+    }
+
     int seek(uint64_t offset) {
         return fseeko64(file, offset, SEEK_SET);
     }
 
+    uint64_t tell() {
+        return ftello64(file);
+    }
+
     int trunc(uint64_t size) {
         return ftruncate64(fileno(file), size);
     }
@@ -89,9 +266,29 @@ public:
     }
 
     int fdatasync() {
+        fflush(file);
+        fileSyncCounter++;
         return ::fdatasync(file->_fileno);
     }
 
+    // starts writeback of dirty pages without waiting for it.
+    int writeBehind() {
+        fflush(file);
+        return sync_file_range(fileno(file), 0, 0, SYNC_FILE_RANGE_WRITE);
+    }
+
+    // makes creations, renames and removals of files in a directory durable.
+    static int syncDirectory(const std::string &path) {
+        int fd = open(path.data(), O_RDONLY | O_DIRECTORY);
+        if (fd < 0) {
+            return -1;
+        }
+        fileSyncCounter++;
+        int r = ::fsync(fd);
+        close(fd);
+        return r;
+    }
+
     int getFd() {
         return fileno(file);
     }
@@ -103,6 +300,14 @@ public:
 private:
     FILE *file;
     int status = 0;
+    IOLimiter *limiter = nullptr;
+    bool preallocated = false;
+
+    uint64_t adviceWindow = 0;
+    uint64_t adviceEnd = 0;
+    // what has been prefetched and dropped of the sequential read.
+    uint64_t prefetchedEnd = 0;
+    uint64_t droppedEnd = 0;
 };
 
 
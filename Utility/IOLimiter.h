@@ -0,0 +1,123 @@
+//  Copyright (c) Xiangyu Zou, 2020. All rights reserved.
+//  This source code is licensed under the GPLv2
+
+#ifndef MFDEDUP_IOLIMITER_H
+#define MFDEDUP_IOLIMITER_H
+
+#include <sys/time.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include "gflags/gflags.h"
+#include "Lock.h"
+
+DEFINE_uint64(ArrangementBandwidth,
+              0, "I/O bandwidth (MB/s) of arrangement, 0 means unlimited");
+DEFINE_uint64(ArrangementIOPS,
+              0, "I/O operations per second of arrangement, 0 means unlimited");
+DEFINE_uint64(EliminationBandwidth,
+              0, "I/O bandwidth (MB/s) of elimination, 0 means unlimited");
+DEFINE_uint64(EliminationIOPS,
+              0, "I/O operations per second of elimination, 0 means unlimited");
+DEFINE_uint64(RestoreBandwidth,
+              0, "I/O bandwidth (MB/s) of restore, 0 means unlimited");
+DEFINE_uint64(RestoreIOPS,
+              0, "I/O operations per second of restore, 0 means unlimited");
+DEFINE_bool(IOPriority,
+            true, "whether set I/O priority, idle class for arrangement and elimination, best-effort high for restore");
+
+// Token bucket refilled at rate per second, holding at most 100ms of tokens. An acquisition larger than the
+// bucket runs into debt, and the caller sleeps until the debt is paid off.
+class TokenBucket {
+public:
+    void setRate(uint64_t r) {
+        MutexLockGuard mutexLockGuard(lock);
+        rate = r;
+        burst = rate / 10 ? rate / 10 : 1;
+        tokens = burst;
+        gettimeofday(&last, NULL);
+    }
+
+    void acquire(uint64_t amount) {
+        if (!rate) return;
+        uint64_t waitTime = 0;
+        {
+            MutexLockGuard mutexLockGuard(lock);
+            struct timeval now;
+            gettimeofday(&now, NULL);
+            double elapsed = (now.tv_sec - last.tv_sec) + (now.tv_usec - last.tv_usec) / 1000000.0;
+            last = now;
+            tokens += elapsed * rate;
+            if (tokens > burst) {
+                tokens = burst;
+            }
+            tokens -= amount;
+            if (tokens < 0) {
+                waitTime = -tokens * 1000000 / rate;
+            }
+        }
+        if (waitTime) {
+            usleep(waitTime);
+        }
+    }
+
+private:
+    MutexLock lock;
+    uint64_t rate = 0;
+    double burst = 0;
+    double tokens = 0;
+    struct timeval last;
+};
+
+// Bandwidth and IOPS budget shared by every file of a task.
+class IOLimiter {
+public:
+    void configure(uint64_t bandwidth, uint64_t iops) {
+        bandwidthBucket.setRate(bandwidth * 1024 * 1024);
+        iopsBucket.setRate(iops);
+    }
+
+    void acquire(uint64_t bytes) {
+        iopsBucket.acquire(1);
+        bandwidthBucket.acquire(bytes);
+    }
+
+private:
+    TokenBucket bandwidthBucket;
+    TokenBucket iopsBucket;
+};
+
+static IOLimiter GlobalArrangementIOLimiter;
+static IOLimiter GlobalEliminationIOLimiter;
+static IOLimiter GlobalRestoreIOLimiter;
+
+enum class IOPriorityClass {
+    None = 0,
+    RealTime = 1,
+    BestEffort = 2,
+    Idle = 3,
+};
+
+const int IOPriorityClassShift = 13;
+const int IOPriorityWhoProcess = 1;
+
+// Sets the I/O priority of the calling thread, which takes effect under I/O schedulers supporting priorities
+// (e.g. BFQ). Returns the previous priority.
+inline int setIOPriority(IOPriorityClass ioClass, int level = 0) {
+    int previous = syscall(SYS_ioprio_get, IOPriorityWhoProcess, 0);
+    if (FLAGS_IOPriority &&
+        syscall(SYS_ioprio_set, IOPriorityWhoProcess, 0, ((int) ioClass << IOPriorityClassShift) | level) != 0) {
+        printf("Can not set I/O priority : %s\n", strerror(errno));
+    }
+    return previous;
+}
+
+inline int restoreIOPriority(int priority) {
+    if (FLAGS_IOPriority && priority >= 0) {
+        syscall(SYS_ioprio_set, IOPriorityWhoProcess, 0, priority);
+    }
+    return 0;
+}
+
+#endif //MFDEDUP_IOLIMITER_H
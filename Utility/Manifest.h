@@ -2,20 +2,71 @@
 #define MFDEDUP_MANIFEST_H
 
 #include <string>
+#include <vector>
+#include <dirent.h>
 #include "FileOperator.h"
+#include "ChunkIndex.h"
+#include "Resemblance.h"
 
 struct Manifest{
     uint64_t TotalVersion;
     uint64_t ArrangementFallBehind;
+    // incremented by every commit.
+    uint64_t Generation;
+    // generation of the commit which saved the index.
+    uint64_t IndexGeneration;
 };
 
 extern std::string ManifestPath;
+extern std::string HomePath;
+extern std::string KVPath;
+extern std::string LogicFilePath;
+extern std::string ClassFilePath;
 
+// The index is saved aside under the generation to be committed, so that the committed one stays intact until the
+// manifest refers to the new one. Generation 0 is the index of repositories written before generations.
+std::string indexPath(uint64_t generation) {
+    if (generation == 0) {
+        return KVPath;
+    }
+    return HomePath + "/kvstore." + std::to_string(generation);
+}
+
+// removes indexes of generations other than the committed one.
+int removeStaleIndexes(const Manifest &manifest) {
+    if (manifest.IndexGeneration == 0) {
+        return 0;
+    }
+    remove(KVPath.data());
+    DIR *dir = opendir(HomePath.data());
+    if (!dir) {
+        return -1;
+    }
+    std::string current = "kvstore." + std::to_string(manifest.IndexGeneration);
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        std::string name = entry->d_name;
+        if (name.compare(0, 8, "kvstore.") == 0 && name != current) {
+            remove((HomePath + "/" + name).data());
+        }
+    }
+    closedir(dir);
+    return 0;
+}
+
+// A new generation is written aside and replaces the manifest by rename, which the directory sync makes durable. The
+// manifest is either the old generation or the new one after a crash.
 class ManifestWriter{
 public:
     ManifestWriter(const Manifest& manifest){
-        FileOperator fileOperator((char*)ManifestPath.data(), FileOpenType::Write);
-        fileOperator.write((uint8_t*)&manifest, sizeof(Manifest));
+        std::string writingPath = ManifestPath + ".writing";
+        {
+            FileOperator fileOperator((char*)writingPath.data(), FileOpenType::Write);
+            fileOperator.write((uint8_t*)&manifest, sizeof(Manifest));
+            fileOperator.fdatasync();
+        }
+        rename(writingPath.data(), ManifestPath.data());
+        FileOperator::syncDirectory(HomePath);
     }
 private:
 };
@@ -26,16 +77,138 @@ public:
         printf("-----------------------Manifest-----------------------\n");
         printf("Loading Manifest..\n");
         FileOperator fileOperator((char*)ManifestPath.data(), FileOpenType::Read);
+        manifest->Generation = 0;
+        manifest->IndexGeneration = 0;
         if(fileOperator.getStatus() == -1){
             printf("0 version in storage\n");
             manifest->TotalVersion = 0;
             manifest->ArrangementFallBehind = 0;
         }else{
+            // manifests written before generations hold only the first two fields.
             fileOperator.read((uint8_t*)manifest, sizeof(Manifest));
-            printf("%lu versions in storage\n", manifest->TotalVersion);
+            printf("%lu versions in storage, generation %lu\n", manifest->TotalVersion, manifest->Generation);
         };
     }
 private:
 };
 
+enum class IntentOperation : uint64_t {
+    Backup = 1,
+    Arrangement = 2,
+    Elimination = 3,
+};
+
+const uint64_t ManifestIntentMagic = 0x544e45544e49464d;
+
+struct IntentRecord {
+    uint64_t magic;
+    uint64_t operation;
+    uint64_t version;
+    // generation whose commit completes the operation.
+    uint64_t generation;
+};
+
+// Write-ahead intents of operations which change the repository. An intent is recorded before the operation writes
+// anything, and dropped once the manifest generation completing it has been committed. Intents left by a crash tell
+// what the uncommitted operations may have left behind.
+class ManifestIntent {
+public:
+    static int begin(IntentOperation operation, uint64_t version, uint64_t generation) {
+        std::vector<IntentRecord> records = load();
+        records.push_back({ManifestIntentMagic, (uint64_t) operation, version, generation});
+        return save(records);
+    }
+
+    static int commit(uint64_t generation) {
+        std::vector<IntentRecord> records = load(), pending;
+        for (auto &record : records) {
+            if (record.generation > generation) {
+                pending.push_back(record);
+            }
+        }
+        if (pending.empty()) {
+            remove(intentPath().data());
+            return 0;
+        }
+        return save(pending);
+    }
+
+    // removes what operations which have not been committed have written, where it would be mistaken for data of
+    // the committed generation.
+    static int recover(const Manifest &manifest) {
+        std::vector<IntentRecord> records = load();
+        if (records.empty()) {
+            return 0;
+        }
+        uint64_t lastGeneration = manifest.Generation;
+        for (auto &record : records) {
+            if (record.generation <= manifest.Generation) {
+                continue;
+            }
+            lastGeneration = std::max(lastGeneration, record.generation);
+            char pathBuffer[256];
+            switch ((IntentOperation) record.operation) {
+                case IntentOperation::Backup:
+                    printf("Backup of version %lu was not committed, remove its recipe and category\n",
+                           record.version);
+                    sprintf(pathBuffer, LogicFilePath.data(), record.version);
+                    remove(pathBuffer);
+                    DeltaReferences::remove(pathBuffer);
+                    sprintf(pathBuffer, ClassFilePath.data(), record.version * (record.version + 1) / 2);
+                    remove(pathBuffer);
+                    ChunkIndex::remove(pathBuffer);
+                    break;
+                case IntentOperation::Arrangement:
+                    printf("Arrangement of version %lu was not committed, its outputs are rewritten when it runs "
+                           "again\n", record.version);
+                    break;
+                case IntentOperation::Elimination:
+                    printf("Warning: deletion of the earliest version was interrupted among %lu versions, the "
+                           "repository requires a check\n", record.version);
+                    break;
+            }
+        }
+        for (uint64_t g = manifest.Generation + 1; g <= lastGeneration; g++) {
+            if (g != manifest.IndexGeneration) {
+                remove(indexPath(g).data());
+            }
+        }
+        remove(intentPath().data());
+        FileOperator::syncDirectory(HomePath);
+        return 0;
+    }
+
+private:
+    static std::string intentPath() {
+        return ManifestPath + ".intent";
+    }
+
+    static std::vector<IntentRecord> load() {
+        std::vector<IntentRecord> records;
+        if (access(intentPath().data(), F_OK) != 0) {
+            return records;
+        }
+        FileOperator fileOperator((char *) intentPath().data(), FileOpenType::Read);
+        IntentRecord record;
+        while (fileOperator.read((uint8_t *) &record, sizeof(IntentRecord)) == sizeof(IntentRecord) &&
+               record.magic == ManifestIntentMagic) {
+            records.push_back(record);
+        }
+        return records;
+    }
+
+    // intents are replaced as a whole, like the manifest.
+    static int save(const std::vector<IntentRecord> &records) {
+        std::string writingPath = intentPath() + ".writing";
+        {
+            FileOperator fileOperator((char *) writingPath.data(), FileOpenType::Write);
+            fileOperator.write((uint8_t *) records.data(), records.size() * sizeof(IntentRecord));
+            fileOperator.fdatasync();
+        }
+        rename(writingPath.data(), intentPath().data());
+        FileOperator::syncDirectory(HomePath);
+        return 0;
+    }
+};
+
 #endif //MFDEDUP_MANIFEST_H
@@ -0,0 +1,231 @@
+//  Copyright (c) Xiangyu Zou, 2020. All rights reserved.
+//  This source code is licensed under the GPLv2
+
+#ifndef MFDEDUP_RECIPEREADER_H
+#define MFDEDUP_RECIPEREADER_H
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "StorageTask.h"
+#include "FileOperator.h"
+
+extern std::string LogicFilePath;
+
+// Compact recipes are runs of chunks in ops, each a varint of (entries << 1 | reference). A reference is followed by a
+// zigzag varint of where it starts in the recipe of the previous version, relative to the end of the last reference.
+// Other runs are followed by their entries, each the fingerprint without padding and a varint length. Ops are
+// followed by the seek index and the trailer. Flat recipes, which are arrays of headers, have no trailer.
+const uint64_t RecipeMagic = 0x455049434552504d;
+const uint64_t RecipeFingerprintLength = 20;
+const uint64_t RecipeReadBufferLength = 1048576;
+
+struct RecipeTrailer {
+    uint64_t entryCount;
+    // length of the version.
+    uint64_t totalLength;
+    uint64_t seekInterval;
+    uint64_t seekPoints;
+    // ops end where the seek index begins.
+    uint64_t seekOffset;
+    // recipes below in the chain of references, 0 when the recipe does not refer to the previous one.
+    uint64_t depth;
+    uint64_t magic;
+};
+
+// ops starting at entries which are multiples of the seek interval.
+struct RecipeSeekPoint {
+    uint64_t offset;
+    uint64_t referenceEnd;
+};
+
+inline uint64_t zigzagEncode(int64_t value) {
+    return ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+}
+
+inline int64_t zigzagDecode(uint64_t value) {
+    return (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+}
+
+// Reads the entries of the recipe of a version as headers, whichever its format. References are read from the recipe
+// of the previous version, which is opened along with it. Reads near the previous one continue from it, others start
+// at a seek point. Not thread-safe.
+class RecipeReader {
+public:
+    explicit RecipeReader(uint64_t recipeVersion) : version(recipeVersion) {
+        char pathBuffer[256];
+        sprintf(pathBuffer, LogicFilePath.data(), version);
+        fileOperator = new FileOperator(pathBuffer, FileOpenType::Read);
+        if (!fileOperator->ok()) {
+            return;
+        }
+        uint64_t size = FileOperator::size(pathBuffer);
+        RecipeTrailer recipeTrailer;
+        if (size >= sizeof(RecipeTrailer) &&
+            fileOperator->readAt((uint8_t *) &recipeTrailer, sizeof(RecipeTrailer), size - sizeof(RecipeTrailer)) ==
+            sizeof(RecipeTrailer) && recipeTrailer.magic == RecipeMagic) {
+            compact = true;
+            trailer = recipeTrailer;
+            entryCount = trailer.entryCount;
+            totalLength = trailer.totalLength;
+            seekPoints.resize(trailer.seekPoints);
+            fileOperator->readAt((uint8_t *) seekPoints.data(), seekPoints.size() * sizeof(RecipeSeekPoint),
+                                 trailer.seekOffset);
+            if (trailer.depth) {
+                previous = new RecipeReader(version - 1);
+            }
+        } else {
+            entryCount = size / sizeof(BlockHeader);
+        }
+    }
+
+    ~RecipeReader() {
+        delete previous;
+        delete fileOperator;
+    }
+
+    int ok() {
+        return fileOperator->ok() && (!previous || previous->ok());
+    }
+
+    bool isCompact() const {
+        return compact;
+    }
+
+    uint64_t getDepth() const {
+        return compact ? trailer.depth : 0;
+    }
+
+    uint64_t getCount() const {
+        return entryCount;
+    }
+
+    // length of the version, for which flat recipes are read once.
+    uint64_t getLength() {
+        if (totalLength == (uint64_t) -1) {
+            const uint64_t batch = 4096;
+            std::vector<BlockHeader> blockHeaders(batch);
+            totalLength = 0;
+            uint64_t readCount;
+            for (uint64_t first = 0; (readCount = read(first, batch, blockHeaders.data())) > 0; first += readCount) {
+                for (uint64_t i = 0; i < readCount; i++) {
+                    totalLength += blockHeaders[i].length;
+                }
+            }
+        }
+        return totalLength;
+    }
+
+    // reads count entries from the first-th, returns how many have been read.
+    uint64_t read(uint64_t first, uint64_t count, BlockHeader *blockHeaders) {
+        if (first >= entryCount) {
+            return 0;
+        }
+        count = std::min(count, entryCount - first);
+        if (!compact) {
+            return fileOperator->readAt((uint8_t *) blockHeaders, count * sizeof(BlockHeader),
+                                        first * sizeof(BlockHeader)) / sizeof(BlockHeader);
+        }
+        uint64_t point = first / trailer.seekInterval;
+        if (cursor.entry > first || point * trailer.seekInterval > cursor.entry || cursor.offset == (uint64_t) -1) {
+            cursor = {seekPoints[point].offset, point * trailer.seekInterval, seekPoints[point].referenceEnd};
+        }
+        uint64_t produced = 0;
+        while (produced < count) {
+            uint64_t offset = cursor.offset;
+            uint64_t op = readVarint(offset);
+            uint64_t runLength = op >> 1;
+            uint64_t from = first + produced - cursor.entry;
+            uint64_t take = from < runLength ? std::min(runLength - from, count - produced) : 0;
+            uint64_t referenceEnd = cursor.referenceEnd;
+            if (runLength == 0 || offset > trailer.seekOffset) {
+                printf("Recipe of version %lu is corrupted\n", version);
+                return produced;
+            }
+            if (op & 1) {
+                uint64_t start = referenceEnd + zigzagDecode(readVarint(offset));
+                if (take && previous->read(start + from, take, blockHeaders + produced) != take) {
+                    return produced;
+                }
+                referenceEnd = start + runLength;
+            } else {
+                // a run which is only partly read is not parsed to its end.
+                uint64_t parsed = take && from + take < runLength ? from + take : runLength;
+                for (uint64_t i = 0; i < parsed; i++) {
+                    const uint8_t *fingerprint = fetch(offset, RecipeFingerprintLength);
+                    BlockHeader *blockHeader = i >= from ? blockHeaders + produced + i - from : nullptr;
+                    if (blockHeader) {
+                        memset(blockHeader, 0, sizeof(BlockHeader));
+                        memcpy(&blockHeader->fp, fingerprint, RecipeFingerprintLength);
+                    }
+                    offset += RecipeFingerprintLength;
+                    uint64_t length = readVarint(offset);
+                    if (blockHeader) {
+                        blockHeader->length = length;
+                    }
+                }
+            }
+            produced += take;
+            if (from + take < runLength) {
+                break;
+            }
+            cursor = {offset, cursor.entry + runLength, referenceEnd};
+        }
+        return produced;
+    }
+
+    // reads the entries following those of the last call.
+    uint64_t next(BlockHeader *blockHeaders, uint64_t count) {
+        uint64_t readCount = read(position, count, blockHeaders);
+        position += readCount;
+        return readCount;
+    }
+
+private:
+    // start of the op holding the next entry to read.
+    struct Cursor {
+        uint64_t offset;
+        uint64_t entry;
+        uint64_t referenceEnd;
+    };
+
+    // ops from offset, at least length bytes of them unless they end before.
+    const uint8_t *fetch(uint64_t offset, uint64_t length) {
+        if (offset < bufferBegin || offset + length > bufferBegin + buffer.size()) {
+            uint64_t end = std::min(offset + std::max(length, RecipeReadBufferLength), trailer.seekOffset);
+            buffer.resize(std::max(end, offset + length) - offset);
+            fileOperator->readAt(buffer.data(), end > offset ? end - offset : 0, offset);
+            bufferBegin = offset;
+        }
+        return buffer.data() + (offset - bufferBegin);
+    }
+
+    uint64_t readVarint(uint64_t &offset) {
+        const uint8_t *data = fetch(offset, 10);
+        uint64_t value = 0;
+        for (uint64_t i = 0; i < 10; i++) {
+            value |= (uint64_t) (data[i] & 0x7f) << (7 * i);
+            if (!(data[i] & 0x80)) {
+                offset += i + 1;
+                return value;
+            }
+        }
+        offset += 10;
+        return value;
+    }
+
+    uint64_t version;
+    FileOperator *fileOperator;
+    bool compact = false;
+    RecipeTrailer trailer = {0, 0, 1, 0, 0, 0, 0};
+    uint64_t entryCount = 0;
+    uint64_t totalLength = -1;
+    std::vector<RecipeSeekPoint> seekPoints;
+    RecipeReader *previous = nullptr;
+    Cursor cursor = {(uint64_t) -1, 0, 0};
+    uint64_t position = 0;
+    std::vector<uint8_t> buffer;
+    uint64_t bufferBegin = 0;
+};
+
+#endif //MFDEDUP_RECIPEREADER_H
@@ -0,0 +1,256 @@
+//  Copyright (c) Xiangyu Zou, 2020. All rights reserved.
+//  This source code is licensed under the GPLv2
+
+#ifndef MFDEDUP_RESEMBLANCE_H
+#define MFDEDUP_RESEMBLANCE_H
+
+#include <vector>
+#include <string>
+#include "gflags/gflags.h"
+#include "StorageTask.h"
+#include "FileOperator.h"
+#include "ChunkCompressor.h"
+
+DEFINE_bool(Resemblance,
+            false, "store unique chunks resembling chunks of the previous version as deltas against them");
+
+DEFINE_uint64(ResemblanceIndexEntries,
+              1048576, "entries of the resemblance index of each version, which forgets the oldest on collision");
+
+// chunks are split into SuperFeatureAmount * FeaturesPerSuperFeature sub-chunks, each of which gives a feature.
+const uint64_t FeaturesPerSuperFeature = 4;
+const uint64_t ResemblanceMinLength = 256;
+// matches of deltas are found by hashing windows of the base.
+const uint64_t DeltaWindow = 16;
+const uint64_t DeltaMaxTableBits = 16;
+
+// Super-features of a chunk, after Finesse: features are the maxima of a rolling hash in equal sub-chunks, and
+// neighbouring features are grouped into super-features. An edit changes the features of the sub-chunks it touches,
+// so chunks resembling each other share a super-feature at least.
+class Resemblance {
+public:
+    Resemblance() {
+        // the gear table is fixed, since super-features are kept in the index across runs.
+        uint64_t seed = 0x9e3779b97f4a7c15;
+        for (uint64_t i = 0; i < 256; i++) {
+            gearMatrix[i] = mix(seed + i);
+        }
+    }
+
+    // a chunk too short to have features gets none, which are 0.
+    void superFeatures(const uint8_t *chunk, uint64_t length, uint64_t *result) const {
+        const uint64_t featureAmount = SuperFeatureAmount * FeaturesPerSuperFeature;
+        if (length < ResemblanceMinLength) {
+            for (uint64_t i = 0; i < SuperFeatureAmount; i++) {
+                result[i] = 0;
+            }
+            return;
+        }
+        uint64_t features[featureAmount];
+        uint64_t hash = 0;
+        for (uint64_t f = 0; f < featureAmount; f++) {
+            uint64_t end = length * (f + 1) / featureAmount;
+            uint64_t feature = 0;
+            for (uint64_t i = length * f / featureAmount; i < end; i++) {
+                hash = (hash << 1) + gearMatrix[chunk[i]];
+                feature = std::max(feature, hash);
+            }
+            features[f] = feature;
+        }
+        for (uint64_t s = 0; s < SuperFeatureAmount; s++) {
+            uint64_t superFeature = s;
+            for (uint64_t f = 0; f < FeaturesPerSuperFeature; f++) {
+                superFeature = mix(superFeature ^ features[s * FeaturesPerSuperFeature + f]);
+            }
+            result[s] = superFeature ? superFeature : 1;
+        }
+    }
+
+private:
+    static uint64_t mix(uint64_t x) {
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+        return x ^ (x >> 31);
+    }
+
+    uint64_t gearMatrix[256];
+};
+
+// Deltas are the fingerprint of the base followed by instructions, each a varint of (length << 1 | copy). A copy is
+// followed by a varint offset in the base, and an insert by its bytes.
+class DeltaCompressor {
+public:
+    // writes the delta of target against base to out, and returns its length, or 0 when it would exceed limit.
+    static uint64_t encode(const SHA1FP &baseFp, const uint8_t *base, uint64_t baseLength, const uint8_t *target,
+                           uint64_t targetLength, uint8_t *out, uint64_t limit, std::vector<uint32_t> &table) {
+        if (limit < sizeof(SHA1FP) || baseLength < DeltaWindow || targetLength < DeltaWindow) {
+            return 0;
+        }
+        uint64_t bits = 8;
+        while (bits < DeltaMaxTableBits && ((uint64_t) 1 << bits) < baseLength) {
+            bits++;
+        }
+        // positions are stored plus one, so that 0 is empty.
+        table.assign((uint64_t) 1 << bits, 0);
+        for (uint64_t i = 0; i + DeltaWindow <= baseLength; i++) {
+            table[windowHash(base + i, bits)] = i + 1;
+        }
+
+        memcpy(out, &baseFp, sizeof(SHA1FP));
+        uint64_t length = sizeof(SHA1FP), literal = 0, i = 0;
+        while (i + DeltaWindow <= targetLength) {
+            uint32_t candidate = table[windowHash(target + i, bits)];
+            if (!candidate || memcmp(base + candidate - 1, target + i, DeltaWindow) != 0) {
+                i++;
+                continue;
+            }
+            uint64_t copyBegin = candidate - 1, matchLength = DeltaWindow;
+            while (i + matchLength < targetLength && copyBegin + matchLength < baseLength &&
+                   target[i + matchLength] == base[copyBegin + matchLength]) {
+                matchLength++;
+            }
+            // a match also extends backwards into the pending insert.
+            while (i > literal && copyBegin > 0 && target[i - 1] == base[copyBegin - 1]) {
+                i--;
+                copyBegin--;
+                matchLength++;
+            }
+            if (!insert(target + literal, i - literal, out, length, limit) ||
+                !copy(copyBegin, matchLength, out, length, limit)) {
+                return 0;
+            }
+            i += matchLength;
+            literal = i;
+        }
+        if (!insert(target + literal, targetLength - literal, out, length, limit)) {
+            return 0;
+        }
+        return length;
+    }
+
+    // the fingerprint of the base which a delta refers to.
+    static SHA1FP baseOf(const uint8_t *delta) {
+        SHA1FP baseFp;
+        memcpy(&baseFp, delta, sizeof(SHA1FP));
+        return baseFp;
+    }
+
+    // rebuilds the target of a delta into out, which holds targetLength bytes. Returns false on a malformed delta.
+    static bool decode(const uint8_t *base, uint64_t baseLength, const uint8_t *delta, uint64_t deltaLength,
+                       uint8_t *out, uint64_t targetLength) {
+        uint64_t offset = sizeof(SHA1FP), written = 0;
+        while (offset < deltaLength) {
+            uint64_t instruction, copyBegin;
+            if (!readVarint(delta, deltaLength, offset, instruction)) {
+                return false;
+            }
+            uint64_t length = instruction >> 1;
+            if (length > targetLength - written) {
+                return false;
+            }
+            if (instruction & 1) {
+                if (!readVarint(delta, deltaLength, offset, copyBegin) || copyBegin > baseLength ||
+                    length > baseLength - copyBegin) {
+                    return false;
+                }
+                memcpy(out + written, base + copyBegin, length);
+            } else {
+                if (length > deltaLength - offset) {
+                    return false;
+                }
+                memcpy(out + written, delta + offset, length);
+                offset += length;
+            }
+            written += length;
+        }
+        return written == targetLength;
+    }
+
+private:
+    static uint64_t windowHash(const uint8_t *window, uint64_t bits) {
+        uint64_t a, b;
+        memcpy(&a, window, sizeof(uint64_t));
+        memcpy(&b, window + sizeof(uint64_t), sizeof(uint64_t));
+        return ((a * 0x9e3779b97f4a7c15) ^ (b * 0xc2b2ae3d27d4eb4f)) >> (64 - bits);
+    }
+
+    static bool insert(const uint8_t *data, uint64_t dataLength, uint8_t *out, uint64_t &length, uint64_t limit) {
+        if (!dataLength) {
+            return true;
+        }
+        if (!writeVarint(dataLength << 1, out, length, limit) || dataLength > limit - length) {
+            return false;
+        }
+        memcpy(out + length, data, dataLength);
+        length += dataLength;
+        return true;
+    }
+
+    static bool copy(uint64_t copyBegin, uint64_t copyLength, uint8_t *out, uint64_t &length, uint64_t limit) {
+        return writeVarint(copyLength << 1 | 1, out, length, limit) && writeVarint(copyBegin, out, length, limit);
+    }
+
+    static bool writeVarint(uint64_t value, uint8_t *out, uint64_t &length, uint64_t limit) {
+        do {
+            if (length >= limit) {
+                return false;
+            }
+            out[length++] = (value & 0x7f) | (value >= 0x80 ? 0x80 : 0);
+            value >>= 7;
+        } while (value);
+        return true;
+    }
+
+    static bool readVarint(const uint8_t *data, uint64_t dataLength, uint64_t &offset, uint64_t &value) {
+        value = 0;
+        for (uint64_t shift = 0; shift < 64 && offset < dataLength; shift += 7) {
+            uint8_t byte = data[offset++];
+            value |= (uint64_t) (byte & 0x7f) << shift;
+            if (!(byte & 0x80)) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+// A recipe is followed by a sidecar [recipe].delta listing the delta chunks of its version with their bases, so that
+// a restore reads the bases as well, and the index of a catch-up keeps them.
+struct DeltaReference {
+    SHA1FP fp;
+    SHA1FP base;
+};
+
+class DeltaReferences {
+public:
+    static std::string path(const std::string &recipePath) {
+        return recipePath + ".delta";
+    }
+
+    // a recipe without a sidecar has no delta chunks.
+    static std::vector<DeltaReference> load(const std::string &recipePath) {
+        std::vector<DeltaReference> references;
+        std::string sidecarPath = path(recipePath);
+        if (FileOperator::size(sidecarPath) == 0) {
+            return references;
+        }
+        FileOperator fileOperator((char *) sidecarPath.data(), FileOpenType::Read);
+        references.resize(FileOperator::size(sidecarPath) / sizeof(DeltaReference));
+        references.resize(fileOperator.read((uint8_t *) references.data(),
+                                            references.size() * sizeof(DeltaReference)) / sizeof(DeltaReference));
+        return references;
+    }
+
+    static void rename(const char *oldRecipePath, const char *newRecipePath) {
+        std::string oldPath = path(oldRecipePath), newPath = path(newRecipePath);
+        if (::rename(oldPath.data(), newPath.data()) != 0) {
+            ::remove(newPath.data());
+        }
+    }
+
+    static void remove(const char *recipePath) {
+        ::remove(path(recipePath).data());
+    }
+};
+
+#endif //MFDEDUP_RESEMBLANCE_H
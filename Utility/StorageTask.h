@@ -4,6 +4,7 @@
 #include "Lock.h"
 #include <list>
 #include <tuple>
+#include <vector>
 #include <cstring>
 
 struct SHA1FP {
@@ -17,11 +18,15 @@ struct SHA1FP {
 };
 
 
+// super-features of a chunk, by which resembling chunks are found.
+const uint64_t SuperFeatureAmount = 3;
+
 struct DedupTask {
     uint8_t *buffer;
     uint64_t pos;
     uint64_t length;
     SHA1FP fp;
+    uint64_t superFeatures[SuperFeatureAmount];
     uint64_t fileID;
     CountdownLatch *countdownLatch = nullptr;
     uint64_t index;
@@ -35,6 +40,9 @@ struct WriteTask {
     uint64_t oldClass;
     uint64_t fileID;
     SHA1FP sha1Fp;
+    // a delta chunk is stored against its base.
+    bool hasBase = false;
+    SHA1FP baseFp;
     CountdownLatch *countdownLatch = nullptr;
     uint64_t index;
 
@@ -66,12 +74,16 @@ struct RestoreTask {
     uint64_t maxVersion;
     uint64_t targetVersion;
     uint64_t fallBehind;
+    // all restored versions in ascending order, when several versions are restored in one pass.
+    std::vector<uint64_t> targetVersions;
 };
 
 struct RestoreParseTask {
     uint8_t *buffer = nullptr;
     uint64_t length;
     bool endFlag = false;
+    // all chunks of the current window of recipe have been delivered.
+    bool windowEndFlag = false;
     uint64_t index = 0;
     uint64_t beginPos = 0;
 
@@ -120,7 +132,11 @@ struct ArrangementWriteTask{
     uint8_t* writeBuffer = nullptr;
     uint64_t length;
     uint64_t beforeClassId;
+    // the arranged version for startFlag, otherwise the volume an archived chunk goes to.
     uint64_t arrangementVersion = -1;
+    uint64_t arrangementVersions = 1;
+    bool catchUp = false;
+    uint64_t journalVersion = 0;
     bool isArchived = 0;
     bool classEndFlag = false;
     bool finalEndFlag = false;
@@ -161,6 +177,10 @@ struct ArrangementFilterTask{
     uint64_t length;
     uint64_t classId;
     uint64_t arrangementVersion;
+    uint64_t arrangementVersions = 1;
+    uint64_t birthVersion = 0;
+    bool catchUp = false;
+    uint64_t journalVersion = 0;
     bool classEndFlag = false;
     bool finalEndFlag = false;
     bool startFlag = false;
@@ -194,11 +214,22 @@ struct ArrangementFilterTask{
 struct ArrangementTask {
     uint64_t arrangementVersion;
     CountdownLatch *countdownLatch = nullptr;
+    bool background = false;
+    // catch-up arranges versions [arrangementVersion, arrangementVersion + arrangementVersions) in one pass.
+    uint64_t arrangementVersions = 1;
+    bool catchUp = false;
+    // last version chunks are classified by, an arrangement by committed versions is journaled to be resumable.
+    uint64_t journalVersion = 0;
 };
 
+// In recipes, length is the length of the chunk. In categories and volumes, it is the length of what follows the
+// header, which is the chunk encoded as recorded by encoding and decodedLength, or the chunk itself where both are 0.
+// Headers written before encodings held a 64-bit length, whose upper half reads as no encoding.
 struct BlockHeader {
     SHA1FP fp;
-    uint64_t length;
+    uint32_t length;
+    uint32_t encoding: 8;
+    uint32_t decodedLength: 24;
 };
 
 struct VolumeFileHeader {
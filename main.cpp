@@ -2,6 +2,8 @@
 //  This source code is licensed under the GPLv2
 
 #include <iostream>
+#include <set>
+#include <sstream>
 
 #include "DedupPipeline/ReadFilePipeline.h"
 #include "RestorePipeline/RestoreReadPipeline.h"
@@ -10,11 +12,14 @@
 #include "Utility/Config.h"
 #include "Utility/Manifest.h"
 #include "ArrangementPipeline/ArrangementReadPipeline.h"
+#include "ArrangementPipeline/ArrangementScheduler.h"
 
 DEFINE_string(RestorePath,
               "", "restore path");
 DEFINE_uint64(RestoreRecipe,
 1, "restore recipe");
+DEFINE_string(RestoreRecipes,
+              "", "versions restored in one pass, separated by commas, the restore path is a pattern with %lu for the version");
 DEFINE_string(task,
 "", "task type");
 DEFINE_string(BatchFilePath,
@@ -25,6 +30,10 @@ DEFINE_string(InputFile,
               "", "input path");
 DEFINE_bool(ApplyArrangement,
               true, "Whether apply arrangement");
+DEFINE_bool(BackgroundArrangement,
+              false, "Whether arrange the previous version in background during the next backup");
+DEFINE_uint64(CatchUpVersions,
+              0, "how many fallen-behind versions are arranged by catch-up arrangement, 0 means all");
 
 std::string LogicFilePath;
 std::string ClassFilePath;
@@ -32,45 +41,98 @@ std::string VersionFilePath;
 std::string ManifestPath;
 std::string HomePath;
 std::string ClassFileAppendPath;
+std::string JournalFilePath;
+std::string RestoreCalibrationPath;
 uint64_t TotalVersion;
 uint64_t RetentionTime;
 std::string KVPath;
 
-uint64_t  do_backup(const std::string& path){
+uint64_t  do_backup(const std::string& path, uint64_t fallBehind){
     StorageTask storageTask;
     CountdownLatch countdownLatch(5); // there are 5 pipelines in the workflow of write.
     storageTask.path = path;
     storageTask.countdownLatch = &countdownLatch;
     storageTask.fileID = TotalVersion;
+    GlobalWriteFilePipelinePtr->expect(FileOperator::size(path));
+    GlobalWriteFilePipelinePtr->setBaseLayout(fallBehind);
     GlobalReadPipelinePtr->addTask(&storageTask);
     countdownLatch.wait();
     return storageTask.length;
 }
 
-int do_restore(uint64_t version, uint64_t fallBehind){
+int do_restore(const std::vector<uint64_t> &versions, uint64_t fallBehind){
     struct timeval t0, t1;
 
-    char recipePath[256];
-    sprintf(recipePath, LogicFilePath.data(), version);
+    uint64_t version = versions.back();
     CountdownLatch countdownLatch(1);
 
+    std::vector<std::string> restorePaths;
+    for (auto v : versions) {
+        if (v == 0 || v > TotalVersion) {
+            printf("Version %lu is not stored\n", v);
+            return -1;
+        }
+        char pathBuffer[256];
+        sprintf(pathBuffer, FLAGS_RestorePath.data(), v);
+        restorePaths.push_back(pathBuffer);
+    }
+    if (versions.size() > 1) {
+        if (FLAGS_RestorePath.find("%lu") == std::string::npos || FLAGS_RestoreBase || FLAGS_RestoreOffset ||
+            FLAGS_RestoreLength || FLAGS_RestoreStream) {
+            printf("Several versions are restored into regular files, named by a restore path with %%lu\n");
+            return -1;
+        }
+    }
+
+    if (FLAGS_RestoreBase) {
+        // the restore path must hold exactly the base version, which is updated in place.
+        char basePath[256];
+        sprintf(basePath, LogicFilePath.data(), FLAGS_RestoreBase);
+        if (FLAGS_RestoreBase > TotalVersion || FileOperator::size(basePath) == 0) {
+            printf("Base version %lu is not stored\n", FLAGS_RestoreBase);
+            return -1;
+        }
+        if (FLAGS_RestoreOffset || FLAGS_RestoreLength || FLAGS_RestoreStream || FLAGS_RestorePath == "-") {
+            printf("Incremental restore updates a whole version in a regular file\n");
+            return -1;
+        }
+        struct stat statBuffer;
+        if (stat(FLAGS_RestorePath.data(), &statBuffer) != 0 || !S_ISREG(statBuffer.st_mode) ||
+            (uint64_t) statBuffer.st_size != RestoreParserPipeline::getVersionLength(FLAGS_RestoreBase)) {
+            printf("%s does not hold version %lu\n", FLAGS_RestorePath.data(), FLAGS_RestoreBase);
+            return -1;
+        }
+    }
+
     RestoreTask restoreTask = {
             TotalVersion,
             version,
-            fallBehind
+            fallBehind,
+            {},
     };
 
     GlobalRestoreReadPipelinePtr = new RestoreReadPipeline();
-    GlobalRestoreWritePipelinePtr = new RestoreWritePipeline(FLAGS_RestorePath, &countdownLatch);  // order is important.
-    GlobalRestoreParserPipelinePtr = new RestoreParserPipeline(version, recipePath);  // order is important.
+    if (versions.size() > 1) {
+        restoreTask.targetVersions = versions;
+        GlobalRestoreWritePipelinePtr = new RestoreWritePipeline(restorePaths, &countdownLatch);  // order is important.
+        GlobalRestoreParserPipelinePtr = new RestoreParserPipeline(version, versions);  // order is important.
+    } else {
+        GlobalRestoreWritePipelinePtr = new RestoreWritePipeline(FLAGS_RestorePath, &countdownLatch);  // order is important.
+        GlobalRestoreParserPipelinePtr = new RestoreParserPipeline(version);  // order is important.
+    }
 
     gettimeofday(&t0, NULL);
     GlobalRestoreReadPipelinePtr->addTask(&restoreTask);
     countdownLatch.wait();
+    GlobalDurability.commit("restore");
     gettimeofday(&t1, NULL);
     uint64_t duration = (t1.tv_sec-t0.tv_sec)*1000000 + (t1.tv_usec-t0.tv_usec);
     printf("Total duration : %lu, speed : %f MB/s\n", duration, (float)GlobalRestoreWritePipelinePtr->getTotalSize() / duration);
 
+    // restore plans estimate their durations by the throughput of the latest restores.
+    RestoreCalibration restoreCalibration;
+    restoreCalibration.record(GlobalRestoreParserPipelinePtr->getReadLength(), duration);
+
     delete GlobalRestoreReadPipelinePtr;
     delete GlobalRestoreParserPipelinePtr;
     delete GlobalRestoreWritePipelinePtr;
@@ -78,32 +140,200 @@ int do_restore(uint64_t version, uint64_t fallBehind){
     return 0;
 }
 
-int do_arrangement(){
+// Reports the files and extents which restoring the versions would read, and how long it would take, as JSON on stdout.
+// Only the manifest, recipes, volume headers and existing chunk indexes are read, and logs go to stderr.
+int do_restore_plan(const std::vector<uint64_t> &versions, uint64_t fallBehind){
+    // stdout is given back once the report is written, as the restore writer does for -.
+    int stdoutFd = dup(STDOUT_FILENO);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    FILE *json = fdopen(dup(stdoutFd), "w");
+    auto finish = [json, stdoutFd](int result) {
+        fclose(json);
+        fflush(stdout);
+        dup2(stdoutFd, STDOUT_FILENO);
+        close(stdoutFd);
+        return result;
+    };
+
+    uint64_t restoredLength = 0;
+    std::unordered_set<SHA1FP, TupleHasher, TupleEqualer> fpTable;
+    bool selective = fallBehind && FLAGS_RestoreSkipChunks;
+    for (auto v : versions) {
+        if (v == 0 || v > TotalVersion) {
+            printf("Version %lu is not stored\n", v);
+            return finish(-1);
+        }
+        char recipePath[256];
+        sprintf(recipePath, LogicFilePath.data(), v);
+        RecipeReader recipe(v);
+        restoredLength += recipe.getLength();
+        if (!selective) {
+            continue;
+        }
+        const uint64_t batch = 4096;
+        BlockHeader *blockHeaders = (BlockHeader *) malloc(batch * sizeof(BlockHeader));
+        uint64_t readSize;
+        while ((readSize = recipe.next(blockHeaders, batch)) > 0) {
+            for (uint64_t i = 0; i < readSize; i++) {
+                fpTable.insert(blockHeaders[i].fp);
+            }
+        }
+        free(blockHeaders);
+        for (auto &item : DeltaReferences::load(recipePath)) {
+            fpTable.insert(item.base);
+        }
+    }
+
+    RestoreTask restoreTask = {
+            TotalVersion,
+            versions.back(),
+            fallBehind,
+            versions,
+    };
+    RestorePlanner restorePlanner;
+    restorePlanner.planFiles(&restoreTask);
+    std::vector<ReadExtent> extents;
+    restorePlanner.planExtents(extents);
+    if (selective) {
+        // files without a chunk index are planned as a whole rather than scanned.
+        restorePlanner.selectExtents(extents, [&fpTable](const SHA1FP &fp) {
+            return fpTable.find(fp) != fpTable.end();
+        }, false);
+    }
+
+    uint64_t readLength = restorePlanner.getPredictedLength();
+    RestoreCalibration restoreCalibration;
+    double throughput = restoreCalibration.getThroughput();
+
+    fprintf(json, "{\n  \"versions\": [");
+    for (uint64_t i = 0; i < versions.size(); i++) {
+        fprintf(json, "%s%lu", i ? ", " : "", versions[i]);
+    }
+    fprintf(json, "],\n  \"maxVersion\": %lu,\n  \"fallBehind\": %lu,\n", TotalVersion, fallBehind);
+    fprintf(json, "  \"restoredBytes\": %lu,\n  \"readBytes\": %lu,\n  \"readAmplification\": %f,\n",
+            restoredLength, readLength, restoredLength ? (double) readLength / restoredLength : 0);
+    fprintf(json, "  \"files\": [");
+    auto &plannedFiles = restorePlanner.getPlannedFiles();
+    for (uint64_t i = 0; i < plannedFiles.size(); i++) {
+        auto &plannedFile = plannedFiles[i];
+        fprintf(json, "%s\n    {\"path\": \"%s\", \"fileLength\": %lu, \"readLength\": %lu, \"extents\": %lu, "
+                      "\"indexed\": %s}", i ? "," : "", plannedFile.path.data(), plannedFile.fileLength,
+                plannedFile.readLength, plannedFile.extents, plannedFile.indexed ? "true" : "false");
+    }
+    fprintf(json, "\n  ],\n  \"throughput\": %f,\n  \"calibrated\": %s,\n  \"estimatedSeconds\": %f\n}\n",
+            throughput, restoreCalibration.isCalibrated() ? "true" : "false",
+            throughput > 0 ? readLength / throughput / 1000000 : 0);
+    return finish(0);
+}
+
+// Source categories are kept until the arrangement has been committed, the caller removes them. It is committed
+// along with the backup before it, and an interruption rolls back both, so that it is not journaled.
+int do_arrangement(const Manifest &manifest){
     printf("Arrangement Task: Version %lu\n", TotalVersion-1);
+    ManifestIntent::begin(IntentOperation::Arrangement, TotalVersion - 1, manifest.Generation + 1);
     CountdownLatch arrangementLatch(1);
     ArrangementTask arrangementTask = {
             TotalVersion - 1, &arrangementLatch,
     };
     GlobalArrangementReadPipelinePtr->addTask(&arrangementTask);
     arrangementLatch.wait();
+    return 0;
+}
+
+// Prepares the arrangement of versions which have fallen behind, and returns how many versions the OPT layout covers
+// after it. A deferred arrangement of a single version classifies chunks by the rolled index, otherwise the fallen-
+// behind versions are caught up in one pass by survival tables loaded from recipes.
+uint64_t prepare_pending_arrangement(ArrangementTask &arrangementTask, uint64_t fallBehind, uint64_t versions, bool deferred){
+    uint64_t arrangementVersion = TotalVersion - fallBehind;
+    uint64_t arrangementVersions = fallBehind;
+    if (deferred && fallBehind == 1) {
+        GlobalMetadataManagerPtr->deferredRolling();
+    } else if (arrangementVersion == 0 && fallBehind == 1) {
+        // only version 1 is pending, whose arrangement is void and just rolls the index.
+    } else {
+        if (arrangementVersion == 0) {
+            // arrangement of version 0 is void.
+            arrangementVersion = 1;
+            arrangementVersions--;
+        }
+        if (versions && versions < arrangementVersions) {
+            arrangementVersions = versions;
+        }
+        // an interrupted arrangement is resumed as it was, e.g. a background one whose backup has been committed
+        // since, and the versions after it are left to the next one.
+        uint64_t journaledVersions = ArrangementJournal::journaledVersions(arrangementVersion);
+        if (journaledVersions && journaledVersions < arrangementVersions) {
+            arrangementVersions = journaledVersions;
+        }
+        GlobalMetadataManagerPtr->catchUpLoad(arrangementVersion, arrangementVersion + arrangementVersions, TotalVersion);
+        arrangementTask.catchUp = true;
+    }
+    arrangementTask.arrangementVersion = arrangementVersion;
+    arrangementTask.arrangementVersions = arrangementVersions;
+    // progress is journaled, an interrupted arrangement of the same versions resumes from its last checkpoint.
+    arrangementTask.journalVersion = TotalVersion;
+    printf("Arrangement Task: Version %lu ~ %lu\n", arrangementVersion, arrangementVersion + arrangementVersions - 1);
+    return arrangementVersion + arrangementVersions;
 }
 
-int do_delete(){
+// Returns how many of the fallen-behind versions are to be arranged now, 0 means deferring the arrangement.
+uint64_t schedule_arrangement(uint64_t fallBehind){
+    if (FLAGS_ArrangementPolicy != "cost") {
+        return fallBehind;
+    }
+    ArrangementScheduler scheduler(TotalVersion, fallBehind, GlobalMetadataManagerPtr);
+    uint64_t versions = scheduler.schedule();
+    scheduler.report();
+    return versions;
+}
+
+int do_delete(const Manifest &manifest){
     printf("------------------------Deleting----------------------\n");
     printf("%lu versions exist, delete the earliest version\n", TotalVersion);
     printf("Delete Task..\n");
+    // files are renamed in place, an interrupted deletion can only be reported.
+    ManifestIntent::begin(IntentOperation::Elimination, TotalVersion, manifest.Generation + 1);
     Eliminator eliminator;
-    eliminator.run(TotalVersion);
-    TotalVersion--;
+    if(eliminator.run(TotalVersion, manifest.ArrangementFallBehind) == 0){
+        TotalVersion--;
+    }
+    return 0;
+}
+
+// saves the index as the generation to be committed next.
+int save_index(Manifest &manifest){
+    manifest.IndexGeneration = manifest.Generation + 1;
+    return GlobalMetadataManagerPtr->save(indexPath(manifest.IndexGeneration));
+}
+
+// Commits a new manifest generation. Files which it refers to and their directory entries are durable before it, so
+// no sync is required in between under the version durability mode.
+int do_commit(Manifest &manifest){
+    GlobalDurability.sync();
+    FileOperator::syncDirectory(LogicFilePath.substr(0, LogicFilePath.rfind('/')));
+    FileOperator::syncDirectory(ClassFilePath.substr(0, ClassFilePath.rfind('/')));
+    FileOperator::syncDirectory(HomePath);
+    manifest.TotalVersion = TotalVersion;
+    manifest.Generation++;
+    ManifestWriter manifestWriter(manifest);
+    ManifestIntent::commit(manifest.Generation);
+    removeStaleIndexes(manifest);
+    char name[64];
+    sprintf(name, "commit of generation %lu", manifest.Generation);
+    GlobalDurability.report(name);
+    return 0;
 }
 
 int main(int argc, char **argv) {
     gflags::ParseCommandLineFlags(&argc, &argv, true);
     std::string statusStr("status");
     std::string restoreStr("restore");
+    std::string restorePlanStr("restore-plan");
     std::string writeStr("write");
     std::string batchStr("batch");
     std::string eliminateStr("delete");
+    std::string arrangeStr("arrange");
+    std::string scheduleStr("schedule");
 
     Manifest manifest;
     {
@@ -111,6 +341,9 @@ int main(int argc, char **argv) {
         ManifestReader manifestReader(&manifest);
         TotalVersion = manifest.TotalVersion;
     }
+    if (FLAGS_task == writeStr || FLAGS_task == arrangeStr || FLAGS_task == eliminateStr) {
+        ManifestIntent::recover(manifest);
+    }
 
     if (FLAGS_task == writeStr) {
 
@@ -128,20 +361,60 @@ int main(int argc, char **argv) {
         //------------------------------------------------------
 
         if(TotalVersion != 0)
-            GlobalMetadataManagerPtr->load();
+            GlobalMetadataManagerPtr->load(indexPath(manifest.IndexGeneration));
 
         uint64_t dedupDuration = 0, arrDuration = 0;
+        // version whose source categories are removed once its arrangement has been committed.
+        uint64_t arrangedVersion = 0;
         std::string workloadPath = FLAGS_InputFile;
         uint64_t taskLength = 0;
 
         {
+            struct timeval t0, t1, at0, at1;
+
+            // arrangements of stored versions which have been left to this run.
+            uint64_t pendingVersions = 0;
+            if (FLAGS_ApplyArrangement && manifest.ArrangementFallBehind > 0) {
+                pendingVersions = schedule_arrangement(manifest.ArrangementFallBehind);
+            }
+            bool pendingArrangement = pendingVersions > 0;
+            uint64_t layoutVersion = TotalVersion - manifest.ArrangementFallBehind;
+            CountdownLatch pendingLatch(1);
+            ArrangementTask pendingTask = {
+                    TotalVersion - 1, &pendingLatch, FLAGS_BackgroundArrangement,
+            };
+            if (pendingArrangement) {
+                printf("------------------Pending Arrangement--------------------\n");
+                printf("Arrangement falls %lu versions behind, arrange them %s\n", manifest.ArrangementFallBehind,
+                       FLAGS_BackgroundArrangement ? "in background" : "in foreground");
+                layoutVersion = prepare_pending_arrangement(pendingTask, manifest.ArrangementFallBehind,
+                                                            pendingVersions, FLAGS_BackgroundArrangement);
+                // a background arrangement is committed after the backup, which commits first.
+                ManifestIntent::begin(IntentOperation::Arrangement, pendingTask.arrangementVersion,
+                                      manifest.Generation + (FLAGS_BackgroundArrangement ? 2 : 1));
+                gettimeofday(&at0, NULL);
+                GlobalArrangementReadPipelinePtr->addTask(&pendingTask);
+                if (!FLAGS_BackgroundArrangement) {
+                    pendingLatch.wait();
+                    gettimeofday(&at1, NULL);
+                    arrDuration += (at1.tv_sec - at0.tv_sec) * 1000000 + at1.tv_usec - at0.tv_usec;
+                    manifest.ArrangementFallBehind = TotalVersion - layoutVersion;
+                    save_index(manifest);
+                    do_commit(manifest);
+                    ArrangementJournal::clear();
+                    GlobalArrangementReadPipelinePtr->removeArrangedCategories(pendingTask.arrangementVersion,
+                                                                               pendingTask.arrangementVersions);
+                }
+            }
+
             TotalVersion++;
+            ManifestIntent::begin(IntentOperation::Backup, TotalVersion, manifest.Generation + 1);
             printf("-----------------------Backing up-----------------------\n");
             printf("Dedup Task: %s\n", workloadPath.data());
-            struct timeval t0, t1;
             gettimeofday(&t0, NULL);
 
-            taskLength = do_backup(workloadPath);
+            // a background arrangement leaves the layout as it is until its commit.
+            taskLength = do_backup(workloadPath, manifest.ArrangementFallBehind);
 
             gettimeofday(&t1, NULL);
             uint64_t singleDedup = (t1.tv_sec - t0.tv_sec) * 1000000 + t1.tv_usec - t0.tv_usec;
@@ -155,30 +428,59 @@ int main(int argc, char **argv) {
             GlobalWriteFilePipelinePtr->getStatistics();
 
             printf("----------------------Arrangement------------------------\n");
-            if (FLAGS_ApplyArrangement){
+            if (FLAGS_BackgroundArrangement && FLAGS_ApplyArrangement) {
+                // the new version is durable once its recipe and category are synced, commit it before waiting
+                // for the background arrangement. Its own arrangement is left to the next backup.
+                manifest.ArrangementFallBehind++;
+                save_index(manifest);
+                do_commit(manifest);
+                printf("Backup of version %lu committed, arrangement of version %lu is left to the next backup\n",
+                       TotalVersion, TotalVersion - 1);
+                if (pendingArrangement) {
+                    printf("Waiting for the background arrangement..\n");
+                    pendingLatch.wait();
+                    gettimeofday(&at1, NULL);
+                    arrDuration += (at1.tv_sec - at0.tv_sec) * 1000000 + at1.tv_usec - at0.tv_usec;
+                    manifest.ArrangementFallBehind = TotalVersion - layoutVersion;
+                    do_commit(manifest);
+                    ArrangementJournal::clear();
+                    GlobalArrangementReadPipelinePtr->removeArrangedCategories(pendingTask.arrangementVersion,
+                                                                               pendingTask.arrangementVersions);
+                    printf("Background arrangement duration : %lu\n", arrDuration);
+                }
+            } else if (FLAGS_ApplyArrangement && manifest.ArrangementFallBehind == 0 && schedule_arrangement(1)){
                 gettimeofday(&t0, NULL);
-                do_arrangement();
+                do_arrangement(manifest);
+                arrangedVersion = TotalVersion - 1;
                 gettimeofday(&t1, NULL);
                 uint64_t singleArr = (t1.tv_sec - t0.tv_sec) * 1000000 + t1.tv_usec - t0.tv_usec;
                 arrDuration += singleArr;
                 printf("Arrangement duration : %lu\n", singleArr);
             }else{
-                printf("Arrangement is disabled by user.\n");
+                printf("Arrangement is %s.\n", !FLAGS_ApplyArrangement ? "disabled by user" :
+                                                manifest.ArrangementFallBehind ? "behind" : "deferred by the policy");
                 manifest.ArrangementFallBehind++;
             }
 
             printf("------------------------Retention----------------------\n");
             if(TotalVersion > RetentionTime){
-                do_delete();
+                // elimination renames categories onto the ids of the arranged sources, which are removed first.
+                if (arrangedVersion) {
+                    GlobalArrangementReadPipelinePtr->removeArrangedCategories(arrangedVersion);
+                    arrangedVersion = 0;
+                }
+                do_delete(manifest);
             }else{
                 printf("Only %lu versions exist, and the retention is %lu, deletion is not required.\n", TotalVersion, RetentionTime);
             }
         }
 
         {
-            manifest.TotalVersion = TotalVersion;
-            ManifestWriter manifestWriter(manifest);
-            GlobalMetadataManagerPtr->save();
+            save_index(manifest);
+            do_commit(manifest);
+            if (arrangedVersion) {
+                GlobalArrangementReadPipelinePtr->removeArrangedCategories(arrangedVersion);
+            }
         }
 
         printf("==============================================\n");
@@ -203,17 +505,72 @@ int main(int argc, char **argv) {
         //------------------------------------------------------
 
     }
-    else if (FLAGS_task == restoreStr) {
-        do_restore(FLAGS_RestoreRecipe, manifest.ArrangementFallBehind);
+    else if (FLAGS_task == restoreStr || FLAGS_task == restorePlanStr) {
+        std::set<uint64_t> versions;
+        std::stringstream versionStream(FLAGS_RestoreRecipes);
+        std::string item;
+        while (std::getline(versionStream, item, ',')) {
+            versions.insert(strtoull(item.data(), nullptr, 10));
+        }
+        if (versions.empty()) {
+            versions.insert(FLAGS_RestoreRecipe);
+        }
+        if (FLAGS_task == restorePlanStr) {
+            do_restore_plan(std::vector<uint64_t>(versions.begin(), versions.end()), manifest.ArrangementFallBehind);
+        } else {
+            do_restore(std::vector<uint64_t>(versions.begin(), versions.end()), manifest.ArrangementFallBehind);
+        }
+    }
+    else if (FLAGS_task == arrangeStr) {
+        if (manifest.ArrangementFallBehind == 0) {
+            printf("Arrangement does not fall behind, skip\n");
+            return 0;
+        }
+        GlobalMetadataManagerPtr = new MetadataManager();
+        GlobalArrangementReadPipelinePtr = new ArrangementReadPipeline();
+        GlobalArrangementFilterPipelinePtr = new ArrangementFilterPipeline();
+        GlobalArrangementWritePipelinePtr = new ArrangementWritePipeline();
+        // the saved index keeps what is not rebuilt from recipes, e.g. super-features.
+        GlobalMetadataManagerPtr->load(indexPath(manifest.IndexGeneration));
+
+        printf("----------------------Catch-up Arrangement------------------------\n");
+        struct timeval t0, t1;
+        CountdownLatch arrangementLatch(1);
+        ArrangementTask arrangementTask = {
+                0, &arrangementLatch,
+        };
+        gettimeofday(&t0, NULL);
+        uint64_t layoutVersion = prepare_pending_arrangement(arrangementTask, manifest.ArrangementFallBehind,
+                                                             FLAGS_CatchUpVersions, false);
+        ManifestIntent::begin(IntentOperation::Arrangement, arrangementTask.arrangementVersion,
+                              manifest.Generation + 1);
+        GlobalArrangementReadPipelinePtr->addTask(&arrangementTask);
+        arrangementLatch.wait();
+        gettimeofday(&t1, NULL);
+        printf("Arrangement duration : %lu\n", (t1.tv_sec - t0.tv_sec) * 1000000 + t1.tv_usec - t0.tv_usec);
+
+        manifest.ArrangementFallBehind = TotalVersion - layoutVersion;
+        save_index(manifest);
+        do_commit(manifest);
+        ArrangementJournal::clear();
+        GlobalArrangementReadPipelinePtr->removeArrangedCategories(arrangementTask.arrangementVersion,
+                                                                   arrangementTask.arrangementVersions);
+        printf("Arrangement falls %lu versions behind now.\n", manifest.ArrangementFallBehind);
+
+        delete GlobalArrangementReadPipelinePtr;
+        delete GlobalArrangementFilterPipelinePtr;
+        delete GlobalArrangementWritePipelinePtr;
+        delete GlobalMetadataManagerPtr;
+    }
+    else if (FLAGS_task == scheduleStr) {
+        // estimates from recipes and category sizes only, nothing is arranged.
+        ArrangementScheduler scheduler(TotalVersion, manifest.ArrangementFallBehind);
+        scheduler.schedule();
+        scheduler.report();
     }
     else if (FLAGS_task == eliminateStr) {
-        Eliminator eliminator;
-        eliminator.run(TotalVersion);
-        TotalVersion--;
-        {
-            manifest.TotalVersion = TotalVersion;
-            ManifestWriter manifestWriter(manifest);
-        }
+        do_delete(manifest);
+        do_commit(manifest);
     }
     else if (FLAGS_task == statusStr) {
         printf("Totally %lu versions stored.\n", manifest.TotalVersion);
@@ -224,9 +581,20 @@ int main(int argc, char **argv) {
         printf("Usage: MFDedup [args..]\n");
         printf("1. Write a series of versions into system\n");
         printf("./MFDedup --ConfigFile=[config file] --task=write --InputFile=[backup workload]\n");
+        printf("   with --BackgroundArrangement=true, the arrangement of the previous version overlaps the next backup\n");
         printf("2. Restore a version of from the system\n");
         printf("./MFDedup --ConfigFile=config.toml --task=restore --RestorePath=[where the restored file is to locate] --RestoreRecipe=[which version to restore(1 ~ no. of the last retained version)]\n");
-        printf("3. Check status of the system\n");
+        printf("   with --RestoreRecipes=[versions, e.g. 3,4,5] --RestorePath=[pattern, e.g. restored%%lu], several versions are restored in one pass\n");
+        printf("   with --RestoreBase=[version which the restore path holds], only chunks differing from it are written\n");
+        printf("   with --RestoreOffset=[offset] --RestoreLength=[length], only a byte range of the version is restored\n");
+        printf("   with --RestorePath=-, a pipe or a device, the version is streamed in order, e.g. into tar\n");
+        printf("   with --task=restore-plan, the files and extents to read and the estimated duration are printed as JSON\n");
+        printf("3. Catch up arrangement which falls behind, in one pass\n");
+        printf("./MFDedup --ConfigFile=[config file] --task=arrange [--CatchUpVersions=(0 means all)]\n");
+        printf("   with --ArrangementPolicy=cost, a write arranges only when it saves more restore reads than it costs\n");
+        printf("4. Report the arrangement schedule under the policy\n");
+        printf("./MFDedup --ConfigFile=[config file] --task=schedule [--ArrangementPolicy=cost]\n");
+        printf("5. Check status of the system\n");
         printf("./MFDedup --task=status\n");
         printf("--------------------------------------------------\n");
         printf("more information with --help\n");